@@ -0,0 +1,247 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+/* the first chunk, the next ones double */
+#define CHUNK_SIZE ((size_t)1 << 20)
+
+#define HUGE_PAGE_SIZE ((size_t)1 << 21)
+
+/* keeps allocations aligned */
+#define HEADER_SIZE ARENA_ALIGNMENT
+
+struct chunk
+{
+    struct chunk *next;
+
+    /* including the header */
+    size_t size;
+    size_t used;
+};
+
+/* precedes each allocation */
+struct header
+{
+    /* including the header */
+    size_t size;
+};
+
+static size_t align_up(size_t n, size_t a)
+{
+    return (n + (a - 1)) / a * a;
+}
+
+static void *aligned_malloc(size_t size, void *opaque)
+{
+    void *ptr;
+
+    (void)opaque;
+
+    if (posix_memalign(&ptr, ARENA_ALIGNMENT, size) != 0)
+    {
+        return NULL;
+    }
+
+    return ptr;
+}
+
+static void aligned_free(void *ptr, size_t size, void *opaque)
+{
+    (void)size;
+    (void)opaque;
+
+    free(ptr);
+}
+
+/* explicit huge pages if reserved by the system, transparent huge pages otherwise */
+static void *huge_pages_alloc(size_t size, void *opaque)
+{
+    void *ptr = MAP_FAILED;
+
+    (void)opaque;
+
+#ifdef MAP_HUGETLB
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+
+    if (ptr == MAP_FAILED)
+    {
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (ptr == MAP_FAILED)
+        {
+            return NULL;
+        }
+
+#ifdef MADV_HUGEPAGE
+        madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+    }
+
+    return ptr;
+}
+
+static void huge_pages_free(void *ptr, size_t size, void *opaque)
+{
+    (void)opaque;
+
+    munmap(ptr, size);
+}
+
+void arena_init(struct arena *arena, const struct allocator *allocator, int flags)
+{
+    assert(arena != NULL);
+
+    if (allocator != NULL)
+    {
+        arena->allocator = *allocator;
+    }
+    else
+    {
+        arena->allocator.alloc = (flags & ARENA_HUGE_PAGES) ? huge_pages_alloc : aligned_malloc;
+        arena->allocator.free = (flags & ARENA_HUGE_PAGES) ? huge_pages_free : aligned_free;
+        arena->allocator.opaque = NULL;
+    }
+
+    arena->flags = flags;
+    arena->chunks = NULL;
+    arena->allocations = 0;
+}
+
+static struct chunk *new_chunk(struct arena *arena, size_t size)
+{
+    if (arena->flags & ARENA_HUGE_PAGES)
+    {
+        size = align_up(size, HUGE_PAGE_SIZE);
+    }
+
+    struct chunk *chunk = arena->allocator.alloc(size, arena->allocator.opaque);
+
+    if (chunk == NULL)
+    {
+        return NULL;
+    }
+
+    arena->allocations++;
+
+    chunk->next = arena->chunks;
+    chunk->size = size;
+    chunk->used = HEADER_SIZE;
+
+    arena->chunks = chunk;
+
+    return chunk;
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    assert(arena != NULL);
+
+    size_t need = HEADER_SIZE + align_up(size, ARENA_ALIGNMENT);
+
+    struct chunk *chunk = arena->chunks;
+
+    if (chunk == NULL || chunk->used + need > chunk->size)
+    {
+        size_t chunk_size = chunk != NULL ? 2 * chunk->size : CHUNK_SIZE;
+
+        if (chunk_size < HEADER_SIZE + need)
+        {
+            chunk_size = HEADER_SIZE + need;
+        }
+
+        chunk = new_chunk(arena, chunk_size);
+
+        if (chunk == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    char *base = (char *)chunk + chunk->used;
+
+    ((struct header *)base)->size = need;
+
+    chunk->used += need;
+
+    return base + HEADER_SIZE;
+}
+
+void arena_free(struct arena *arena, void *ptr)
+{
+    assert(arena != NULL);
+
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    struct chunk *chunk = arena->chunks;
+    char *base = (char *)ptr - HEADER_SIZE;
+
+    /* not in use in the current chunk (e.g., after arena_reset) */
+    if (chunk == NULL || base < (char *)chunk || base >= (char *)chunk + chunk->used)
+    {
+        return;
+    }
+
+    size_t size = ((struct header *)base)->size;
+
+    /* the most recent allocation */
+    if (base + size == (char *)chunk + chunk->used)
+    {
+        chunk->used -= size;
+    }
+}
+
+void arena_reset(struct arena *arena)
+{
+    assert(arena != NULL);
+
+    struct chunk *chunk = arena->chunks;
+
+    if (chunk == NULL)
+    {
+        return;
+    }
+
+    /* the arena has grown, merge the chunks so that the next image fits in a single one */
+    if (chunk->next != NULL)
+    {
+        size_t size = 0;
+
+        for (; chunk != NULL; chunk = chunk->next)
+        {
+            size += chunk->size;
+        }
+
+        arena_destroy(arena);
+
+        /* on failure, chunks are allocated on demand again */
+        new_chunk(arena, size);
+
+        return;
+    }
+
+    chunk->used = HEADER_SIZE;
+}
+
+void arena_destroy(struct arena *arena)
+{
+    assert(arena != NULL);
+
+    struct chunk *chunk = arena->chunks;
+
+    while (chunk != NULL)
+    {
+        struct chunk *next = chunk->next;
+
+        arena->allocator.free(chunk, chunk->size, arena->allocator.opaque);
+
+        chunk = next;
+    }
+
+    arena->chunks = NULL;
+}
@@ -0,0 +1,59 @@
+#ifndef JPEG_ARENA_H
+#define JPEG_ARENA_H
+
+#include <stddef.h>
+
+/* all allocations are aligned to cache lines */
+#define ARENA_ALIGNMENT 64
+
+/* back the arena by (transparent) huge pages */
+#define ARENA_HUGE_PAGES 1
+
+/*
+ * where the arena gets its memory from (pluggable)
+ *
+ * alloc() must return memory aligned to ARENA_ALIGNMENT, or NULL
+ */
+struct allocator
+{
+    void *(*alloc)(size_t size, void *opaque);
+    void (*free)(void *ptr, size_t size, void *opaque);
+    void *opaque;
+};
+
+struct chunk;
+
+/*
+ * per-image buffers are carved out of few large chunks,
+ * arena_reset() returns them all at once while keeping the capacity,
+ * so that a sequence of similar images reaches a steady state without allocations
+ */
+struct arena
+{
+    struct allocator allocator;
+
+    int flags;
+
+    /* the current chunk is the first one */
+    struct chunk *chunks;
+
+    /* calls to allocator.alloc() so far */
+    size_t allocations;
+};
+
+/* allocator may be NULL (aligned malloc or mmap) */
+void arena_init(struct arena *arena, const struct allocator *allocator, int flags);
+
+/* ARENA_ALIGNMENT aligned */
+void *arena_alloc(struct arena *arena, size_t size);
+
+/* the memory is reclaimed only when ptr is the most recent allocation (LIFO), otherwise at arena_reset() */
+void arena_free(struct arena *arena, void *ptr);
+
+/* release all allocations, keep the capacity */
+void arena_reset(struct arena *arena);
+
+/* release the memory back to the allocator */
+void arena_destroy(struct arena *arena);
+
+#endif
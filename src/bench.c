@@ -0,0 +1,1751 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "common.h"
+#include "coeffs.h"
+#include "io.h"
+#include "huffman.h"
+#include "hcache.h"
+#include "imgproc.h"
+#include "frame.h"
+#include "pool.h"
+#include "jpegm.h"
+
+/* command line parameters */
+struct params
+{
+    /* image size */
+    uint16_t Y, X;
+
+    /* luma subsampling */
+    uint8_t H, V;
+
+    /* number of runs, the best one is reported */
+    int runs;
+};
+
+static void init_params(struct params *params)
+{
+    assert(params != NULL);
+
+    params->Y = 2048;
+    params->X = 2048;
+
+    params->H = 2;
+    params->V = 2;
+
+    params->runs = 3;
+}
+
+double get_time()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/* YCbCr frame as if parsed from SOF, the context has been initialized */
+int setup_context(struct context *context, struct params *params, int fused)
+{
+    int err;
+
+    err = reset_context(context);
+    RETURN_IF(err);
+
+    context->P = 8;
+    context->Y = params->Y;
+    context->X = params->X;
+    context->Nf = 3;
+
+    for (int i = 0; i < 3; ++i)
+    {
+        context->component[i].C = i + 1;
+        context->component[i].H = i == 0 ? params->H : 1;
+        context->component[i].V = i == 0 ? params->V : 1;
+        context->component[i].Tq = i == 0 ? 0 : 1;
+    }
+
+    context->max_H = params->H;
+    context->max_V = params->V;
+
+    uint16_t Q[2][64];
+
+    for (int j = 0; j < 64; ++j)
+    {
+        Q[0][j] = (uint16_t)(4 + j % 8 + j / 8);
+        Q[1][j] = (uint16_t)(8 + j % 8 + j / 8);
+    }
+
+    update_qtable(&context->qtable[0], 0, Q[0]);
+    update_qtable(&context->qtable[1], 0, Q[1]);
+
+    if (fused)
+    {
+        context->m_rows = 1;
+        context->fused = 1;
+    }
+
+    err = compute_no_blocks_and_alloc_buffers(context);
+    RETURN_IF(err);
+
+    return RET_SUCCESS;
+}
+
+/* sparse coefficients, standing in for the output of the entropy decoder */
+struct int_block *create_coefficients(struct component *component)
+{
+    size_t blocks = component->b_x * component->b_y;
+
+    struct int_block *source = malloc(sizeof(struct int_block) * blocks);
+
+    if (source == NULL)
+    {
+        return NULL;
+    }
+
+    for (size_t b = 0; b < blocks; ++b)
+    {
+        memset(&source[b], 0, sizeof(struct int_block));
+
+        source[b].c[0] = rand() % 64 - 32;
+
+        for (int k = 1; k < 6; ++k)
+        {
+            source[b].c[zigzag[rand() % 16]] = rand() % 16 - 8;
+        }
+    }
+
+    return source;
+}
+
+/* intermediate buffers */
+size_t buffers_size(struct context *context, struct frame *frame)
+{
+    size_t size = sizeof(float) * frame->components * frame->size_x * frame->size_y;
+
+    for (int i = 0; i < context->Nf; ++i)
+    {
+        struct component *component = &context->component[i];
+
+        if (component->frame_buffer != NULL)
+        {
+            size_t blocks = component->b_x * context->m_rows * component->V;
+
+            size += sizeof(float) * 64 * blocks;
+
+            if (component->int_buffer != NULL)
+            {
+                size += (sizeof(struct int_block) + sizeof(struct flt_block)) * blocks;
+            }
+        }
+    }
+
+    return size;
+}
+
+/* the current epilogue: each stage walks all blocks of all components */
+int epilogue_phased(struct context *context, struct int_block *source[MAX_COMPONENTS], size_t *size)
+{
+    int err;
+
+    struct frame frame;
+
+    for (int i = 0; i < context->Nf; ++i)
+    {
+        struct component *component = &context->component[i];
+
+        if (source[i] != NULL)
+        {
+            memcpy(component->int_buffer, source[i], sizeof(struct int_block) * component->b_x * component->b_y);
+        }
+    }
+
+    err = dequantize(context);
+    RETURN_IF(err);
+    err = inverse_dct(context);
+    RETURN_IF(err);
+    err = conv_blocks_to_frame(context);
+    RETURN_IF(err);
+
+    err = frame_create(context, &frame);
+    RETURN_IF(err);
+
+    err = frame_to_rgb(&frame);
+
+    *size = buffers_size(context, &frame);
+
+    frame_destroy(&frame);
+
+    return err;
+}
+
+/* fused: each block is reconstructed while hot, the samples live in a single MCU row */
+int epilogue_fused(struct context *context, struct int_block *source[MAX_COMPONENTS], size_t *size)
+{
+    int err;
+
+    struct frame band;
+
+    err = frame_create_band(context, &band);
+    RETURN_IF(err);
+
+    for (size_t y = 0; y < context->m_y; ++y)
+    {
+        for (size_t x = 0; x < context->m_x; ++x)
+        {
+            for (int i = 0; i < context->Nf; ++i)
+            {
+                struct component *component = &context->component[i];
+
+                if (source[i] == NULL)
+                {
+                    continue;
+                }
+
+                for (int v = 0; v < component->V; ++v)
+                {
+                    for (int h = 0; h < component->H; ++h)
+                    {
+                        size_t block_x = x * component->H + h;
+                        size_t block_y = y * component->V + v;
+
+                        struct int_block scratch = source[i][block_y * component->b_x + block_x];
+
+                        reconstruct_block(context, component, &scratch, block_x, block_y);
+                    }
+                }
+            }
+        }
+
+        transform_mcu_row_to_frame(context, &band, y);
+
+        band.Y = (uint16_t)(context->Y - y * band.size_y < band.size_y ? context->Y - y * band.size_y : band.size_y);
+
+        err = frame_to_rgb(&band);
+
+        if (err)
+        {
+            break;
+        }
+    }
+
+    *size = buffers_size(context, &band);
+
+    frame_destroy(&band);
+
+    return err;
+}
+
+/* phase-by-phase epilogue() vs. per-MCU fused decoding */
+int bench_epilogue(struct params *params)
+{
+    int err;
+
+    struct context *context = malloc(sizeof(struct context));
+
+    if (context == NULL)
+    {
+        return RET_FAILURE_MEMORY_ALLOCATION;
+    }
+
+    struct int_block *source[MAX_COMPONENTS] = { NULL };
+
+    const char *name[2] = { "phase-by-phase", "fused" };
+    double best[2] = { 0., 0. };
+    size_t size[2] = { 0, 0 };
+
+    err = init_context(context);
+
+    if (err)
+    {
+        goto end;
+    }
+
+    for (int fused = 0; fused < 2; ++fused)
+    {
+        err = setup_context(context, params, fused);
+
+        if (err)
+        {
+            goto end;
+        }
+
+        for (int i = 0; i < context->Nf; ++i)
+        {
+            if (source[i] == NULL)
+            {
+                source[i] = create_coefficients(&context->component[i]);
+
+                if (source[i] == NULL)
+                {
+                    err = RET_FAILURE_MEMORY_ALLOCATION;
+                    goto end;
+                }
+            }
+        }
+
+        for (int r = 0; r < params->runs; ++r)
+        {
+            double t = get_time();
+
+            err = fused ? epilogue_fused(context, source, &size[fused]) : epilogue_phased(context, source, &size[fused]);
+
+            if (err)
+            {
+                goto end;
+            }
+
+            t = get_time() - t;
+
+            if (r == 0 || t < best[fused])
+            {
+                best[fused] = t;
+            }
+        }
+
+        free_buffers(context);
+    }
+
+    for (int fused = 0; fused < 2; ++fused)
+    {
+        printf("epilogue %-14s: %8.3f ms, %8zu KiB of intermediate buffers\n", name[fused], best[fused] * 1e3, size[fused] / 1024);
+    }
+
+    printf("epilogue buffers reduced %.1fx, time %.2fx\n", (double)size[0] / (double)size[1], best[0] / best[1]);
+
+end:
+    for (int i = 0; i < MAX_COMPONENTS; ++i)
+    {
+        free(source[i]);
+    }
+
+    free_context(context);
+
+    free(context);
+
+    return err;
+}
+
+/* per-image setup: init_context() vs. reset_context() of a used context */
+int bench_context(void)
+{
+    int err;
+
+    struct context *context = malloc(sizeof(struct context));
+
+    if (context == NULL)
+    {
+        return RET_FAILURE_MEMORY_ALLOCATION;
+    }
+
+    const int loops = 10000;
+
+    double t = get_time();
+
+    for (int l = 0; l < loops; ++l)
+    {
+        err = init_context(context);
+
+        if (err)
+        {
+            goto end;
+        }
+    }
+
+    double t_init = (get_time() - t) / loops;
+
+    t = get_time();
+
+    for (int l = 0; l < loops; ++l)
+    {
+        const struct hcode *hcode;
+
+        err = reset_context(context);
+
+        if (err)
+        {
+            goto end;
+        }
+
+        /* the tables an image would use */
+        for (int j = 0; j < 2; ++j)
+        {
+            for (int i = 0; i < 2; ++i)
+            {
+                err = get_hcode(context, j, i, &hcode);
+
+                if (err)
+                {
+                    goto end;
+                }
+            }
+        }
+    }
+
+    double t_reset = (get_time() - t) / loops;
+
+    printf("context %zu bytes: init_context %.3f us, reset_context + tables %.3f us\n", sizeof(struct context), t_init * 1e6, t_reset * 1e6);
+
+    /* the same tables in DHT segments of every image: shared tables vs. building them */
+    double t_dht[2];
+
+    for (int shared = 0; shared < 2; ++shared)
+    {
+        t = get_time();
+
+        for (int l = 0; l < loops; ++l)
+        {
+            const struct hcode *hcode;
+
+            /* built by each image */
+            struct hcode built;
+
+            err = reset_context(context);
+
+            if (err)
+            {
+                goto end;
+            }
+
+            for (int j = 0; j < 2; ++j)
+            {
+                for (int i = 0; i < 2; ++i)
+                {
+                    /* parse_huffman_tables() */
+                    set_htable(context, j, i);
+
+                    if (shared)
+                    {
+                        err = get_hcode(context, j, i, &hcode);
+                    }
+                    else
+                    {
+                        err = conv_htable_to_hcode(&context->htable[j][i], &built);
+                    }
+
+                    if (err)
+                    {
+                        goto end;
+                    }
+                }
+            }
+        }
+
+        t_dht[shared] = (get_time() - t) / loops;
+    }
+
+    size_t hits, misses;
+
+    hcache_stats(&hits, &misses);
+
+    printf("context DHT tables: built %.3f us, shared %.3f us (%zu hits, %zu misses)\n", t_dht[0] * 1e6, t_dht[1] * 1e6, hits, misses);
+
+end:
+    free_context(context);
+
+    free(context);
+
+    return err;
+}
+
+/* the serial prologue of jpegmenc after read_image() */
+int prologue_phased(struct context *context, struct frame *frame)
+{
+    int err;
+
+    err = frame_to_ycc(frame);
+    RETURN_IF(err);
+
+    transform_frame_to_components(context, frame);
+
+    err = conv_frame_to_blocks(context);
+    RETURN_IF(err);
+    err = forward_dct(context);
+    RETURN_IF(err);
+    err = quantize(context);
+    RETURN_IF(err);
+
+    return RET_SUCCESS;
+}
+
+/* same coefficients as the serial prologue */
+int same_coefficients(struct context *context, struct int_block *expected[MAX_COMPONENTS])
+{
+    for (int i = 0; i < context->Nf; ++i)
+    {
+        struct component *component = &context->component[i];
+
+        if (memcmp(component->int_buffer, expected[i], sizeof(struct int_block) * component->b_x * component->b_y) != 0)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* serial prologue vs. MCU-row bands on 1, 2, 4, ... threads (up to the online processors) */
+int bench_prologue(struct params *params)
+{
+    int err;
+
+    struct context *context = malloc(sizeof(struct context));
+
+    if (context == NULL)
+    {
+        return RET_FAILURE_MEMORY_ALLOCATION;
+    }
+
+    struct int_block *expected[MAX_COMPONENTS] = { NULL };
+    float *source = NULL;
+    struct frame frame;
+
+    err = init_context(context);
+
+    if (err)
+    {
+        goto end;
+    }
+
+    err = setup_context(context, params, 0);
+
+    if (err)
+    {
+        goto end;
+    }
+
+    frame.components = 3;
+    frame.Y = context->Y;
+    frame.X = context->X;
+    frame.precision = 8;
+
+    err = frame_create_empty(context, &frame);
+
+    if (err)
+    {
+        goto end;
+    }
+
+    size_t size = sizeof(float) * frame.components * frame.size_x * frame.size_y;
+
+    /* RGB samples, standing in for read_image() */
+    source = malloc(size);
+
+    if (source == NULL)
+    {
+        err = RET_FAILURE_MEMORY_ALLOCATION;
+        goto end;
+    }
+
+    for (size_t j = 0; j < size / sizeof(float); ++j)
+    {
+        source[j] = (float)(rand() % 256);
+    }
+
+    double serial = 0.;
+
+    for (int r = 0; r < params->runs; ++r)
+    {
+        memcpy(frame.data, source, size);
+
+        double t = get_time();
+
+        err = prologue_phased(context, &frame);
+
+        if (err)
+        {
+            goto end;
+        }
+
+        t = get_time() - t;
+
+        if (r == 0 || t < serial)
+        {
+            serial = t;
+        }
+    }
+
+    for (int i = 0; i < context->Nf; ++i)
+    {
+        struct component *component = &context->component[i];
+
+        size_t blocks = component->b_x * component->b_y;
+
+        expected[i] = malloc(sizeof(struct int_block) * blocks);
+
+        if (expected[i] == NULL)
+        {
+            err = RET_FAILURE_MEMORY_ALLOCATION;
+            goto end;
+        }
+
+        memcpy(expected[i], component->int_buffer, sizeof(struct int_block) * blocks);
+    }
+
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+
+    printf("prologue serial        : %8.3f ms\n", serial * 1e3);
+
+    for (int threads = 1; threads <= online || threads == 1; threads *= 2)
+    {
+        struct pool *pool;
+
+        err = pool_create(&pool, threads);
+
+        if (err)
+        {
+            goto end;
+        }
+
+        context->pool = pool;
+
+        double best = 0.;
+        int same = 1;
+
+        for (int r = 0; r < params->runs; ++r)
+        {
+            memcpy(frame.data, source, size);
+
+            for (int i = 0; i < context->Nf; ++i)
+            {
+                memset(context->component[i].int_buffer, 0, sizeof(struct int_block) * context->component[i].b_x * context->component[i].b_y);
+            }
+
+            double t = get_time();
+
+            err = frame_decompose(context, &frame);
+
+            t = get_time() - t;
+
+            if (err)
+            {
+                break;
+            }
+
+            same &= same_coefficients(context, expected);
+
+            if (r == 0 || t < best)
+            {
+                best = t;
+            }
+        }
+
+        context->pool = NULL;
+
+        pool_destroy(pool);
+
+        if (err)
+        {
+            goto end;
+        }
+
+        printf("prologue %2i threads    : %8.3f ms, speedup %.2fx, %s\n", threads, best * 1e3, serial / best, same ? "identical" : "DIFFERENT");
+    }
+
+end:
+    for (int i = 0; i < MAX_COMPONENTS; ++i)
+    {
+        free(expected[i]);
+    }
+
+    free(source);
+
+    free_context(context);
+
+    free(context);
+
+    return err;
+}
+
+/* the allocator of glibc, under the counting functions below */
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+/* the calls of malloc() and its relatives in the whole program, those of the C library (e.g., fmemopen()) included */
+static size_t malloc_calls;
+
+void *malloc(size_t size)
+{
+    __atomic_add_fetch(&malloc_calls, 1, __ATOMIC_RELAXED);
+
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    __atomic_add_fetch(&malloc_calls, 1, __ATOMIC_RELAXED);
+
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __atomic_add_fetch(&malloc_calls, 1, __ATOMIC_RELAXED);
+
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    __atomic_add_fetch(&malloc_calls, 1, __ATOMIC_RELAXED);
+
+    void *p = __libc_memalign(alignment, size);
+
+    if (p == NULL)
+    {
+        return ENOMEM;
+    }
+
+    *ptr = p;
+
+    return 0;
+}
+
+/* counts the calls reaching the system allocator */
+struct counter
+{
+    size_t allocs;
+
+    /* currently reserved */
+    size_t bytes;
+};
+
+static void *counting_alloc(size_t size, void *opaque)
+{
+    struct counter *counter = opaque;
+    void *ptr;
+
+    if (posix_memalign(&ptr, ARENA_ALIGNMENT, size) != 0)
+    {
+        return NULL;
+    }
+
+    counter->allocs++;
+    counter->bytes += size;
+
+    return ptr;
+}
+
+static void counting_free(void *ptr, size_t size, void *opaque)
+{
+    struct counter *counter = opaque;
+
+    counter->bytes -= size;
+
+    free(ptr);
+}
+
+/* a sequence of images of growing size: allocator calls per image, the arena reaches a steady state */
+int bench_arena(struct params *params)
+{
+    int err;
+
+    struct context *context = malloc(sizeof(struct context));
+
+    if (context == NULL)
+    {
+        return RET_FAILURE_MEMORY_ALLOCATION;
+    }
+
+    struct counter counter = { 0, 0 };
+    struct allocator allocator = { counting_alloc, counting_free, &counter };
+
+    err = init_context(context);
+
+    if (err)
+    {
+        goto end;
+    }
+
+    /* replace the default allocator */
+    arena_init(&context->arena, &allocator, 0);
+
+    const int images = 8;
+
+    for (int n = 0; n < images; ++n)
+    {
+        struct params image = *params;
+        struct frame frame;
+
+        /* the first images are smaller */
+        image.X = (uint16_t)(params->X / (n < 3 ? 4 - n : 1));
+        image.Y = (uint16_t)(params->Y / (n < 3 ? 4 - n : 1));
+
+        size_t allocs = counter.allocs;
+
+        double t = get_time();
+
+        err = setup_context(context, &image, 0);
+
+        if (err)
+        {
+            goto end;
+        }
+
+        err = frame_create(context, &frame);
+
+        if (err)
+        {
+            goto end;
+        }
+
+        frame_destroy(&frame);
+
+        t = get_time() - t;
+
+        printf("arena image %i (%ux%u): %zu allocator calls, %zu KiB reserved, setup %.3f ms\n", n, image.X, image.Y, counter.allocs - allocs, counter.bytes / 1024, t * 1e3);
+    }
+
+end:
+    free_context(context);
+
+    free(context);
+
+    return err;
+}
+
+/* sum of FREQ(V) * code length */
+static size_t table_cost(const struct htable *htable, const size_t *freq)
+{
+    size_t cost = 0;
+
+    for (int k = 0, i = 0; i < 16; ++i)
+    {
+        for (int l = 0; l < htable->L[i]; ++l, ++k)
+        {
+            cost += freq[htable->V[k]] * (size_t)(i + 1);
+        }
+    }
+
+    return cost;
+}
+
+/* RGB test pattern of params->X by params->Y pixels, release it by free(image->pixels) */
+static int create_image(struct jpegm_image *image, struct params *params)
+{
+    jpegm_init_image(image);
+
+    image->width = params->X;
+    image->height = params->Y;
+    image->precision = 8;
+    image->format = JPEGM_FORMAT_RGB;
+    image->stride = (size_t)image->width * 3;
+    image->pixels = malloc(image->stride * image->height);
+
+    if (image->pixels == NULL)
+    {
+        return RET_FAILURE_MEMORY_ALLOCATION;
+    }
+
+    for (size_t y = 0; y < image->height; ++y)
+    {
+        uint8_t *row = (uint8_t *)image->pixels + y * image->stride;
+
+        for (size_t x = 0; x < image->width; ++x)
+        {
+            row[3 * x + 0] = (uint8_t)(x ^ y);
+            row[3 * x + 1] = (uint8_t)(x + y);
+            row[3 * x + 2] = (uint8_t)(x * y >> 4);
+        }
+    }
+
+    return RET_SUCCESS;
+}
+
+/* the file bytes (with the stuffed zero bytes) of the test pattern at some qualities, the tables by K.2 (optimize = 2) vs. package-merge */
+static int compare_file_bytes(struct params *params)
+{
+    int err;
+
+    struct jpegm_image image;
+
+    err = create_image(&image, params);
+    RETURN_IF(err);
+
+    const int quality[4] = { 50, 75, 90, 95 };
+
+    size_t total[2] = { 0, 0 };
+    int larger = 0;
+
+    for (int n = 0; n < 4; ++n)
+    {
+        size_t size[2];
+
+        for (int a = 0; a < 2; ++a)
+        {
+            struct jpegm_encode_opts opts;
+
+            jpegm_init_encode_opts(&opts);
+
+            opts.H = params->H;
+            opts.V = params->V;
+            opts.quality = quality[n];
+            opts.optimize = a == 0 ? 2 : 1;
+
+            struct jpegm_buffer buffer = { NULL, 0, 0 };
+
+            err = jpegm_encode(&image, &opts, &buffer);
+
+            size[a] = buffer.size;
+
+            free(buffer.data);
+
+            if (err)
+            {
+                goto end;
+            }
+
+            total[a] += size[a];
+        }
+
+        if (size[1] > size[0])
+        {
+            larger++;
+        }
+    }
+
+    /* the code lengths are never longer, where the 0xFF bytes of the codes (and the stuffing) outweigh that the K.2 tables are kept */
+    printf("huffman file bytes: K.2 %zu, package-merge %zu (larger at %i of 4 qualities)\n", total[0], total[1], larger);
+
+    if (larger > 0)
+    {
+        err = RET_FAILURE_LOGIC_ERROR;
+    }
+
+end:
+    free(image.pixels);
+
+    return err;
+}
+
+/* random symbol counts, geometric-like as for the AC values, some of them very skewed */
+static void random_histogram(struct huffenc *huffenc, int symbols)
+{
+    init_huffenc(huffenc);
+
+    size_t scale = (size_t)1 << (rand() % 24);
+
+    for (int k = 0; k < symbols; ++k)
+    {
+        int v = rand() % 256;
+
+        huffenc->freq[v] += 1 + scale / (size_t)(1 + k * (1 + rand() % 8));
+    }
+}
+
+/* the Annex K.2 procedure vs. package-merge: time per table, the total code length and the file bytes */
+int bench_huffman(struct params *params)
+{
+    int err;
+    const int tables = 4096;
+
+    struct huffenc *input = malloc(sizeof(struct huffenc) * tables);
+    struct huffenc *huffenc = malloc(sizeof(struct huffenc));
+
+    if (input == NULL || huffenc == NULL)
+    {
+        free(input);
+        free(huffenc);
+        return RET_FAILURE_MEMORY_ALLOCATION;
+    }
+
+    srand(1);
+
+    for (int n = 0; n < tables; ++n)
+    {
+        /* from a DC table up to a full AC table */
+        random_histogram(&input[n], 1 + rand() % 256);
+    }
+
+    const char *name[2] = { "K.2", "package-merge" };
+    int (*adapt[2])(struct htable *, struct huffenc *) = { adapt_huffman_table_k2, adapt_huffman_table };
+
+    for (int a = 0; a < 2; ++a)
+    {
+        double best = 0.;
+        size_t cost = 0;
+
+        for (int r = 0; r < params->runs; ++r)
+        {
+            double t = get_time();
+
+            cost = 0;
+
+            for (int n = 0; n < tables; ++n)
+            {
+                struct htable htable;
+
+                *huffenc = input[n];
+
+                err = adapt[a](&htable, huffenc);
+
+                if (err)
+                {
+                    goto end;
+                }
+
+                cost += table_cost(&htable, input[n].freq);
+            }
+
+            t = get_time() - t;
+
+            if (r == 0 || t < best)
+            {
+                best = t;
+            }
+        }
+
+        printf("huffman %s: %.3f us per table, %zu bits total\n", name[a], best / tables * 1e6, cost);
+    }
+
+    /* package-merge is optimal, never worse than K.2 */
+    for (int n = 0; n < tables; ++n)
+    {
+        struct htable htable[2];
+
+        for (int a = 0; a < 2; ++a)
+        {
+            *huffenc = input[n];
+
+            err = adapt[a](&htable[a], huffenc);
+
+            if (err)
+            {
+                goto end;
+            }
+        }
+
+        if (table_cost(&htable[1], input[n].freq) > table_cost(&htable[0], input[n].freq))
+        {
+            printf("huffman: table %i is longer than K.2\n", n);
+            err = RET_FAILURE_LOGIC_ERROR;
+            goto end;
+        }
+    }
+
+    err = compare_file_bytes(params);
+
+end:
+    free(huffenc);
+    free(input);
+
+    return err;
+}
+
+/* the entropy-coded bytes of an image: one fwrite() per byte (as before) vs. memory and file sinks */
+int bench_sink(struct params *params)
+{
+    int err = RET_SUCCESS;
+
+    size_t bytes = (size_t)params->X * params->Y;
+
+    FILE *stream = tmpfile();
+
+    if (stream == NULL)
+    {
+        return RET_FAILURE_FILE_OPEN;
+    }
+
+    double best[3] = { 0., 0., 0. };
+
+    for (int r = 0; r < params->runs; ++r)
+    {
+        for (int kind = 0; kind < 3; ++kind)
+        {
+            struct sink sink;
+
+            rewind(stream);
+
+            if (kind == 0)
+            {
+                init_sink_memory(&sink);
+            }
+            else if (kind == 1)
+            {
+                err = init_sink_file(&sink, fileno(stream));
+
+                if (err)
+                {
+                    goto end;
+                }
+            }
+
+            double t = get_time();
+
+            for (size_t n = 0; n < bytes && !err; ++n)
+            {
+                uint8_t byte = (uint8_t)(n * 7);
+
+                if (kind < 2)
+                {
+                    err = write_ecs_byte(&sink, byte);
+                }
+                else if (fwrite(&byte, 1, 1, stream) != 1 || (byte == 0xff && fwrite("", 1, 1, stream) != 1))
+                {
+                    err = RET_FAILURE_FILE_IO;
+                }
+            }
+
+            if (!err && kind < 2)
+            {
+                err = sink_flush(&sink);
+            }
+            else if (!err)
+            {
+                err = fflush(stream) != 0 ? RET_FAILURE_FILE_IO : RET_SUCCESS;
+            }
+
+            t = get_time() - t;
+
+            if (kind < 2)
+            {
+                free_sink(&sink);
+            }
+
+            if (err)
+            {
+                goto end;
+            }
+
+            if (r == 0 || t < best[kind])
+            {
+                best[kind] = t;
+            }
+        }
+    }
+
+    printf("sink %zu bytes: memory %.3f ms, file %.3f ms, fwrite per byte %.3f ms\n", bytes, best[0] * 1e3, best[1] * 1e3, best[2] * 1e3);
+
+end:
+    fclose(stream);
+
+    return err;
+}
+
+struct api_job
+{
+    const struct jpegm_buffer *buffer;
+    struct jpegm_image image;
+    int err;
+};
+
+static void *api_decode(void *arg)
+{
+    struct api_job *job = arg;
+
+    jpegm_init_image(&job->image);
+
+    job->err = jpegm_decode(job->buffer->data, job->buffer->size, &job->image, NULL);
+
+    return NULL;
+}
+
+/* a 12-bit grey step edge through jpegm_encode() and jpegm_decode(), other precisions are refused */
+static int api_precision(void)
+{
+    int err;
+
+    enum { SIZE = 64 };
+
+    static uint16_t samples[SIZE * SIZE];
+
+    for (int y = 0; y < SIZE; ++y)
+    {
+        for (int x = 0; x < SIZE; ++x)
+        {
+            /* the edge within a block, the full range of DC differences */
+            samples[y * SIZE + x] = (uint16_t)(x < SIZE / 2 - 3 ? y * 32 : 4095 - y * 32);
+        }
+    }
+
+    struct jpegm_image image;
+
+    jpegm_init_image(&image);
+
+    image.width = SIZE;
+    image.height = SIZE;
+    image.precision = 12;
+    image.format = JPEGM_FORMAT_GREY;
+    image.pixels = samples;
+
+    struct jpegm_buffer buffer = { NULL, 0, 0 };
+
+    err = jpegm_encode(&image, NULL, &buffer);
+    RETURN_IF(err);
+
+    size_t size = buffer.size;
+
+    struct jpegm_image decoded;
+
+    jpegm_init_image(&decoded);
+
+    err = jpegm_decode(buffer.data, buffer.size, &decoded, NULL);
+
+    free(buffer.data);
+
+    RETURN_IF(err);
+
+    /* the largest difference */
+    int error = decoded.precision == 12 && decoded.format == JPEGM_FORMAT_GREY ? 0 : 4096;
+
+    for (int y = 0; y < SIZE && error < 4096; ++y)
+    {
+        const uint16_t *row = (const uint16_t *)((const uint8_t *)decoded.pixels + y * decoded.stride);
+
+        for (int x = 0; x < SIZE; ++x)
+        {
+            int d = abs((int)row[x] - (int)samples[y * SIZE + x]);
+
+            error = d > error ? d : error;
+        }
+    }
+
+    jpegm_free_image(&decoded);
+
+    image.precision = 16;
+
+    buffer.data = NULL;
+
+    int refused = jpegm_encode(&image, NULL, &buffer) == JPEGM_ERROR_UNSUPPORTED;
+
+    free(buffer.data);
+
+    printf("api 12-bit encode: %zu bytes, error at most %i, 16-bit %s\n", size, error, refused ? "refused" : "accepted");
+
+    /* 4 levels of 8-bit samples */
+    if (error > 64 || !refused)
+    {
+        return RET_FAILURE_LOGIC_ERROR;
+    }
+
+    return RET_SUCCESS;
+}
+
+/* frames of two qualities (the second with restart intervals) through a context reused by jpegm_encode() and jpegm_decode()
+ * (of the whole image and of a rectangle), into the buffers of the caller: nothing is allocated once each quality has been coded */
+static int api_reuse(struct params *params)
+{
+    int err;
+
+    struct jpegm_image image;
+
+    err = create_image(&image, params);
+    RETURN_IF(err);
+
+    struct counter counter = { 0, 0 };
+    struct jpegm_allocator allocator = { counting_alloc, counting_free, &counter };
+
+    struct jpegm_context_opts context_opts;
+
+    jpegm_init_context_opts(&context_opts);
+
+    context_opts.allocator = &allocator;
+    context_opts.huge_pages = 1;
+
+    struct jpegm_context *context = NULL;
+
+    size_t capacity = image.stride * image.height * 2;
+
+    uint8_t *codestream = malloc(capacity);
+    uint8_t *pixels = malloc(image.stride * image.height);
+
+    /* a new context for each call */
+    struct jpegm_buffer expected[2] = { { NULL, 0, 0 }, { NULL, 0, 0 } };
+    struct jpegm_image decoded[2];
+
+    jpegm_init_image(&decoded[0]);
+    jpegm_init_image(&decoded[1]);
+
+    if (codestream == NULL || pixels == NULL)
+    {
+        err = RET_FAILURE_MEMORY_ALLOCATION;
+        goto end;
+    }
+
+    err = jpegm_create_context(&context_opts, &context);
+
+    if (err)
+    {
+        goto end;
+    }
+
+    struct jpegm_encode_opts encode_opts;
+    struct jpegm_decode_opts decode_opts;
+
+    jpegm_init_encode_opts(&encode_opts);
+    jpegm_init_decode_opts(&decode_opts);
+
+    encode_opts.H = params->H;
+    encode_opts.V = params->V;
+
+    for (int q = 0; q < 2; ++q)
+    {
+        encode_opts.quality = q == 0 ? 75 : 90;
+        encode_opts.restart_interval = q == 0 ? 0 : 4;
+
+        err = jpegm_encode(&image, &encode_opts, &expected[q]);
+
+        if (err)
+        {
+            goto end;
+        }
+
+        err = jpegm_decode(expected[q].data, expected[q].size, &decoded[q], NULL);
+
+        if (err)
+        {
+            goto end;
+        }
+    }
+
+    encode_opts.context = context;
+    decode_opts.context = context;
+
+    enum { FRAMES = 8 };
+
+    size_t calls[2] = { 0, 0 };
+    int identical = 1;
+
+    for (int f = 0; f < FRAMES; ++f)
+    {
+        size_t allocs = counter.allocs;
+        size_t mallocs = __atomic_load_n(&malloc_calls, __ATOMIC_RELAXED);
+
+        encode_opts.quality = f % 2 == 0 ? 75 : 90;
+        encode_opts.restart_interval = f % 2 == 0 ? 0 : 4;
+
+        struct jpegm_buffer buffer = { codestream, 0, capacity };
+
+        err = jpegm_encode(&image, &encode_opts, &buffer);
+
+        if (err)
+        {
+            goto end;
+        }
+
+        struct jpegm_image frame;
+
+        jpegm_init_image(&frame);
+
+        frame.format = JPEGM_FORMAT_RGB;
+        frame.size = image.stride * image.height;
+        frame.pixels = pixels;
+
+        err = jpegm_decode(buffer.data, buffer.size, &frame, &decode_opts);
+
+        if (err)
+        {
+            goto end;
+        }
+
+        const struct jpegm_buffer *e = &expected[f % 2];
+        const struct jpegm_image *d = &decoded[f % 2];
+
+        identical = identical && buffer.size == e->size && memcmp(buffer.data, e->data, e->size) == 0;
+        identical = identical && frame.stride == d->stride && memcmp(frame.pixels, d->pixels, d->stride * d->height) == 0;
+
+        /* the next encode follows the decode of a rectangle */
+        jpegm_init_image(&frame);
+
+        frame.format = JPEGM_FORMAT_RGB;
+        frame.size = image.stride * image.height;
+        frame.pixels = pixels;
+
+        decode_opts.crop_x = 8;
+        decode_opts.crop_y = 8;
+        decode_opts.crop_width = 64;
+        decode_opts.crop_height = 64;
+
+        err = jpegm_decode(buffer.data, buffer.size, &frame, &decode_opts);
+
+        decode_opts.crop_width = 0;
+        decode_opts.crop_height = 0;
+
+        if (err)
+        {
+            goto end;
+        }
+
+        if (f >= 2)
+        {
+            calls[0] += counter.allocs - allocs;
+            calls[1] += __atomic_load_n(&malloc_calls, __ATOMIC_RELAXED) - mallocs;
+        }
+    }
+
+    printf("api reused context: %i frames, %zu allocator and %zu malloc() calls after the first 2, %zu KiB reserved, %s\n",
+        (int)FRAMES, calls[0], calls[1], counter.bytes / 1024, identical ? "identical" : "MISMATCH");
+
+    if (calls[0] != 0 || calls[1] != 0 || !identical)
+    {
+        err = RET_FAILURE_LOGIC_ERROR;
+    }
+end:
+    jpegm_free_context(context);
+
+    for (int q = 0; q < 2; ++q)
+    {
+        free(expected[q].data);
+        jpegm_free_image(&decoded[q]);
+    }
+
+    free(pixels);
+    free(codestream);
+    free(image.pixels);
+
+    return err;
+}
+
+/* jpegm_encode() of a synthetic image, jpegm_decode() from several threads at once */
+int bench_api(struct params *params)
+{
+    int err;
+
+    struct jpegm_image image;
+
+    err = create_image(&image, params);
+    RETURN_IF(err);
+
+    struct jpegm_encode_opts opts;
+
+    jpegm_init_encode_opts(&opts);
+
+    opts.H = params->H;
+    opts.V = params->V;
+
+    struct jpegm_buffer buffer = { NULL, 0, 0 };
+
+    double t = get_time();
+
+    err = jpegm_encode(&image, &opts, &buffer);
+
+    t = get_time() - t;
+
+    free(image.pixels);
+
+    RETURN_IF(err);
+
+    printf("api encode %ux%u: %zu bytes in %.3f ms\n", (unsigned)params->X, (unsigned)params->Y, buffer.size, t * 1e3);
+
+    struct jpegm_info info;
+
+    double t_probe = 0.;
+
+    for (int r = 0; r < params->runs; ++r)
+    {
+        t = get_time();
+
+        err = jpegm_probe(buffer.data, buffer.size, &info);
+
+        t = get_time() - t;
+
+        if (err)
+        {
+            goto end;
+        }
+
+        if (r == 0 || t < t_probe)
+        {
+            t_probe = t;
+        }
+    }
+
+    printf("api probe: %.3f us\n", t_probe * 1e6);
+
+    /* the reference */
+    struct api_job serial = { &buffer, { 0 }, 0 };
+
+    t = get_time();
+
+    api_decode(&serial);
+
+    t = get_time() - t;
+
+    err = serial.err;
+
+    if (err)
+    {
+        goto end;
+    }
+
+    printf("api decode: %.3f ms\n", t * 1e3);
+
+    struct jpegm_report report;
+
+    t = get_time();
+
+    err = jpegm_validate(buffer.data, buffer.size, &report);
+
+    t = get_time() - t;
+
+    if (err || !report.valid)
+    {
+        err = err ? err : RET_FAILURE_LOGIC_ERROR;
+        goto end;
+    }
+
+    printf("api validate: %.3f ms\n", t * 1e3);
+
+    /* a tile of 256x256 in the middle */
+    struct jpegm_decode_opts crop_opts;
+
+    jpegm_init_decode_opts(&crop_opts);
+
+    crop_opts.crop_x = params->X > 256 ? (uint16_t)((params->X - 256) / 2) : 0;
+    crop_opts.crop_y = params->Y > 256 ? (uint16_t)((params->Y - 256) / 2) : 0;
+    crop_opts.crop_width = 256;
+    crop_opts.crop_height = 256;
+
+    struct jpegm_image tile;
+
+    jpegm_init_image(&tile);
+
+    t = get_time();
+
+    err = jpegm_decode(buffer.data, buffer.size, &tile, &crop_opts);
+
+    t = get_time() - t;
+
+    if (err)
+    {
+        goto end;
+    }
+
+    printf("api crop %ux%u: %.3f ms\n", (unsigned)tile.width, (unsigned)tile.height, t * 1e3);
+
+    jpegm_free_image(&tile);
+
+    /* in the DCT domain */
+    struct jpegm_transform_opts transform_opts;
+
+    jpegm_init_transform_opts(&transform_opts);
+
+    transform_opts.transform = JPEGM_TRANSFORM_ROT_90;
+
+    struct jpegm_buffer rotated = { NULL, 0, 0 };
+
+    t = get_time();
+
+    err = jpegm_transform(buffer.data, buffer.size, &transform_opts, &rotated);
+
+    t = get_time() - t;
+
+    free(rotated.data);
+
+    if (err)
+    {
+        goto end;
+    }
+
+    printf("api rotate 90: %.3f ms\n", t * 1e3);
+
+    transform_opts.transform = JPEGM_TRANSFORM_NONE;
+    transform_opts.crop_width = 256;
+    transform_opts.crop_height = 256;
+
+    struct jpegm_buffer cropped = { NULL, 0, 0 };
+
+    t = get_time();
+
+    err = jpegm_transform(buffer.data, buffer.size, &transform_opts, &cropped);
+
+    t = get_time() - t;
+
+    free(cropped.data);
+
+    if (err)
+    {
+        goto end;
+    }
+
+    printf("api lossless crop 256x256: %.3f ms\n", t * 1e3);
+
+    transform_opts.crop_width = 0;
+    transform_opts.crop_height = 0;
+    transform_opts.quality = 50;
+
+    struct jpegm_buffer requantized = { NULL, 0, 0 };
+
+    t = get_time();
+
+    err = jpegm_transform(buffer.data, buffer.size, &transform_opts, &requantized);
+
+    t = get_time() - t;
+
+    free(requantized.data);
+
+    if (err)
+    {
+        goto end;
+    }
+
+    printf("api requantize q50: %zu bytes in %.3f ms\n", requantized.size, t * 1e3);
+
+    transform_opts.quality = 0;
+    transform_opts.downscale = 1;
+
+    struct jpegm_buffer preview = { NULL, 0, 0 };
+
+    t = get_time();
+
+    err = jpegm_transform(buffer.data, buffer.size, &transform_opts, &preview);
+
+    t = get_time() - t;
+
+    free(preview.data);
+
+    if (err)
+    {
+        goto end;
+    }
+
+    printf("api downscale 1/8: %zu bytes in %.3f ms\n", preview.size, t * 1e3);
+
+    enum { THREADS = 4 };
+
+    struct api_job jobs[THREADS];
+    pthread_t threads[THREADS];
+
+    t = get_time();
+
+    for (int i = 0; i < THREADS; ++i)
+    {
+        jobs[i].buffer = &buffer;
+        jobs[i].image.pixels = NULL;
+        jobs[i].err = RET_FAILURE_LOGIC_ERROR;
+
+        if (pthread_create(&threads[i], NULL, api_decode, &jobs[i]) != 0)
+        {
+            /* run it here instead */
+            api_decode(&jobs[i]);
+            threads[i] = pthread_self();
+        }
+    }
+
+    for (int i = 0; i < THREADS; ++i)
+    {
+        if (!pthread_equal(threads[i], pthread_self()))
+        {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    t = get_time() - t;
+
+    size_t mismatches = 0;
+
+    for (int i = 0; i < THREADS; ++i)
+    {
+        if (jobs[i].err == RET_SUCCESS && memcmp(jobs[i].image.pixels, serial.image.pixels, serial.image.stride * serial.image.height) == 0)
+        {
+            jpegm_free_image(&jobs[i].image);
+            continue;
+        }
+
+        if (jobs[i].err == RET_SUCCESS)
+        {
+            jpegm_free_image(&jobs[i].image);
+        }
+
+        mismatches++;
+    }
+
+    printf("api decode on %i threads at once: %.3f ms, %zu mismatches\n", (int)THREADS, t * 1e3, mismatches);
+
+    if (mismatches > 0)
+    {
+        err = RET_FAILURE_LOGIC_ERROR;
+    }
+
+    if (!err)
+    {
+        err = api_precision();
+    }
+
+    if (!err)
+    {
+        err = api_reuse(params);
+    }
+
+    jpegm_free_image(&serial.image);
+end:
+    free(buffer.data);
+
+    return err;
+}
+
+int main(int argc, char *argv[])
+{
+    struct params params;
+
+    init_params(&params);
+
+    const char *test = argc > 1 ? argv[1] : "all";
+
+    if (argc > 3)
+    {
+        params.X = (uint16_t)atoi(argv[2]);
+        params.Y = (uint16_t)atoi(argv[3]);
+    }
+
+    int err = RET_SUCCESS;
+
+    if (strcmp(test, "all") != 0 && strcmp(test, "epilogue") != 0 && strcmp(test, "context") != 0 && strcmp(test, "arena") != 0 && strcmp(test, "prologue") != 0 && strcmp(test, "huffman") != 0 && strcmp(test, "sink") != 0 && strcmp(test, "api") != 0)
+    {
+        fprintf(stderr, "Usage: %s [all|epilogue|context|arena|prologue|huffman|sink|api] [width height]\n", argv[0]);
+        return 1;
+    }
+
+    if (strcmp(test, "all") == 0 || strcmp(test, "epilogue") == 0)
+    {
+        err = bench_epilogue(&params);
+    }
+
+    if (!err && (strcmp(test, "all") == 0 || strcmp(test, "context") == 0))
+    {
+        err = bench_context();
+    }
+
+    if (!err && (strcmp(test, "all") == 0 || strcmp(test, "arena") == 0))
+    {
+        err = bench_arena(&params);
+    }
+
+    if (!err && (strcmp(test, "all") == 0 || strcmp(test, "prologue") == 0))
+    {
+        err = bench_prologue(&params);
+    }
+
+    if (!err && (strcmp(test, "all") == 0 || strcmp(test, "huffman") == 0))
+    {
+        err = bench_huffman(&params);
+    }
+
+    if (!err && (strcmp(test, "all") == 0 || strcmp(test, "sink") == 0))
+    {
+        err = bench_sink(&params);
+    }
+
+    if (!err && (strcmp(test, "all") == 0 || strcmp(test, "api") == 0))
+    {
+        err = bench_api(&params);
+    }
+
+    if (err)
+    {
+        fprintf(stderr, "Failure.\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -1,4 +1,7 @@
 #include <assert.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 #include "coeffs.h"
 #include "huffman.h"
 
@@ -71,6 +74,10 @@ uint8_t encode_cat(int32_t c)
         c = -c;
     }
 
+#ifdef __GNUC__
+    /* the number of significant bits */
+    return (uint8_t)(32 - __builtin_clz((unsigned)c));
+#else
     uint8_t r = 0;
 
     do
@@ -81,6 +88,7 @@ uint8_t encode_cat(int32_t c)
     while (c != 0);
 
     return r;
+#endif
 }
 
 uint16_t encode_extra(int32_t c, uint8_t cat)
@@ -94,7 +102,7 @@ uint16_t encode_extra(int32_t c, uint8_t cat)
 }
 
 // read_code + read_extra_bits + compose the coefficient value
-int read_dc(struct bits *bits, struct hcode *hcode_dc, struct coeff_dc *coeff_dc)
+int read_dc(struct bits *bits, const struct hcode *hcode_dc, struct coeff_dc *coeff_dc)
 {
     int err;
 
@@ -118,7 +126,7 @@ int read_dc(struct bits *bits, struct hcode *hcode_dc, struct coeff_dc *coeff_dc
 }
 
 // encode_cat(), encode_extra(), write_code(), write_extra_bits()
-int write_dc(struct bits *bits, struct hcode *hcode_dc, struct coeff_dc *coeff_dc)
+int write_dc(struct bits *bits, const struct hcode *hcode_dc, struct coeff_dc *coeff_dc)
 {
     int err;
 
@@ -136,7 +144,7 @@ int write_dc(struct bits *bits, struct hcode *hcode_dc, struct coeff_dc *coeff_d
     return RET_SUCCESS;
 }
 
-int read_ac(struct bits *bits, struct hcode *hcode_ac, struct coeff_ac *coeff_ac)
+int read_ac(struct bits *bits, const struct hcode *hcode_ac, struct coeff_ac *coeff_ac)
 {
     int err;
 
@@ -175,7 +183,7 @@ int read_ac(struct bits *bits, struct hcode *hcode_ac, struct coeff_ac *coeff_ac
 }
 
 // encode_cat, encode_extra, compose rs from zrl and cat, write_code(), write_extra_bits()
-int write_ac(struct bits *bits, struct hcode *hcode_ac, struct coeff_ac *coeff_ac)
+int write_ac(struct bits *bits, const struct hcode *hcode_ac, struct coeff_ac *coeff_ac)
 {
     int err;
 
@@ -209,14 +217,18 @@ int write_ac(struct bits *bits, struct hcode *hcode_ac, struct coeff_ac *coeff_a
     return RET_SUCCESS;
 }
 
-int read_block(struct bits *bits, struct context *context, uint8_t Cs, struct int_block *int_block)
+int read_block(struct bits *bits, struct context *context, struct component *component, struct int_block *int_block)
 {
     int err;
-    uint8_t Td = context->component[Cs].Td;
-    uint8_t Ta = context->component[Cs].Ta;
+    uint8_t Td = component->Td;
+    uint8_t Ta = component->Ta;
 
-    struct hcode *hcode_dc = &context->hcode[0][Td];
-    struct hcode *hcode_ac = &context->hcode[1][Ta];
+    const struct hcode *hcode_dc, *hcode_ac;
+
+    err = get_hcode(context, 0, Td, &hcode_dc);
+    RETURN_IF(err);
+    err = get_hcode(context, 1, Ta, &hcode_ac);
+    RETURN_IF(err);
 
     struct coeff_dc coeff_dc;
 
@@ -230,7 +242,7 @@ int read_block(struct bits *bits, struct context *context, uint8_t Cs, struct in
      */
     if (int_block == NULL)
     {
-        printf("*** corrupted JPEG file ***\n");
+        TRACE(context, "*** corrupted JPEG file ***\n");
         return RET_FAILURE_NO_MORE_DATA;
     }
 
@@ -262,6 +274,12 @@ int read_block(struct bits *bits, struct context *context, uint8_t Cs, struct in
             break;
         }
 
+        // the run must stay within the block (corrupted data)
+        if (coeff_ac.zrl >= rem)
+        {
+            return RET_FAILURE_FILE_UNSUPPORTED;
+        }
+
         // zero run + one AC coeff.
         i += coeff_ac.zrl;
         int_block->c[zigzag[i]] = coeff_ac.c;
@@ -274,127 +292,211 @@ int read_block(struct bits *bits, struct context *context, uint8_t Cs, struct in
     return RET_SUCCESS;
 }
 
-int write_block(struct bits *bits, struct context *context, uint8_t Cs, struct int_block *int_block)
+/* bit i set for a non-zero coefficient i in zig-zag order */
+static uint64_t nonzero_mask(const struct int_block *int_block)
 {
-    int err;
-    uint8_t Td = context->component[Cs].Td;
-    uint8_t Ta = context->component[Cs].Ta;
+    uint64_t mask = 0;
+
+#ifdef __AVX2__
+    /* gather eight coefficients in zig-zag order at a time, compare with zero */
+    for (int i = 0; i < 64; i += 8)
+    {
+        __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&zigzag[i]));
+        __m256i c = _mm256_i32gather_epi32((const int *)int_block->c, index, 4);
+        __m256i zero = _mm256_cmpeq_epi32(c, _mm256_setzero_si256());
+
+        mask |= (uint64_t)(~_mm256_movemask_ps(_mm256_castsi256_ps(zero)) & 0xff) << i;
+    }
+#else
+    for (int i = 0; i < 64; ++i)
+    {
+        mask |= (uint64_t)(int_block->c[zigzag[i]] != 0) << i;
+    }
+#endif
+
+    return mask;
+}
+
+/* index of the lowest set bit, mask != 0 */
+static int lowest_bit(uint64_t mask)
+{
+#ifdef __GNUC__
+    return __builtin_ctzll(mask);
+#else
+    int i = 0;
+
+    while ((mask & 1) == 0)
+    {
+        mask >>= 1;
+        i++;
+    }
 
-    struct hcode *hcode_dc = &context->hcode[0][Td];
-    struct hcode *hcode_ac = &context->hcode[1][Ta];
+    return i;
+#endif
+}
 
+/*
+ * Figure F.2 – Procedure for sequential encoding of AC coefficients with Huffman coding
+ *
+ * the DC difference (F.1.2.1) followed by the AC symbols, returns the number of tokens (at most 64)
+ *
+ * the zero runs are the gaps between the bits of the non-zero mask
+ */
+size_t tokenize_block(const struct int_block *int_block, int32_t pred, struct token *tokens)
+{
     assert(int_block != NULL);
+    assert(tokens != NULL);
 
-    struct coeff_dc coeff_dc;
+    size_t n = 0;
 
-    coeff_dc.c = int_block->c[zigzag[0]];
+    /* differential DC coding */
+    int32_t diff = int_block->c[zigzag[0]] - pred;
 
-    // write_dc()
-    err = write_dc(bits, hcode_dc, &coeff_dc);
-    RETURN_IF(err);
+    /* categories up to 11 for 8-bit samples, up to 15 for 12-bit ones */
+    assert(diff >= -32767 && diff <= +32767);
+
+    uint8_t cat = encode_cat(diff);
 
-    /* Figure F.2 – Procedure for sequential encoding of AC coefficients with Huffman coding */
-    for (int r = 0, i = 1; i < 64; ++i)
+    tokens[n].value = cat;
+    tokens[n].size = cat | TOKEN_DC;
+    tokens[n].extra = encode_extra(diff, cat);
+    n++;
+
+    /* AC coefficients only */
+    uint64_t mask = nonzero_mask(int_block) & ~UINT64_C(1);
+
+    /* the previous non-zero coefficient */
+    int k = 0;
+
+    while (mask != 0)
     {
-        struct coeff_ac coeff_ac;
-        coeff_ac.eob = 0;
+        int i = lowest_bit(mask);
+        int r = i - k - 1;
 
-        if (int_block->c[zigzag[i]] == 0)
-        {
-            /* zero coefficient */
-            if (i == 63)
-            {
-                coeff_ac.eob = 1;
-                err = write_ac(bits, hcode_ac, &coeff_ac);
-                RETURN_IF(err);
-            }
-            else
-            {
-                r++;
-            }
-        }
-        else
+        while (r > 15)
         {
-            /* non-zero coefficient */
-            while (r > 15)
-            {
-                /* produce ZRL */
-                coeff_ac.c = 0;
-                coeff_ac.zrl = 15;
-                err = write_ac(bits, hcode_ac, &coeff_ac);
-                RETURN_IF(err);
-                r -= 16;
-            }
-            /* encode coefficient */
-            coeff_ac.c = int_block->c[zigzag[i]];
-            coeff_ac.zrl = r;
-            err = write_ac(bits, hcode_ac, &coeff_ac);
-            RETURN_IF(err);
-            r = 0;
+            /* ZRL */
+            tokens[n].value = 0xf0;
+            tokens[n].size = 0;
+            tokens[n].extra = 0;
+            n++;
+            r -= 16;
         }
+
+        /* encode coefficient */
+        int32_t c = int_block->c[zigzag[i]];
+
+        cat = encode_cat(c);
+
+        tokens[n].value = cat_zrl_to_value(cat, r);
+        tokens[n].size = cat;
+        tokens[n].extra = encode_extra(c, cat);
+        n++;
+
+        k = i;
+        mask &= mask - 1;
     }
 
-    return RET_SUCCESS;
+    if (k != 63)
+    {
+        /* EOB */
+        tokens[n].value = 0x00;
+        tokens[n].size = 0;
+        tokens[n].extra = 0;
+        n++;
+    }
+
+    return n;
 }
 
-/* don't actually compress the block, just collect the coded values to later optimize Huffman table */
-int write_block_dry(struct context *context, uint8_t Cs, struct int_block *int_block)
+size_t count_block_tokens(const struct int_block *int_block)
 {
-    uint8_t Td = context->component[Cs].Td;
-    uint8_t Ta = context->component[Cs].Ta;
+    assert(int_block != NULL);
 
-    struct huffenc *huffenc_dc = &context->huffenc[0][Td];
-    struct huffenc *huffenc_ac = &context->huffenc[1][Ta];
+    /* DC */
+    size_t n = 1;
 
-    assert(int_block != NULL);
+    uint64_t mask = nonzero_mask(int_block) & ~UINT64_C(1);
 
-    struct coeff_dc coeff_dc;
+    int k = 0;
+
+    while (mask != 0)
+    {
+        int i = lowest_bit(mask);
 
-    coeff_dc.c = int_block->c[zigzag[0]];
+        /* ZRLs and the coefficient */
+        n += (size_t)(i - k - 1) / 16 + 1;
 
-    // write_dc()
-    huffenc_dc->freq[encode_cat(coeff_dc.c)]++;
+        k = i;
+        mask &= mask - 1;
+    }
 
-    /* Figure F.2 – Procedure for sequential encoding of AC coefficients with Huffman coding */
-    for (int r = 0, i = 1; i < 64; ++i)
+    /* EOB */
+    if (k != 63)
     {
-        struct coeff_ac coeff_ac;
-        coeff_ac.eob = 0;
+        n++;
+    }
+
+    return n;
+}
 
-        if (int_block->c[zigzag[i]] == 0)
+/* collect the coded values to later optimize Huffman table */
+void count_tokens(struct histogram *histogram, const struct component *component, const struct token *tokens, size_t n)
+{
+    assert(histogram != NULL);
+    assert(component != NULL);
+
+    size_t *freq_dc = histogram->freq[0][component->Td];
+    size_t *freq_ac = histogram->freq[1][component->Ta];
+
+    for (size_t k = 0; k < n; ++k)
+    {
+        if (tokens[k].size & TOKEN_DC)
         {
-            /* zero coefficient */
-            if (i == 63)
-            {
-                coeff_ac.eob = 1;
-                // write_ac()
-                huffenc_ac->freq[0]++;
-            }
-            else
-            {
-                r++;
-            }
+            freq_dc[tokens[k].value]++;
         }
         else
         {
-            /* non-zero coefficient */
-            while (r > 15)
-            {
-                /* produce ZRL */
-                coeff_ac.c = 0;
-                coeff_ac.zrl = 15;
-                // write_ac()
-                huffenc_ac->freq[cat_zrl_to_value(encode_cat(coeff_ac.c), coeff_ac.zrl)]++;
-                r -= 16;
-            }
-            /* encode coefficient */
-            coeff_ac.c = int_block->c[zigzag[i]];
-            coeff_ac.zrl = r;
-            // write_ac()
-            huffenc_ac->freq[cat_zrl_to_value(encode_cat(coeff_ac.c), coeff_ac.zrl)]++;
-            r = 0;
+            freq_ac[tokens[k].value]++;
         }
     }
+}
+
+int write_tokens(struct bits *bits, struct context *context, struct component *component, const struct token *tokens, size_t n, size_t *used)
+{
+    int err;
+    uint8_t Td = component->Td;
+    uint8_t Ta = component->Ta;
+
+    const struct hcode *hcode_dc, *hcode_ac;
+
+    err = get_hcode(context, 0, Td, &hcode_dc);
+    RETURN_IF(err);
+    err = get_hcode(context, 1, Ta, &hcode_ac);
+    RETURN_IF(err);
+
+    assert(n > 0 && (tokens[0].size & TOKEN_DC));
+
+    size_t k = 0;
+
+    do
+    {
+        uint8_t size = tokens[k].size & ~TOKEN_DC;
+
+        // Huff(value), extra
+        err = write_code(bits, k == 0 ? hcode_dc : hcode_ac, tokens[k].value);
+        RETURN_IF(err);
+
+        err = write_extra_bits(bits, size, tokens[k].extra);
+        RETURN_IF(err);
+
+        k++;
+    }
+    while (k < n && !(tokens[k].size & TOKEN_DC));
+
+    assert(used != NULL);
+
+    *used = k;
 
     return RET_SUCCESS;
 }
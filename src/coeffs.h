@@ -17,10 +17,31 @@ struct flt_block
     float c[64];
 };
 
-int read_block(struct bits *bits, struct context *context, uint8_t Cs, struct int_block *int_block);
+int read_block(struct bits *bits, struct context *context, struct component *component, struct int_block *int_block);
 
-int write_block(struct bits *bits, struct context *context, uint8_t Cs, struct int_block *int_block);
+/* a coded value with its extra bits */
+struct token
+{
+    /* SSSS (DC) or RRRRSSSS (AC) */
+    uint8_t value;
+
+    /* number of extra bits, the DC token of a block is marked with TOKEN_DC */
+    uint8_t size;
+
+    uint16_t extra;
+};
+
+#define TOKEN_DC 0x80
+
+/* pred is the DC prediction, the block is not modified */
+size_t tokenize_block(const struct int_block *int_block, int32_t pred, struct token *tokens);
+
+/* the number of tokens tokenize_block() produces for the block */
+size_t count_block_tokens(const struct int_block *int_block);
+
+void count_tokens(struct histogram *histogram, const struct component *component, const struct token *tokens, size_t n);
 
-int write_block_dry(struct context *context, uint8_t Cs, struct int_block *int_block);
+/* the tokens of a single block (up to the next DC token), *used is their number */
+int write_tokens(struct bits *bits, struct context *context, struct component *component, const struct token *tokens, size_t n, size_t *used);
 
 #endif
@@ -5,26 +5,61 @@
 #include "common.h"
 #include "mjpeg.h"
 #include "huffman.h"
+#include "hcache.h"
 #include "coeffs.h"
 
 int init_qtable(struct qtable *qtable)
 {
     assert(qtable != NULL);
 
-    qtable->Pq = 0;
+    uint16_t Q[64];
 
     for (int i = 0; i < 64; ++i)
     {
-        qtable->Q[i] = 1;
+        Q[i] = 1;
     }
 
+    /* derive the tables even though Q[] may already hold the same values */
+    qtable->Q[0] = 0;
+
+    update_qtable(qtable, 0, Q);
+
     return RET_SUCCESS;
 }
 
+void update_qtable(struct qtable *qtable, uint8_t Pq, const uint16_t Q[64])
+{
+    assert(qtable != NULL);
+    assert(Q != NULL);
+
+    qtable->Pq = Pq;
+
+    /* e.g. the same DQT segment in every frame of MJPEG stream */
+    if (memcmp(qtable->Q, Q, sizeof(qtable->Q)) == 0)
+    {
+        return;
+    }
+
+    for (int j = 0; j < 64; ++j)
+    {
+        qtable->Q[j] = Q[j];
+
+        qtable->dequant[j] = (float)Q[j];
+        qtable->recip[j] = 1.f / (float)Q[j];
+    }
+
+    for (int i = 0; i < 64; ++i)
+    {
+        qtable->Q_zz[i] = Q[zigzag[i]];
+    }
+}
+
 int init_component(struct component *component)
 {
     assert(component != NULL);
 
+    component->C = 0;
+
     component->H = 0;
     component->V = 0;
 
@@ -53,17 +88,44 @@ int init_htable(struct htable *htable)
         htable->L[i] = 0;
     }
 
-    for (int i = 0; i < 16; ++i)
+    for (int k = 0; k < 256; ++k)
     {
-        for (int j = 0; j < 255; ++j)
-        {
-            htable->V[i][j] = 0;
-        }
+        htable->V[k] = 0;
     }
 
     return RET_SUCCESS;
 }
 
+/* implicit MJPEG tables */
+static const struct htable *mjpg_htable(uint8_t Tc, uint8_t Th)
+{
+    static const struct htable *const mjpg_htables[2][2] =
+    {
+        { &mjpg_htable_0_0, &mjpg_htable_0_1 },
+        { &mjpg_htable_1_0, &mjpg_htable_1_1 }
+    };
+
+    return Th < 2 ? mjpg_htables[Tc][Th] : NULL;
+}
+
+/* install the implicit MJPEG table (or empty table) */
+static void reset_htable(struct context *context, uint8_t Tc, uint8_t Th)
+{
+    const struct htable *htable = mjpg_htable(Tc, Th);
+
+    if (htable != NULL)
+    {
+        context->htable[Tc][Th] = *htable;
+    }
+    else
+    {
+        init_htable(&context->htable[Tc][Th]);
+    }
+
+    context->hcode_dirty[Tc][Th] = 1;
+    context->htable_custom[Tc][Th] = 0;
+}
+
 int init_context(struct context *context)
 {
     assert(context != NULL);
@@ -73,46 +135,199 @@ int init_context(struct context *context)
         init_qtable(&context->qtable[i]);
     }
 
-    context->P = 0;
-
-    context->Y = 0;
-    context->X = 0;
-
-    context->Nf = 0;
-
-    for (int i = 0; i < 256; ++i)
+    for (int i = 0; i < MAX_COMPONENTS; ++i)
     {
         init_component(&context->component[i]);
     }
 
+    /* the hcode[][] are built on first use (except the MJPEG ones), the huffenc[][] when optimizing */
     for (int j = 0; j < 2; ++j)
     {
         for (int i = 0; i < 4; ++i)
         {
-            init_htable(&context->htable[j][i]);
+            context->hcode[j][i] = NULL;
 
-            init_huffenc(&context->huffenc[j][i]);
+            reset_htable(context, j, i);
         }
     }
 
-    /* implicit MJPEG tables */
-    context->htable[0][0] = mjpg_htable_0_0;
-    context->htable[0][1] = mjpg_htable_0_1;
-    context->htable[1][0] = mjpg_htable_1_0;
-    context->htable[1][1] = mjpg_htable_1_1;
+    context->huffenc = NULL;
+
+    context->Nf = 0;
 
-    conv_htable_to_hcode(&context->htable[0][0], &context->hcode[0][0]);
-    conv_htable_to_hcode(&context->htable[0][1], &context->hcode[0][1]);
-    conv_htable_to_hcode(&context->htable[1][0], &context->hcode[1][0]);
-    conv_htable_to_hcode(&context->htable[1][1], &context->hcode[1][1]);
+    arena_init(&context->arena, NULL, 0);
+
+    context->pool = NULL;
+
+    context->verbose = 0;
+
+    return reset_context(context);
+}
+
+int reset_context(struct context *context)
+{
+    assert(context != NULL);
+
+    free_buffers(context);
+
+    context->P = 0;
+
+    context->Y = 0;
+    context->X = 0;
+
+    context->Nf = 0;
+
+    /* only the tables redefined by the previous image */
+    for (int j = 0; j < 2; ++j)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            if (context->htable_custom[j][i])
+            {
+                reset_htable(context, j, i);
+            }
+        }
+    }
 
     context->Ri = 0;
 
+    /* the buffers of the next image would hold the crop of this one only */
+    context->crop_x = 0;
+    context->crop_y = 0;
+    context->crop_w = 0;
+    context->crop_h = 0;
+
     context->m_x = 0;
     context->m_y = 0;
 
+    context->m_rows = 0;
+
+    context->m_x0 = 0;
+    context->m_x1 = 0;
+    context->m_y0 = 0;
+    context->m_y1 = 0;
+
+    context->fused = 0;
+
+    context->validate = 0;
+
+    context->coefficients = 0;
+
     context->mblocks = 0;
 
+    context->max_H = 0;
+    context->max_V = 0;
+
+    return RET_SUCCESS;
+}
+
+void free_context(struct context *context)
+{
+    assert(context != NULL);
+
+    free_buffers(context);
+
+    arena_destroy(&context->arena);
+}
+
+int component_index(struct context *context, uint8_t C)
+{
+    assert(context != NULL);
+
+    for (int i = 0; i < context->Nf; ++i)
+    {
+        if (context->component[i].C == C)
+        {
+            return i;
+        }
+    }
+
+    return -1; /* not found */
+}
+
+int add_component(struct context *context, uint8_t C, struct component **component)
+{
+    assert(context != NULL);
+    assert(component != NULL);
+
+    int i = component_index(context, C);
+
+    // redefine component (multiple definitions of the same component inside SOF marker)
+    if (i == -1)
+    {
+        if (context->Nf == MAX_COMPONENTS)
+        {
+            return RET_FAILURE_FILE_UNSUPPORTED;
+        }
+
+        i = context->Nf++;
+
+        context->component[i].C = C;
+    }
+
+    *component = &context->component[i];
+
+    return RET_SUCCESS;
+}
+
+void set_htable(struct context *context, uint8_t Tc, uint8_t Th)
+{
+    assert(context != NULL);
+
+    context->hcode_dirty[Tc][Th] = 1;
+    context->htable_custom[Tc][Th] = 1;
+}
+
+int get_hcode(struct context *context, uint8_t Tc, uint8_t Th, const struct hcode **hcode)
+{
+    assert(context != NULL);
+    assert(hcode != NULL);
+
+    if (Tc >= 2 || Th >= 4)
+    {
+        return RET_FAILURE_FILE_UNSUPPORTED;
+    }
+
+    if (context->hcode_dirty[Tc][Th])
+    {
+        const struct hcode *used;
+
+        if (!context->htable_custom[Tc][Th] && Th < 2)
+        {
+            /* the implicit MJPEG tables are const data */
+            used = &mjpg_hcode[Tc][Th];
+        }
+        else
+        {
+            int err = hcache_get(&context->htable[Tc][Th], &used);
+            RETURN_IF(err);
+
+            /* the cache is full */
+            if (used == NULL)
+            {
+                if (context->hcode[Tc][Th] == NULL)
+                {
+                    context->hcode[Tc][Th] = arena_alloc(&context->arena, sizeof(struct hcode));
+
+                    if (context->hcode[Tc][Th] == NULL)
+                    {
+                        return RET_FAILURE_MEMORY_ALLOCATION;
+                    }
+                }
+
+                err = conv_htable_to_hcode(&context->htable[Tc][Th], context->hcode[Tc][Th]);
+                RETURN_IF(err);
+
+                used = context->hcode[Tc][Th];
+            }
+        }
+
+        context->hcode_used[Tc][Th] = used;
+        context->hcode_dirty[Tc][Th] = 0;
+    }
+
+    *hcode = context->hcode_used[Tc][Th];
+
     return RET_SUCCESS;
 }
 
@@ -121,14 +336,43 @@ size_t ceil_div(size_t n, size_t d)
     return (n + (d - 1)) / d;
 }
 
-int alloc_buffers(struct component *component, size_t size)
+int alloc_buffers(struct context *context, struct component *component, size_t size)
 {
+    assert(context != NULL);
+    assert(component != NULL);
+
     // redefine component (multiple definitions of the same component inside SOF marker)
-    free(component->int_buffer);
-    free(component->flt_buffer);
-    free(component->frame_buffer);
+    arena_free(&context->arena, component->flt_buffer);
+    arena_free(&context->arena, component->int_buffer);
+    arena_free(&context->arena, component->frame_buffer);
+
+    component->int_buffer = NULL;
+    component->flt_buffer = NULL;
+    component->frame_buffer = NULL;
+
+    if (context->validate)
+    {
+        /* nothing is kept */
+        return RET_SUCCESS;
+    }
+
+    if (!context->coefficients)
+    {
+        component->frame_buffer = arena_alloc(&context->arena, sizeof(float) * 64 * size);
+
+        if (component->frame_buffer == NULL)
+        {
+            return RET_FAILURE_MEMORY_ALLOCATION;
+        }
+    }
+
+    if (context->fused)
+    {
+        /* only samples */
+        return RET_SUCCESS;
+    }
 
-    component->int_buffer = malloc(sizeof(struct int_block) * size);
+    component->int_buffer = arena_alloc(&context->arena, sizeof(struct int_block) * size);
 
     if (component->int_buffer == NULL)
     {
@@ -137,16 +381,15 @@ int alloc_buffers(struct component *component, size_t size)
 
     memset(component->int_buffer, 0, sizeof(struct int_block) * size);
 
-    component->flt_buffer = malloc(sizeof(struct flt_block) * size);
-
-    if (component->flt_buffer == NULL)
+    if (context->coefficients)
     {
-        return RET_FAILURE_MEMORY_ALLOCATION;
+        /* no samples */
+        return RET_SUCCESS;
     }
 
-    component->frame_buffer = malloc(sizeof(float) * 64 * size);
+    component->flt_buffer = arena_alloc(&context->arena, sizeof(struct flt_block) * size);
 
-    if (component->frame_buffer == NULL)
+    if (component->flt_buffer == NULL)
     {
         return RET_FAILURE_MEMORY_ALLOCATION;
     }
@@ -156,13 +399,30 @@ int alloc_buffers(struct component *component, size_t size)
 
 void free_buffers(struct context *context)
 {
-    for (int i = 0; i < 256; ++i)
+    for (int i = 0; i < context->Nf; ++i)
     {
-        free(context->component[i].int_buffer);
-        free(context->component[i].flt_buffer);
+        context->component[i].int_buffer = NULL;
+        context->component[i].flt_buffer = NULL;
 
-        free(context->component[i].frame_buffer);
+        context->component[i].frame_buffer = NULL;
+    }
+
+    context->huffenc = NULL;
+
+    /* the tables built in the arena are built again on next use */
+    for (int j = 0; j < 2; ++j)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            if (context->hcode[j][i] != NULL)
+            {
+                context->hcode[j][i] = NULL;
+                context->hcode_dirty[j][i] = 1;
+            }
+        }
     }
+
+    arena_reset(&context->arena);
 }
 
 int compute_no_blocks_and_alloc_buffers(struct context *context)
@@ -183,9 +443,36 @@ int compute_no_blocks_and_alloc_buffers(struct context *context)
     context->m_x = ceil_div(X, 8 * max_H);
     context->m_y = ceil_div(Y, 8 * max_V);
 
-    printf("Expecting %zu macroblocks\n", context->m_x * context->m_y);
+    TRACE(context, "Expecting %zu macroblocks\n", context->m_x * context->m_y);
 
-    for (int i = 0; i < 256; ++i)
+    size_t x0, y0, x1, y1;
+
+    crop_region(context, &x0, &y0, &x1, &y1);
+
+    if (x0 >= x1 || y0 >= y1)
+    {
+        /* the crop is outside the image */
+        return RET_FAILURE_FILE_UNSUPPORTED;
+    }
+
+    /* the MCUs covering the crop */
+    context->m_x0 = x0 / (8 * max_H);
+    context->m_x1 = ceil_div(x1, 8 * max_H);
+    context->m_y0 = y0 / (8 * max_V);
+    context->m_y1 = ceil_div(y1, 8 * max_V);
+
+    if (context->crop_w != 0)
+    {
+        TRACE(context, "Cropping to %zu x %zu macroblocks\n", context->m_x1 - context->m_x0, context->m_y1 - context->m_y0);
+    }
+
+    /* either the whole image (crop), or a ring of few MCU rows (streaming) */
+    if (context->m_rows == 0 || context->m_rows > context->m_y1 - context->m_y0)
+    {
+        context->m_rows = context->m_y1 - context->m_y0;
+    }
+
+    for (int i = 0; i < context->Nf; ++i)
     {
         uint8_t H, V;
         H = context->component[i].H;
@@ -198,9 +485,9 @@ int compute_no_blocks_and_alloc_buffers(struct context *context)
             context->component[i].b_x = b_x;
             context->component[i].b_y = b_y;
 
-            printf("C = %i: %zu blocks (x=%zu y=%zu)\n", i, b_x * b_y, b_x, b_y);
+            TRACE(context, "C = %i: %zu blocks (x=%zu y=%zu)\n", context->component[i].C, b_x * b_y, b_x, b_y);
 
-            err = alloc_buffers(&context->component[i], b_x * b_y);
+            err = alloc_buffers(context, &context->component[i], buffer_b_x(context, &context->component[i]) * context->m_rows * V);
             RETURN_IF(err);
         }
     }
@@ -208,6 +495,46 @@ int compute_no_blocks_and_alloc_buffers(struct context *context)
     return RET_SUCCESS;
 }
 
+/* index of the block within the component buffers, these may hold only m_rows MCU rows */
+size_t block_seq(const struct context *context, const struct component *component, size_t block_x, size_t block_y)
+{
+    assert(context != NULL);
+    assert(component != NULL);
+
+    size_t y = block_y - context->m_y0 * component->V;
+    size_t x = block_x - context->m_x0 * component->H;
+
+    return (y % (context->m_rows * component->V)) * buffer_b_x(context, component) + x;
+}
+
+size_t buffer_b_x(const struct context *context, const struct component *component)
+{
+    assert(context != NULL);
+    assert(component != NULL);
+
+    return (context->m_x1 - context->m_x0) * component->H;
+}
+
+void crop_region(const struct context *context, size_t *x0, size_t *y0, size_t *x1, size_t *y1)
+{
+    assert(context != NULL);
+
+    *x0 = 0;
+    *y0 = 0;
+    *x1 = context->X;
+    *y1 = context->Y;
+
+    if (context->crop_w == 0)
+    {
+        return;
+    }
+
+    *x0 = context->crop_x < context->X ? context->crop_x : context->X;
+    *y0 = context->crop_y < context->Y ? context->crop_y : context->Y;
+    *x1 = (size_t)context->crop_x + context->crop_w < context->X ? (size_t)context->crop_x + context->crop_w : context->X;
+    *y1 = (size_t)context->crop_y + context->crop_h < context->Y ? (size_t)context->crop_y + context->crop_h : context->Y;
+}
+
 int clamp(int min, int val, int max)
 {
     if (val < min)
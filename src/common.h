@@ -3,6 +3,9 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#include "arena.h"
+#include "pool.h"
 
 /**
  * \brief Error codes
@@ -44,6 +47,22 @@ static const uint8_t zigzag[64] =
     53, 60, 61, 54, 47, 55, 62, 63
 };
 
+/* a progress message on stdout, see context->verbose */
+#define TRACE(context, ...) \
+	do { \
+		if ((context)->verbose) { \
+			printf(__VA_ARGS__); \
+		} \
+	} while (0)
+
+/* the reason of a failure on stderr */
+#define TRACE_ERROR(context, ...) \
+	do { \
+		if ((context)->verbose) { \
+			fprintf(stderr, __VA_ARGS__); \
+		} \
+	} while (0)
+
 #define RETURN_IF(err) \
 	do { \
 		if (err) { \
@@ -57,10 +76,25 @@ struct qtable
     uint8_t Pq;
     /* elements: in raster scan order */
     uint16_t Q[64];
+
+    /* derived from Q[] by update_qtable(), valid until Q[] changes */
+
+    /* dequantization multipliers, raster order */
+    float dequant[64];
+    /* quantization reciprocals 1/Q, raster order */
+    float recip[64];
+    /* Q[] in zig-zag order (as in the DQT segment) */
+    uint16_t Q_zz[64];
 };
 
+/* Nf is at most 4 for the colour spaces we can handle (YCbCr, YCCK, grayscale) */
+#define MAX_COMPONENTS 4
+
 struct component
 {
+    /* Component identifier */
+    uint8_t C;
+
     /* Horizontal sampling factor, Vertical sampling factor */
     uint8_t H, V;
     /* Quantization table destination selector */
@@ -91,8 +125,8 @@ struct htable
     /* Number of Huffman codes of length i */
     uint8_t L[16];
 
-    /*  Value associated with each Huffman code */
-    uint8_t V[16][255];
+    /* Value associated with each Huffman code, in order of increasing code length */
+    uint8_t V[256];
 };
 
 /*
@@ -100,13 +134,13 @@ struct htable
  */
 struct hcode
 {
-    /* unrolled htable.V[] */
-    uint8_t huff_val[16 * 255];
+    /* htable.V[] */
+    uint8_t huff_val[256];
 
     /* contains a list of code lengths */
-    size_t huff_size[256];
+    uint8_t huff_size[257];
     /*  contains the Huffman codes corresponding to those lengths */
-    uint16_t huff_code[256];
+    uint16_t huff_code[257];
 
     /* the index of the last entry in the table */
     size_t last_k;
@@ -115,7 +149,17 @@ struct hcode
      * HUFFCODE and HUFFSIZE according to the symbol values assigned to each code
      */
     uint16_t e_huf_co[256];
-    size_t e_huf_si[256];
+    uint8_t e_huf_si[256];
+
+    /* F.2.2.3 Decoder tables: the largest code, the smallest code and the index
+     * to the start of the list of values in huff_val[] for each code length */
+    int32_t max_code[18];
+    int32_t min_code[17];
+    int16_t val_ptr[17];
+
+    /* the codes of up to 8 bits indexed by the next 8 bits of the data: their size (0 = longer code) and value */
+    uint8_t look_size[256];
+    uint8_t look_val[256];
 };
 
 /* K.2 A procedure for generating the lists which specify a Huffman code table */
@@ -125,7 +169,13 @@ struct huffenc
     size_t codesize[257];
     int others[257];
     size_t bits[33]; // 0..32, corresponds to htable.L[]
-    uint8_t huff_val[16 * 255]; // to hcode.huff_val[] => htable.V[]
+    uint8_t huff_val[256]; // to htable.V[]
+};
+
+/* symbol counts [0=DC/1=AC][identifier][value] of a part of the image, merged into huffenc[][].freq */
+struct histogram
+{
+    size_t freq[2][4][256];
 };
 
 struct context
@@ -143,13 +193,27 @@ struct context
     /* Number of image components in frame */
     uint8_t Nf;
 
-    struct component component[256];
+    /* components in frame order, see component_index() */
+    struct component component[MAX_COMPONENTS];
 
     /* there are two types of tables, DC and AC; the identifiers are not unique accross these types */
     /* indices: [0=DC/1=AC][identifier] */
     struct htable htable[2][4];
-    struct hcode hcode[2][4];
-    struct huffenc huffenc[2][4];
+
+    /* the symbol counts when optimizing, [2][4] in the arena (see tokenize_scan()), NULL until then */
+    struct huffenc (*huffenc)[4];
+
+    /* the tables in use, see get_hcode(): the const MJPEG ones, shared ones (hcache.h), or hcode[][] */
+    const struct hcode *hcode_used[2][4];
+
+    /* built from a custom htable when the shared cache is full, in the arena (NULL until needed) */
+    struct hcode *hcode[2][4];
+
+    /* hcode is out of date */
+    uint8_t hcode_dirty[2][4];
+
+    /* htable is not the implicit MJPEG table */
+    uint8_t htable_custom[2][4];
 
     /* Restart interval */
     uint16_t Ri;
@@ -157,30 +221,89 @@ struct context
     /* macroblocks horizontally and vertically */
     size_t m_x, m_y;
 
+    /* MCU rows held in component buffers (0 = all of them) */
+    size_t m_rows;
+
+    /* region of interest in pixels, crop_w == 0 = the whole image (see crop_region()) */
+    uint16_t crop_x, crop_y, crop_w, crop_h;
+
+    /* the MCU columns m_x0 .. m_x1 - 1 and rows m_y0 .. m_y1 - 1 of the crop are held in component buffers */
+    size_t m_x0, m_x1, m_y0, m_y1;
+
+    /* blocks are reconstructed as soon as decoded, no coefficient buffers */
+    int fused;
+
+    /* the blocks are only entropy decoded and checked, no buffers at all */
+    int validate;
+
+    /* only the quantized coefficients are kept (transcoding), no samples */
+    int coefficients;
+
     /* seq. number */
     size_t mblocks;
 
     uint8_t max_H, max_V;
+
+    /* per-image buffers, kept across reset_context() */
+    struct arena arena;
+
+    /* threads for the epilogue, owned by the caller (NULL = serial) */
+    struct pool *pool;
+
+    /* print the progress messages (the command line tools), the library is quiet otherwise */
+    int verbose;
 };
 
 void init_huffenc(struct huffenc *huffenc);
 
 int init_qtable(struct qtable *qtable);
 
+/* install Q[] (raster order) and derive the tables, nothing is done if the table is the same */
+void update_qtable(struct qtable *qtable, uint8_t Pq, const uint16_t Q[64]);
+
 int init_component(struct component *component);
 
 int init_htable(struct htable *htable);
 
 int init_context(struct context *context);
 
-int alloc_buffers(struct component *component, size_t size);
+/* prepare the context for the next image as if it were new, keeps built tables and the capacity of the arena */
+int reset_context(struct context *context);
+
+/* release the memory held by the context (not the context itself) */
+void free_context(struct context *context);
+
+/* position of the component with identifier C in context->component[] */
+int component_index(struct context *context, uint8_t C);
+
+/* find or define the component with identifier C */
+int add_component(struct context *context, uint8_t C, struct component **component);
+
+/* the table has been redefined */
+void set_htable(struct context *context, uint8_t Tc, uint8_t Th);
 
+/* Annex C tables of htable[Tc][Th], looked up on first use (the implicit MJPEG ones are const, the others are shared) */
+int get_hcode(struct context *context, uint8_t Tc, uint8_t Th, const struct hcode **hcode);
+
+/* from context->arena, only the samples in fused mode, only the coefficients when transcoding */
+int alloc_buffers(struct context *context, struct component *component, size_t size);
+
+/* the arena keeps its capacity for the next image */
 void free_buffers(struct context *context);
 
 size_t ceil_div(size_t n, size_t d);
 
 int compute_no_blocks_and_alloc_buffers(struct context *context);
 
+/* the pixels to decode: columns x0 .. x1 - 1, rows y0 .. y1 - 1 (the crop within the image, or the whole image) */
+void crop_region(const struct context *context, size_t *x0, size_t *y0, size_t *x1, size_t *y1);
+
+/* blocks in a row of the component buffers */
+size_t buffer_b_x(const struct context *context, const struct component *component);
+
+/* position of the block in the component buffers, the block must be within m_x0 .. m_x1, m_y0 .. m_y1 */
+size_t block_seq(const struct context *context, const struct component *component, size_t block_x, size_t block_y);
+
 int clamp(int min, int val, int max);
 
 #endif
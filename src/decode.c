@@ -0,0 +1,1352 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <unistd.h>
+#include "common.h"
+#include "io.h"
+#include "huffman.h"
+#include "coeffs.h"
+#include "imgproc.h"
+#include "frame.h"
+#include "pool.h"
+#include "decode.h"
+
+static const char *Pq_to_str[] =
+{
+    [0] = "8-bit",
+    [1] = "16-bit"
+};
+
+/* B.2.4.1 Quantization table-specification syntax */
+int parse_qtable(FILE *stream, struct context *context)
+{
+    int err;
+    uint8_t Pq, Tq;
+    struct qtable *qtable;
+
+    assert(context != NULL);
+
+    err = read_nibbles(stream, &Pq, &Tq);
+    RETURN_IF(err);
+
+    if (Tq >= 4)
+    {
+        /* invalid value */
+        return RET_FAILURE_FILE_UNSUPPORTED;
+    }
+
+    assert(Tq < 4);
+    assert(Pq < 2);
+
+    TRACE(context, "Pq = %" PRIu8 " (%s), Tq = %" PRIu8 " (QT identifier)\n", Pq, Pq_to_str[Pq], Tq);
+
+    qtable = &context->qtable[Tq];
+
+    /* raster order */
+    uint16_t Q[64];
+
+    for (int i = 0; i < 64; ++i)
+    {
+        if (Pq == 0)
+        {
+            uint8_t byte;
+            err = read_byte(stream, &byte);
+            RETURN_IF(err);
+            Q[zigzag[i]] = (uint16_t)byte;
+        }
+        else
+        {
+            uint16_t word;
+            err = read_word(stream, &word);
+            RETURN_IF(err);
+            Q[zigzag[i]] = word;
+        }
+    }
+
+    /* precision, the derived tables are kept for a repeated table */
+    update_qtable(qtable, Pq, Q);
+
+    for (int y = 0; y < 8; ++y)
+    {
+        for (int x = 0; x < 8; ++x)
+        {
+            TRACE(context, "%3" PRIu16 " ", qtable->Q[y * 8 + x]);
+        }
+        TRACE(context, "\n");
+    }
+
+    return RET_SUCCESS;
+}
+
+int parse_frame_header(FILE *stream, struct context *context)
+{
+    int err;
+    /* Sample precision */
+    uint8_t P;
+    /* Number of lines, Number of samples per line */
+    uint16_t Y, X;
+    /* Number of image components in frame */
+    uint8_t Nf;
+
+    assert(context != NULL);
+
+    err = read_byte(stream, &P);
+    RETURN_IF(err);
+    err = read_word(stream, &Y);
+    RETURN_IF(err);
+    err = read_word(stream, &X);
+    RETURN_IF(err);
+    err = read_byte(stream, &Nf);
+    RETURN_IF(err);
+
+    if (X == 0 || Nf == 0)
+    {
+        return RET_FAILURE_FILE_UNSUPPORTED;
+    }
+
+    TRACE(context, "P = %" PRIu8 " (Sample precision), Y = %" PRIu16 ", X = %" PRIu16 ", Nf = %" PRIu8 " (Number of image components)\n", P, Y, X, Nf);
+
+    /* precision */
+    context->P = P;
+
+    context->Y = Y;
+    context->X = X;
+
+    uint8_t max_H = 0, max_V = 0;
+
+    for (int i = 0; i < Nf; ++i)
+    {
+        uint8_t C;
+        uint8_t H, V;
+        uint8_t Tq;
+
+        err = read_byte(stream, &C);
+        RETURN_IF(err);
+        err = read_nibbles(stream, &H, &V);
+        RETURN_IF(err);
+        err = read_byte(stream, &Tq);
+        RETURN_IF(err);
+
+        TRACE(context, "C = %" PRIu8 " (Component identifier), H = %" PRIu8 ", V = %" PRIu8 ", Tq = %" PRIu8 " (QT identifier)\n", C, H, V, Tq);
+
+        struct component *component;
+
+        err = add_component(context, C, &component);
+        RETURN_IF(err);
+
+        component->H = H;
+        component->V = V;
+        component->Tq = Tq;
+
+        max_H = (H > max_H) ? H : max_H;
+        max_V = (V > max_V) ? V : max_V;
+    }
+
+    context->max_H = max_H;
+    context->max_V = max_V;
+
+    return RET_SUCCESS;
+}
+
+static const char *Tc_to_str[] =
+{
+    [0] = "DC",
+    [1] = "AC"
+};
+
+int parse_huffman_tables(FILE *stream, struct context *context)
+{
+    int err;
+    uint8_t Tc, Th;
+
+    assert(context != NULL);
+
+    err = read_nibbles(stream, &Tc, &Th);
+    RETURN_IF(err);
+
+    if (Tc >= 2 || Th >= 4)
+    {
+        return RET_FAILURE_FILE_UNSUPPORTED;
+    }
+
+    assert(Tc < 2);
+
+    TRACE(context, "Tc = %" PRIu8 " (%s table) Th = %" PRIu8 " (HT identifier)\n", Tc, Tc_to_str[Tc], Th);
+
+    struct htable *htable = &context->htable[Tc][Th];
+
+    size_t mt = 0;
+
+    for (int i = 0; i < 16; ++i)
+    {
+        err = read_byte(stream, &htable->L[i]);
+        RETURN_IF(err);
+
+        mt += htable->L[i];
+    }
+
+    if (mt > 256)
+    {
+        return RET_FAILURE_FILE_UNSUPPORTED;
+    }
+
+    for (size_t k = 0; k < mt; ++k)
+    {
+        err = read_byte(stream, &htable->V[k]);
+        RETURN_IF(err);
+    }
+
+    /* Annex C tables are built on first use */
+    set_htable(context, Tc, Th);
+
+    return RET_SUCCESS;
+}
+
+struct scan
+{
+    uint8_t Ns;
+    /* index into context->component[] */
+    uint8_t Cs[MAX_COMPONENTS];
+
+    /* useful to remove differential DC coding
+     *
+     * At the beginning of the scan and at the beginning of each restart interval, the prediction for the DC coefficient prediction
+     * is initialized to 0. */
+    int32_t pred[MAX_COMPONENTS];
+
+    /* validation (NULL = decoding) */
+    struct jpegm_report *report;
+
+    /* blocks decoded in the scan, at the start of the restart interval */
+    size_t blocks, interval;
+
+    /* RSTm markers in the scan */
+    size_t restarts;
+};
+
+void init_output(struct output *output, const char *path)
+{
+    assert(output != NULL);
+
+    output->path = path;
+    output->streaming = 0;
+    output->stream = NULL;
+    output->band.data = NULL;
+    output->band.arena = NULL;
+    output->started = 0;
+    output->m_y = 0;
+    output->pool = NULL;
+    output->pixels = NULL;
+    output->report = NULL;
+    output->crop_x = 0;
+    output->crop_y = 0;
+    output->crop_w = 0;
+    output->crop_h = 0;
+}
+
+int parse_scan_header(FILE *stream, struct context *context, struct scan *scan)
+{
+    int err;
+    /* Number of image components in scan */
+    uint8_t Ns;
+
+    err = read_byte(stream, &Ns);
+    RETURN_IF(err);
+
+    TRACE(context, "Ns = %" PRIu8 " (Number of image components in scan)\n", Ns);
+
+    if (Ns > MAX_COMPONENTS)
+    {
+        return RET_FAILURE_FILE_UNSUPPORTED;
+    }
+
+    assert(scan != NULL);
+
+    scan->Ns = Ns;
+
+    for (int j = 0; j < Ns; ++j)
+    {
+        uint8_t Cs;
+        uint8_t Td, Ta;
+
+        err = read_byte(stream, &Cs);
+        RETURN_IF(err);
+        err = read_nibbles(stream, &Td, &Ta);
+        RETURN_IF(err);
+
+        TRACE(context, "Cs%i = %" PRIu8 " (Component identifier), Td%i = %" PRIu8 " (DC HT identifier), Ta%i = %" PRIu8 " (AC HT identifier)\n", j, Cs, j, Td, j, Ta);
+
+        int i = component_index(context, Cs);
+
+        if (i == -1)
+        {
+            /* missing SOF before SOS? */
+            return RET_FAILURE_FILE_UNSUPPORTED;
+        }
+
+        scan->Cs[j] = (uint8_t)i;
+
+        context->component[i].Td = Td;
+        context->component[i].Ta = Ta;
+    }
+
+    uint8_t Ss;
+    uint8_t Se;
+    uint8_t Ah, Al;
+
+    err = read_byte(stream, &Ss);
+    RETURN_IF(err);
+    err = read_byte(stream, &Se);
+    RETURN_IF(err);
+    err = read_nibbles(stream, &Ah, &Al);
+    RETURN_IF(err);
+
+    if (Ss != 0 || Se != 63)
+    {
+        return RET_FAILURE_FILE_UNSUPPORTED;
+    }
+
+    assert(Ss == 0);
+    assert(Se == 63);
+    TRACE(context, "Ss = %" PRIu8 " (the first DCT coefficient), Se = %" PRIu8 " (the last DCT coefficient)\n", Ss, Se);
+
+    if (Ah != 0 || Al != 0)
+    {
+        return RET_FAILURE_FILE_UNSUPPORTED;
+    }
+
+    assert(Ah == 0);
+    assert(Al == 0);
+    TRACE(context, "Ah = %" PRIu8 " (bit position high), Al = %" PRIu8 " (bit position low)\n", Ah, Al);
+
+    context->mblocks = 0;
+
+    scan->blocks = 0;
+    scan->interval = 0;
+    scan->restarts = 0;
+
+    return RET_SUCCESS;
+}
+
+/* read the block, remove differential DC coding, and reconstruct it right away when fused */
+/* validation: the quantized coefficients must fit the precision (F.1.2.1.1, F.1.2.2.1) */
+static void check_block(struct context *context, struct jpegm_report *report, const struct int_block *int_block)
+{
+    int32_t limit = INT32_C(1) << (context->P + 3);
+
+    for (int i = 0; i < 64; ++i)
+    {
+        if (int_block->c[i] >= limit || int_block->c[i] <= -limit)
+        {
+            report->bad_coefficients++;
+        }
+    }
+}
+
+/* validation: blocks of an MCU of the scan */
+static size_t scan_mcu_blocks(struct context *context, const struct scan *scan)
+{
+    /* A.2.2 Non-interleaved order: a single block */
+    if (scan->Ns == 1)
+    {
+        return 1;
+    }
+
+    size_t blocks = 0;
+
+    for (int j = 0; j < scan->Ns; ++j)
+    {
+        blocks += context->component[scan->Cs[j]].H * context->component[scan->Cs[j]].V;
+    }
+
+    return blocks;
+}
+
+/* validation: blocks of the scan (A.2.2, A.2.3) */
+static size_t scan_blocks(struct context *context, const struct scan *scan)
+{
+    if (scan->Ns == 1)
+    {
+        struct component *component = &context->component[scan->Cs[0]];
+
+        size_t x = ceil_div(ceil_div((size_t)context->X * component->H, context->max_H), 8);
+        size_t y = ceil_div(ceil_div((size_t)context->Y * component->V, context->max_V), 8);
+
+        return x * y;
+    }
+
+    return context->m_x * context->m_y * scan_mcu_blocks(context, scan);
+}
+
+/* validation: RSTm closes an interval of exactly Ri MCUs, m counts modulo 8 */
+static void check_restart(struct context *context, struct scan *scan, uint16_t marker)
+{
+    struct jpegm_report *report = scan->report;
+
+    report->restarts++;
+
+    if ((size_t)(marker & 7) != scan->restarts % 8 || context->Ri == 0 || scan->blocks - scan->interval != context->Ri * scan_mcu_blocks(context, scan))
+    {
+        report->bad_restarts++;
+    }
+
+    scan->restarts++;
+}
+
+/* validation: the scan is complete (or cut short) */
+static void check_scan(struct context *context, struct scan *scan)
+{
+    struct jpegm_report *report = scan->report;
+
+    if (scan->Ns == 0)
+    {
+        return;
+    }
+
+    size_t expected = scan_blocks(context, scan);
+
+    report->scans++;
+    report->blocks += scan->blocks;
+    report->blocks_expected += expected;
+
+    if (scan->blocks < expected)
+    {
+        report->short_scans++;
+    }
+
+    /* the last interval may be shorter */
+    if (context->Ri != 0 && scan->blocks - scan->interval > context->Ri * scan_mcu_blocks(context, scan))
+    {
+        report->bad_restarts++;
+    }
+
+    /* counted once */
+    scan->Ns = 0;
+}
+
+int read_mcu_block(struct bits *bits, struct context *context, struct scan *scan, uint8_t Cs, size_t block_x, size_t block_y)
+{
+    int err;
+
+    struct component *component = &context->component[Cs];
+
+    assert(block_x < component->b_x);
+
+    /* outside the crop: decoded for the DC prediction only */
+    int outside = block_x < context->m_x0 * component->H || block_x >= context->m_x1 * component->H
+        || block_y < context->m_y0 * component->V || block_y >= context->m_y1 * component->V;
+
+    /* the fused pipeline and the validation have no coefficient buffers, the block lives only here */
+    struct int_block scratch;
+
+    struct int_block *int_block = context->fused || context->validate || outside ? &scratch : &component->int_buffer[block_seq(context, component, block_x, block_y)];
+
+    /* past the end of data? */
+    if (block_y >= component->b_y)
+    {
+        if (scan->report != NULL)
+        {
+            /* a whole block more than the frame needs */
+            err = read_block(bits, context, component, &scratch);
+            RETURN_IF(err);
+
+            scan->report->long_scans++;
+
+            return RET_FAILURE_NO_MORE_DATA;
+        }
+
+        int_block = NULL;
+    }
+
+    /* read block */
+    err = read_block(bits, context, component, int_block);
+    RETURN_IF(err);
+
+    /* remove differential DC coding */
+    int_block->c[0] += scan->pred[Cs];
+
+    scan->pred[Cs] = int_block->c[0];
+
+    scan->blocks++;
+
+    if (scan->report != NULL)
+    {
+        check_block(context, scan->report, int_block);
+    }
+
+    if (context->fused && !outside)
+    {
+        reconstruct_block(context, component, int_block, block_x, block_y);
+    }
+
+    return RET_SUCCESS;
+}
+
+/* read MCU */
+int read_macroblock(struct bits *bits, struct context *context, struct scan *scan)
+{
+    int err;
+
+    assert(scan != NULL);
+    assert(context != NULL);
+
+    size_t seq_no = context->mblocks;
+
+    if (scan->Ns == 0)
+    {
+        /* nothing to do */
+        return RET_FAILURE_NO_MORE_DATA;
+    }
+    else if (scan->Ns == 1)
+    {
+        /* A.2.2 Non-interleaved order (Ns = 1) */
+        assert(scan->Ns == 1);
+
+        uint8_t Cs = scan->Cs[0];
+
+        uint8_t H = context->component[Cs].H;
+        uint8_t V = context->component[Cs].V;
+
+        size_t blocks_in_mb = H * V;
+
+        for (size_t w = 0; w < blocks_in_mb; ++w)
+        {
+            size_t block_x = (blocks_in_mb * seq_no + w) % context->component[Cs].b_x;
+            size_t block_y = (blocks_in_mb * seq_no + w) / context->component[Cs].b_x;
+
+            err = read_mcu_block(bits, context, scan, Cs, block_x, block_y);
+            RETURN_IF(err);
+        }
+    }
+    else
+    {
+        assert(scan->Ns > 1);
+
+        if (context->m_x == 0)
+        {
+            /* missing SOF before SOS? */
+            return RET_FAILURE_FILE_UNSUPPORTED;
+        }
+
+        assert(context->m_x != 0);
+
+        size_t x = seq_no % context->m_x;
+        size_t y = seq_no / context->m_x;
+
+// 		printf("[DEBUG] reading macroblock... x=%zu y=%zu\n", x, y);
+
+        /* for each component */
+        for (int j = 0; j < scan->Ns; ++j)
+        {
+            uint8_t Cs = scan->Cs[j];
+            uint8_t H = context->component[Cs].H;
+            uint8_t V = context->component[Cs].V;
+
+// 			printf("[DEBUG] reading component %" PRIu8 " blocks @ x=%zu y=%zu\n", Cs, x * H, y * V);
+
+            /* for each 8x8 block */
+            for (int v = 0; v < V; ++v)
+            {
+                for (int h = 0; h < H; ++h)
+                {
+                    size_t block_x = x * H + h;
+                    size_t block_y = y * V + v;
+
+// 					printf("[DEBUG] reading component %" PRIu8 " blocks @ x=%zu y=%zu out of X=%zu Y=%zu\n", Cs, x * H + h, y * V + v, context->component[Cs].b_x, context->component[Cs].b_y);
+
+                    err = read_mcu_block(bits, context, scan, Cs, block_x, block_y);
+                    RETURN_IF(err);
+                }
+            }
+        }
+    }
+
+    return RET_SUCCESS;
+}
+
+/* streaming: the scan must cover all components in MCU rows */
+int start_streaming(struct context *context, struct scan *scan, struct output *output)
+{
+    int err;
+
+    assert(context != NULL);
+    assert(scan != NULL);
+    assert(output != NULL);
+
+    uint8_t Cs = scan->Cs[0];
+
+    if (output->started || scan->Ns != context->Nf || (scan->Ns == 1 && (context->component[Cs].H != 1 || context->component[Cs].V != 1)))
+    {
+        TRACE_ERROR(context, "Streaming needs a single interleaved scan!\n");
+        return RET_FAILURE_FILE_UNSUPPORTED;
+    }
+
+    if (output->pixels != NULL)
+    {
+        err = pixels_prepare(context, output->pixels);
+        RETURN_IF(err);
+    }
+    else
+    {
+        err = frame_create_band(context, &output->band);
+        RETURN_IF(err);
+
+        /* the header describes the whole image */
+        output->band.Y = context->Y;
+
+        err = write_frame_open(&output->band, output->path, &output->stream);
+        RETURN_IF(err);
+    }
+
+    output->started = 1;
+    output->m_y = 0;
+
+    return RET_SUCCESS;
+}
+
+/* streaming: write all MCU rows above m_y */
+int write_mcu_rows(struct context *context, struct output *output, size_t m_y)
+{
+    int err;
+
+    assert(context != NULL);
+    assert(output != NULL);
+
+    struct frame *band = &output->band;
+
+    for (; output->m_y < m_y; output->m_y++)
+    {
+        size_t y = output->m_y;
+
+        if (output->pixels != NULL)
+        {
+            pack_mcu_row(context, output->pixels, y);
+            continue;
+        }
+
+        /* the blocks have been reconstructed while decoding */
+        transform_mcu_row_to_frame(context, band, y);
+
+        /* the last band may be cropped */
+        band->Y = (uint16_t)(context->Y - y * band->size_y < band->size_y ? context->Y - y * band->size_y : band->size_y);
+
+        err = frame_to_rgb(band);
+        RETURN_IF(err);
+
+        err = write_frame_rows(band, output->stream);
+        RETURN_IF(err);
+    }
+
+    return RET_SUCCESS;
+}
+
+/* the macroblocks of the scan (the decoder's order), their row length and the crop in them */
+static int scan_units(struct context *context, const struct scan *scan, size_t *row, size_t *x0, size_t *x1, size_t *y0, size_t *y1)
+{
+    if (scan->Ns > 1)
+    {
+        *row = context->m_x;
+        *x0 = context->m_x0;
+        *x1 = context->m_x1;
+        *y0 = context->m_y0;
+        *y1 = context->m_y1;
+
+        return 1;
+    }
+
+    struct component *component = &context->component[scan->Cs[0]];
+
+    /* A.2.2 Non-interleaved order: the macroblocks are the blocks */
+    if (component->H != 1 || component->V != 1)
+    {
+        return 0;
+    }
+
+    *row = component->b_x;
+    *x0 = context->m_x0;
+    *x1 = context->m_x1;
+    *y0 = context->m_y0;
+    *y1 = context->m_y1;
+
+    return 1;
+}
+
+/* crop: the macroblocks that follow have no block of the crop */
+static int scan_past_crop(struct context *context, const struct scan *scan)
+{
+    if (context->crop_w == 0 || context->validate || scan->Ns == 0)
+    {
+        return 0;
+    }
+
+    if (scan->Ns > 1)
+    {
+        return context->mblocks / context->m_x >= context->m_y1;
+    }
+
+    struct component *component = &context->component[scan->Cs[0]];
+
+    size_t block_y = component->H * component->V * context->mblocks / component->b_x;
+
+    return block_y >= context->m_y1 * component->V;
+}
+
+/* crop: the restart interval starting at context->mblocks has no block of the crop */
+static int interval_outside_crop(struct context *context, const struct scan *scan)
+{
+    size_t row, x0, x1, y0, y1;
+
+    if (context->crop_w == 0 || context->validate || context->Ri == 0 || scan->Ns == 0 || !scan_units(context, scan, &row, &x0, &x1, &y0, &y1))
+    {
+        return 0;
+    }
+
+    size_t first = context->mblocks;
+    size_t last = context->mblocks + context->Ri - 1;
+
+    if (last / row < y0 || first / row >= y1)
+    {
+        return 1;
+    }
+
+    /* within a single row, left or right of the crop */
+    return first / row == last / row && (last % row < x0 || first % row >= x1);
+}
+
+int read_ecs(FILE *stream, struct context *context, struct scan *scan, struct output *output)
+{
+    int err;
+    struct bits bits;
+
+    init_bits(&bits, stream);
+
+    scan->interval = scan->blocks;
+
+    /* the restart interval has nothing of the crop, DC prediction restarts with the next one */
+    if (interval_outside_crop(context, scan))
+    {
+        context->mblocks += context->Ri;
+
+        return skip_ecs(stream);
+    }
+
+    for (int i = 0; i < MAX_COMPONENTS; ++i)
+    {
+        scan->pred[i] = 0;
+    }
+
+    /* loop over macroblocks */
+    do
+    {
+        if (scan_past_crop(context, scan))
+        {
+            err = skip_ecs(stream);
+            RETURN_IF(err);
+            goto end;
+        }
+
+        err = read_macroblock(&bits, context, scan);
+        if (err == RET_FAILURE_NO_MORE_DATA)
+            goto end;
+        RETURN_IF(err);
+        context->mblocks++;
+
+        /* MCU row completed */
+        if (output->started && context->mblocks % context->m_x == 0)
+        {
+            err = write_mcu_rows(context, output, context->mblocks / context->m_x);
+            RETURN_IF(err);
+        }
+    }
+    while (1);
+
+end:
+    TRACE(context, "Processed: %zu macroblocks\n", context->mblocks);
+
+    return RET_SUCCESS;
+}
+
+int parse_restart_interval(FILE *stream, struct context *context)
+{
+    int err;
+    uint16_t Ri;
+
+    err = read_word(stream, &Ri);
+    RETURN_IF(err);
+
+    context->Ri = Ri;
+
+    return RET_SUCCESS;
+}
+
+int parse_comment(FILE *stream, struct context *context, uint16_t len)
+{
+    if (len < 2)
+    {
+        return RET_FAILURE_FILE_UNSUPPORTED;
+    }
+
+    assert(len >= 2);
+
+    size_t l = len - 2;
+
+    char *buf = arena_alloc(&context->arena, l + 1);
+
+    if (buf == NULL)
+    {
+        return RET_FAILURE_MEMORY_ALLOCATION;
+    }
+
+    if (fread(buf, sizeof(char), l, stream) != l)
+    {
+        arena_free(&context->arena, buf);
+        return RET_FAILURE_FILE_IO;
+    }
+
+    buf[l] = 0;
+
+    TRACE(context, "%s\n", buf);
+
+    arena_free(&context->arena, buf);
+
+    return RET_SUCCESS;
+}
+
+int write_image(struct context *context, const char *path)
+{
+    int err;
+
+    struct frame frame;
+
+    err = frame_create(context, &frame);
+    RETURN_IF(err);
+
+    err = frame_to_rgb(&frame);
+
+    if (err)
+    {
+        goto end;
+    }
+
+    err = write_frame(&frame, path);
+
+end:
+    frame_destroy(&frame);
+
+    return err;
+}
+
+/* the epilogue in parallel MCU-row bands */
+int write_image_bands(struct context *context, const char *path)
+{
+    int err;
+
+    struct frame frame;
+
+    err = frame_reconstruct(context, &frame);
+    RETURN_IF(err);
+
+    err = write_frame(&frame, path);
+
+    frame_destroy(&frame);
+
+    return err;
+}
+
+/* the image into the buffer of the caller, without a frame, in parallel bands when there is a pool */
+int pack_image(struct context *context, struct pixels *pixels)
+{
+    int err;
+
+    err = pixels_prepare(context, pixels);
+    RETURN_IF(err);
+
+    /* the crop is reconstructed in MCU rows, the buffers hold only its blocks */
+    if (context->pool != NULL || context->crop_w != 0)
+    {
+        return pixels_reconstruct(context, pixels);
+    }
+
+    err = dequantize(context);
+    RETURN_IF(err);
+    err = inverse_dct(context);
+    RETURN_IF(err);
+    err = conv_blocks_to_frame(context);
+    RETURN_IF(err);
+
+    for (size_t m_y = 0; m_y < context->m_y; ++m_y)
+    {
+        pack_mcu_row(context, pixels, m_y);
+    }
+
+    return RET_SUCCESS;
+}
+
+/* the crop into a PPM/PGM file */
+int write_crop(struct context *context, const char *path)
+{
+    int err;
+
+    struct pixels pixels = { JPEGM_FORMAT_AUTO, NULL, 0, 0, 0 };
+
+    err = pack_image(context, &pixels);
+
+    if (!err)
+    {
+        size_t x0, y0, x1, y1;
+
+        crop_region(context, &x0, &y0, &x1, &y1);
+
+        err = write_pixels(&pixels, x1 - x0, y1 - y0, context->P, path);
+    }
+
+    if (pixels.owned)
+    {
+        free(pixels.data);
+    }
+
+    return err;
+}
+
+int epilogue(struct context *context, struct output *output)
+{
+    int err;
+
+    if (context->validate || context->coefficients)
+    {
+        /* no image */
+        return RET_SUCCESS;
+    }
+
+    if (output->streaming)
+    {
+        if (!output->started)
+        {
+            /* no scan */
+            return RET_FAILURE_FILE_UNSUPPORTED;
+        }
+
+        /* rows that were not decoded (truncated stream) */
+        err = write_mcu_rows(context, output, context->m_y);
+        RETURN_IF(err);
+
+        return RET_SUCCESS;
+    }
+
+    if (output->pixels != NULL)
+    {
+        return pack_image(context, output->pixels);
+    }
+
+    if (context->crop_w != 0)
+    {
+        return write_crop(context, output->path);
+    }
+
+    if (context->pool != NULL)
+    {
+        return write_image_bands(context, output->path);
+    }
+
+    err = dequantize(context);
+    RETURN_IF(err);
+    err = inverse_dct(context);
+    RETURN_IF(err);
+    err = conv_blocks_to_frame(context);
+    RETURN_IF(err);
+    err = write_image(context, output->path);
+    RETURN_IF(err);
+
+    return RET_SUCCESS;
+}
+
+static int parse_markers(FILE *stream, struct context *context, struct output *output, struct scan *scan)
+{
+    int err;
+
+    while (1)
+    {
+        uint16_t marker;
+
+        long start = ftell(stream);
+
+        err = read_marker(stream, &marker);
+        RETURN_IF(err);
+
+        if (ftell(stream) - start != 2)
+        {
+            TRACE(context, "*** %li bytes skipped ***\n", ftell(stream) - start - 2);
+        }
+
+        /* An asterisk (*) indicates a marker which stands alone,
+         * that is, which is not the start of a marker segment. */
+        switch (marker)
+        {
+            uint16_t len;
+            long pos;
+
+        /* SOI* Start of image */
+        case 0xffd8:
+            TRACE(context, "SOI\n");
+            break;
+        /* APPn */
+        case 0xffe0:
+        case 0xffe1:
+        case 0xffe2:
+        case 0xffe3:
+        case 0xffe4:
+        case 0xffe5:
+        case 0xffe6:
+        case 0xffe7:
+        case 0xffe8:
+        case 0xffeb:
+        case 0xffec:
+        case 0xffed:
+        case 0xffee:
+            TRACE(context, "APP%i\n", marker & 0xf);
+            err = read_length(stream, &len);
+            RETURN_IF(err);
+            err = skip_segment(stream, len);
+            RETURN_IF(err);
+            break;
+        /* DQT Define quantization table(s) */
+        case 0xffdb:
+            TRACE(context, "DQT\n");
+            pos = ftell(stream);
+            err = read_length(stream, &len);
+            RETURN_IF(err);
+            do
+            {
+                err = parse_qtable(stream, context);
+                RETURN_IF(err);
+            }
+            while (ftell(stream) < pos + len);
+            break;
+        /* SOF0 Baseline DCT */
+        case 0xffc0:
+            TRACE(context, "SOF0\n");
+            err = read_length(stream, &len);
+            RETURN_IF(err);
+            err = parse_frame_header(stream, context);
+            RETURN_IF(err);
+            err = compute_no_blocks_and_alloc_buffers(context);
+            RETURN_IF(err);
+            break;
+        /* SOF1 Extended sequential DCT */
+        case 0xffc1:
+            TRACE(context, "SOF1\n");
+            err = read_length(stream, &len);
+            RETURN_IF(err);
+            err = parse_frame_header(stream, context);
+            RETURN_IF(err);
+            err = compute_no_blocks_and_alloc_buffers(context);
+            RETURN_IF(err);
+            break;
+        /* SOF2 Progressive DCT */
+        case 0xffc2:
+            TRACE(context, "SOF2\n");
+            err = read_length(stream, &len);
+            RETURN_IF(err);
+            err = parse_frame_header(stream, context);
+            RETURN_IF(err);
+            TRACE_ERROR(context, "Progressive DCT not supported!\n");
+            return RET_FAILURE_FILE_UNSUPPORTED;
+        /* SOF3 Lossless (sequential) */
+        case 0xffc3:
+            TRACE(context, "SOF3\n");
+            err = read_length(stream, &len);
+            RETURN_IF(err);
+            err = parse_frame_header(stream, context);
+            RETURN_IF(err);
+            TRACE_ERROR(context, "Lossless JPEG not supported!\n");
+            return RET_FAILURE_FILE_UNSUPPORTED;
+        /* SOF9 Extended sequential DCT (arithmetic coding) */
+        case 0xffc9:
+            TRACE(context, "SOF9\n");
+            err = read_length(stream, &len);
+            RETURN_IF(err);
+            err = parse_frame_header(stream, context);
+            RETURN_IF(err);
+            TRACE_ERROR(context, "Arithmetic coding not supported!\n");
+            return RET_FAILURE_FILE_UNSUPPORTED;
+        /* SOF10 Progressive DCT (arithmetic coding) */
+        case 0xffca:
+            TRACE(context, "SOF10\n");
+            err = read_length(stream, &len);
+            RETURN_IF(err);
+            err = parse_frame_header(stream, context);
+            RETURN_IF(err);
+            TRACE_ERROR(context, "Arithmetic coding not supported!\n");
+            return RET_FAILURE_FILE_UNSUPPORTED;
+        /* DHT Define Huffman table(s) */
+        case 0xffc4:
+            TRACE(context, "DHT\n");
+            pos = ftell(stream);
+            err = read_length(stream, &len);
+            RETURN_IF(err);
+            /* parse multiple tables in single DHT */
+            do
+            {
+                err = parse_huffman_tables(stream, context);
+                RETURN_IF(err);
+            }
+            while (ftell(stream) < pos + len);
+            break;
+        /* SOS Start of scan */
+        case 0xffda:
+            TRACE(context, "SOS\n");
+            if (scan->report != NULL)
+            {
+                check_scan(context, scan);
+            }
+            err = read_length(stream, &len);
+            RETURN_IF(err);
+            err = parse_scan_header(stream, context, scan);
+            RETURN_IF(err);
+            if (output->streaming)
+            {
+                err = start_streaming(context, scan, output);
+                RETURN_IF(err);
+            }
+            err = read_ecs(stream, context, scan, output);
+            RETURN_IF(err);
+            break;
+        /* EOI* End of image */
+        case 0xffd9:
+            TRACE(context, "EOI\n");
+            if (scan->report != NULL)
+            {
+                check_scan(context, scan);
+                scan->report->eoi = 1;
+            }
+            pos = ftell(stream);
+            fseek(stream, 0, SEEK_END);
+            if (ftell(stream) - pos > 0)
+            {
+                TRACE(context, "*** %li bytes of garbage ***\n", ftell(stream) - pos);
+            }
+            err = epilogue(context, output);
+            RETURN_IF(err);
+            return RET_SUCCESS;
+        /* DRI Define restart interval */
+        case 0xffdd:
+            TRACE(context, "DRI\n");
+            err = read_length(stream, &len);
+            RETURN_IF(err);
+            err = parse_restart_interval(stream, context);
+            RETURN_IF(err);
+            break;
+        /* RSTm* Restart with modulo 8 count “m” */
+        case 0xffd0:
+        case 0xffd1:
+        case 0xffd2:
+        case 0xffd3:
+        case 0xffd4:
+        case 0xffd5:
+        case 0xffd6:
+        case 0xffd7:
+            TRACE(context, "RST%i\n", marker & 0xf);
+            if (scan->report != NULL)
+            {
+                check_restart(context, scan, marker);
+            }
+            err = read_ecs(stream, context, scan, output);
+            RETURN_IF(err);
+            break;
+        /* COM Comment */
+        case 0xfffe:
+            TRACE(context, "COM\n");
+            err = read_length(stream, &len);
+            RETURN_IF(err);
+            err = parse_comment(stream, context, len);
+            RETURN_IF(err);
+            break;
+        /* TEM* For temporary private use in arithmetic coding */
+        case 0xff01:
+            TRACE(context, "TEM\n");
+            break;
+        /* DAC Define arithmetic coding conditioning(s) */
+        case 0xffcc:
+            TRACE(context, "DAC\n");
+            err = read_length(stream, &len);
+            RETURN_IF(err);
+            err = skip_segment(stream, len);
+            RETURN_IF(err);
+            break;
+        default:
+            TRACE_ERROR(context, "unhandled marker 0x%" PRIx16 "\n", marker);
+            return RET_FAILURE_FILE_UNSUPPORTED;
+        }
+    }
+}
+
+int parse_format(FILE *stream, struct context *context, struct output *output)
+{
+    int err;
+
+    struct scan scan;
+
+    // init
+    scan.Ns = 0;
+    scan.report = output->report;
+
+    err = parse_markers(stream, context, output, &scan);
+
+    /* the scan cut short by the error */
+    if (err && scan.report != NULL)
+    {
+        check_scan(context, &scan);
+    }
+
+    return err;
+}
+
+static void init_report(struct jpegm_report *report)
+{
+    report->valid = 0;
+    report->error = RET_SUCCESS;
+    report->eoi = 0;
+    report->scans = 0;
+    report->short_scans = 0;
+    report->long_scans = 0;
+    report->blocks = 0;
+    report->blocks_expected = 0;
+    report->bad_coefficients = 0;
+    report->restarts = 0;
+    report->bad_restarts = 0;
+}
+
+static void finish_report(struct jpegm_report *report, int err)
+{
+    report->error = err;
+
+    report->valid = err == RET_SUCCESS && report->eoi && report->scans > 0
+        && report->short_scans == 0 && report->long_scans == 0
+        && report->bad_coefficients == 0 && report->bad_restarts == 0;
+}
+
+/* parse the markers up to the frame header (SOFn), the segments in between are skipped */
+int probe_format(FILE *stream, struct context *context, uint16_t *sof)
+{
+    int err;
+
+    assert(context != NULL);
+    assert(sof != NULL);
+
+    while (1)
+    {
+        uint16_t marker;
+        uint16_t len;
+
+        err = read_marker(stream, &marker);
+        RETURN_IF(err);
+
+        switch (marker)
+        {
+        /* SOI* Start of image */
+        case 0xffd8:
+        /* RSTm* */
+        case 0xffd0:
+        case 0xffd1:
+        case 0xffd2:
+        case 0xffd3:
+        case 0xffd4:
+        case 0xffd5:
+        case 0xffd6:
+        case 0xffd7:
+        /* TEM* */
+        case 0xff01:
+            break;
+        /* SOFn */
+        case 0xffc0:
+        case 0xffc1:
+        case 0xffc2:
+        case 0xffc3:
+        case 0xffc5:
+        case 0xffc6:
+        case 0xffc7:
+        case 0xffc9:
+        case 0xffca:
+        case 0xffcb:
+        case 0xffcd:
+        case 0xffce:
+        case 0xffcf:
+            err = read_length(stream, &len);
+            RETURN_IF(err);
+            err = parse_frame_header(stream, context);
+            RETURN_IF(err);
+            *sof = marker;
+            return RET_SUCCESS;
+        /* no frame header */
+        case 0xffda:
+        case 0xffd9:
+            return RET_FAILURE_FILE_UNSUPPORTED;
+        /* APPn, DQT, DHT, DRI, COM, DAC, ... */
+        default:
+            err = read_length(stream, &len);
+            RETURN_IF(err);
+            if (len < 2)
+            {
+                return RET_FAILURE_FILE_UNSUPPORTED;
+            }
+            err = skip_segment(stream, len);
+            RETURN_IF(err);
+        }
+    }
+}
+
+int decode_stream(FILE *stream, struct context *context, struct output *output)
+{
+    int err;
+
+    assert(context != NULL);
+    assert(output != NULL);
+
+    context->pool = output->pool;
+
+    context->crop_x = output->crop_x;
+    context->crop_y = output->crop_y;
+    context->crop_w = output->crop_w;
+    context->crop_h = output->crop_h;
+
+    /* the buffers hold only the crop anyway */
+    if (context->crop_w != 0)
+    {
+        output->streaming = 0;
+    }
+
+    if (output->report != NULL)
+    {
+        init_report(output->report);
+
+        context->validate = 1;
+
+        output->streaming = 0;
+    }
+    else if (output->streaming)
+    {
+        /* a single MCU row of samples, no coefficient buffers */
+        context->m_rows = 1;
+        context->fused = 1;
+    }
+
+    err = parse_format(stream, context, output);
+
+    if (output->report != NULL)
+    {
+        finish_report(output->report, err);
+    }
+
+    if (output->stream != NULL)
+    {
+        fclose(output->stream);
+        output->stream = NULL;
+    }
+
+    frame_destroy(&output->band);
+
+    return err;
+}
@@ -0,0 +1,51 @@
+#ifndef JPEG_DECODE_H
+#define JPEG_DECODE_H
+
+#include <stdio.h>
+#include "common.h"
+#include "frame.h"
+
+/* where and how to write the decoded image */
+struct output
+{
+    const char *path;
+
+    /* write the lines as soon as their MCU row has been decoded */
+    int streaming;
+
+    FILE *stream;
+
+    /* a single MCU row of the image */
+    struct frame band;
+
+    /* streaming: the scan has started */
+    int started;
+
+    /* MCU rows written so far */
+    size_t m_y;
+
+    /* threads for the epilogue (-j), NULL = serial phases */
+    struct pool *pool;
+
+    /* color convert the image into the buffer of the caller instead of writing it */
+    struct pixels *pixels;
+
+    /* only check the stream (no image) */
+    struct jpegm_report *report;
+
+    /* decode only this rectangle (crop_w == 0 = the whole image) */
+    uint16_t crop_x, crop_y, crop_w, crop_h;
+};
+
+void init_output(struct output *output, const char *path);
+
+/* parse the markers up to EOI and produce the output */
+int parse_format(FILE *stream, struct context *context, struct output *output);
+
+/* parse the markers up to SOFn (sof), the context holds the frame header (no buffers) */
+int probe_format(FILE *stream, struct context *context, uint16_t *sof);
+
+/* decode the JPEG stream with an initialized context, the output is closed */
+int decode_stream(FILE *stream, struct context *context, struct output *output);
+
+#endif
@@ -0,0 +1,1451 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "common.h"
+#include "frame.h"
+#include "coeffs.h"
+#include "imgproc.h"
+#include "huffman.h"
+#include "pool.h"
+#include "encode.h"
+
+/* K.1 Quantization tables for luminance and chrominance components */
+const unsigned int std_luminance_quant_tbl[64] =
+{
+    16,  11,  10,  16,  24,  40,  51,  61,
+    12,  12,  14,  19,  26,  58,  60,  55,
+    14,  13,  16,  24,  40,  57,  69,  56,
+    14,  17,  22,  29,  51,  87,  80,  62,
+    18,  22,  37,  56,  68, 109, 103,  77,
+    24,  35,  55,  64,  81, 104, 113,  92,
+    49,  64,  78,  87, 103, 121, 120, 101,
+    72,  92,  95,  98, 112, 100, 103,  99
+};
+
+const unsigned int std_chrominance_quant_tbl[64] =
+{
+    17,  18,  24,  47,  99,  99,  99,  99,
+    18,  21,  26,  66,  99,  99,  99,  99,
+    24,  26,  56,  99,  99,  99,  99,  99,
+    47,  66,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99
+};
+
+/* 0..100 to scaling_factor */
+/* according to https://github.com/libjpeg-turbo/ijg/blob/master/jcparam.c */
+int quality_to_sf(int q)
+{
+    if (q < 1)
+    {
+        q = 1;
+    }
+    if (q > 100)
+    {
+        q = 100;
+    }
+
+    int sf;
+
+    if (q < 50)
+    {
+        sf = 5000 / q;
+    }
+    else
+    {
+        sf = 200 - q * 2;
+    }
+
+    return sf;
+}
+
+void set_qtable(struct qtable *qtable, const unsigned int Q_ref[64], int q)
+{
+    int sf = quality_to_sf(q);
+
+    uint16_t Q[64];
+
+    for (int i = 0; i < 64; ++i)
+    {
+        Q[i] = clamp(1, (Q_ref[i] * sf + 50) / 100, 255);
+    }
+
+    update_qtable(qtable, 0, Q);
+}
+
+void init_params(struct params *params)
+{
+    assert(params != NULL);
+
+    params->H = 2;
+    params->V = 1;
+
+    params->q = 75;
+
+    params->optimize = 1;
+
+    params->threads = -1;
+
+    params->Ri = 0;
+
+    params->segments = NULL;
+    params->segments_size = 0;
+}
+
+/* the components, tables and buffers for the image described by the frame header, the (empty) frame is created in the context arena */
+int setup_image(struct context *context, struct params *params, struct frame *frame)
+{
+    int err;
+
+    assert(context != NULL);
+    assert(frame != NULL);
+
+    /* the DCT-based processes code 8-bit or 12-bit samples only */
+    if (frame->precision != 8 && frame->precision != 12)
+    {
+        return RET_FAILURE_FILE_UNSUPPORTED;
+    }
+
+    context->Y = frame->Y;
+    context->X = frame->X;
+    context->P = frame->precision;
+
+    /* component identifiers 1, 2, 3 */
+    for (int i = 0; i < frame->components; ++i)
+    {
+        struct component *component;
+
+        err = add_component(context, (uint8_t)(i + 1), &component);
+        RETURN_IF(err);
+    }
+
+    switch (frame->components)
+    {
+    case 1:
+        context->component[0].H = 1;
+        context->component[0].V = 1;
+
+        context->component[0].Tq = 0;
+
+        context->component[0].Td = 0;
+        context->component[0].Ta = 0;
+
+        context->max_H = 1;
+        context->max_V = 1;
+        break;
+    case 3:
+        assert(params->H >= 1 && params->H <= 2);
+        assert(params->V >= 1 && params->V <= 2);
+
+        context->component[0].H = params->H;
+        context->component[0].V = params->V;
+        context->component[1].H = 1;
+        context->component[1].V = 1;
+        context->component[2].H = 1;
+        context->component[2].V = 1;
+
+        context->component[0].Tq = 0;
+        context->component[1].Tq = 1;
+        context->component[2].Tq = 1;
+
+        context->component[0].Td = 0;
+        context->component[0].Ta = 0;
+        context->component[1].Td = 1;
+        context->component[1].Ta = 1;
+        context->component[2].Td = 1;
+        context->component[2].Ta = 1;
+
+        context->max_H = params->H;
+        context->max_V = params->V;
+        break;
+    default:
+        return RET_FAILURE_FILE_UNSUPPORTED;
+    }
+
+    set_qtable(&context->qtable[0], std_luminance_quant_tbl, params->q);
+    set_qtable(&context->qtable[1], std_chrominance_quant_tbl, params->q);
+
+    /* before the frame, so that the frame is reclaimed from the arena once transformed */
+    err = compute_no_blocks_and_alloc_buffers(context);
+    RETURN_IF(err);
+
+    err = frame_create_empty(context, frame);
+    RETURN_IF(err);
+
+    return RET_SUCCESS;
+}
+
+/* the frame is left in RGB, in the context arena */
+int read_image(struct context *context, FILE *stream, struct params *params, struct frame *frame)
+{
+    int err;
+
+    assert(context != NULL);
+    assert(frame != NULL);
+
+    // load PPM/PGM header, detect X, Y, number of components, bpp
+    err = read_frame_header(frame, stream);
+    RETURN_IF(err);
+
+    TRACE(context, "read PPM/PGM header: Nf=%" PRIu8 " Y=%" PRIu16 " X=%" PRIu16 " P=%" PRIu8 "\n", frame->components, frame->Y, frame->X, frame->precision);
+
+    err = setup_image(context, params, frame);
+    RETURN_IF(err);
+
+    // load frame body
+    err = read_frame_body(frame, stream);
+
+    if (err)
+    {
+        frame_destroy(frame);
+    }
+
+    return err;
+}
+
+/* frame_to_ycc(), transform_frame_to_components(), conv_frame_to_blocks(), forward_dct(), quantize(), the frame is destroyed */
+int prologue_frame(struct context *context, struct frame *frame)
+{
+    int err;
+
+    if (context->pool != NULL)
+    {
+        /* in parallel MCU-row bands */
+        err = frame_decompose(context, frame);
+
+        frame_destroy(frame);
+
+        return err;
+    }
+
+    err = frame_to_ycc(frame);
+
+    if (err)
+    {
+        frame_destroy(frame);
+        return err;
+    }
+
+    // copy frame->data[] into context->component[]->frame_buffer[]
+    transform_frame_to_components(context, frame);
+
+    frame_destroy(frame);
+
+    err = conv_frame_to_blocks(context);
+    RETURN_IF(err);
+
+    err = forward_dct(context);
+    RETURN_IF(err);
+
+    err = quantize(context);
+    RETURN_IF(err);
+
+    return RET_SUCCESS;
+}
+
+/* read_image(), prologue_frame() */
+int prologue(struct context *context, FILE *i_stream, struct params *params)
+{
+    int err;
+
+    struct frame frame;
+
+    err = read_image(context, i_stream, params, &frame);
+    RETURN_IF(err);
+
+    return prologue_frame(context, &frame);
+}
+
+int produce_SOI(struct sink *sink)
+{
+    int err;
+
+    err = write_marker(sink, 0xffd8);
+    RETURN_IF(err);
+
+    return RET_SUCCESS;
+}
+
+int produce_DQT(struct context *context, uint8_t Tq, struct sink *sink)
+{
+    int err;
+
+    assert(context != NULL);
+
+    err = write_marker(sink, 0xffdb);
+    RETURN_IF(err);
+
+    struct qtable *qtable = &context->qtable[Tq];
+
+    /* 8-bit Qk values, unless the table came with 16-bit ones (transcoding) */
+    uint8_t Pq = qtable->Pq;
+
+    // length = 2 (len) + 1 (Pq, Tq) + 64 * (Pq + 1) (Q[]) = 67 or 131
+    err = write_length(sink, 3 + 64 * (Pq + 1));
+    RETURN_IF(err);
+
+    err = write_nibbles(sink, Pq, Tq);
+    RETURN_IF(err);
+
+    for (int i = 0; i < 64; ++i)
+    {
+        if (Pq == 0)
+        {
+            err = write_byte(sink, (uint8_t)qtable->Q_zz[i]);
+            RETURN_IF(err);
+        }
+        else
+        {
+            err = write_word(sink, qtable->Q_zz[i]);
+            RETURN_IF(err);
+        }
+    }
+
+    return RET_SUCCESS;
+}
+
+/* the table is used by a component of the frame */
+static int qtable_used(struct context *context, uint8_t Tq)
+{
+    for (int i = 0; i < context->Nf; ++i)
+    {
+        if (context->component[i].Tq == Tq)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int produce_SOF0(struct context *context, struct sink *sink)
+{
+    int err;
+
+    assert(context != NULL);
+
+    /* 12-bit samples and 16-bit tables are not allowed in the baseline process */
+    uint16_t marker = context->P != 8 ? 0xffc1 : 0xffc0;
+
+    for (int i = 0; i < context->Nf; ++i)
+    {
+        if (context->qtable[context->component[i].Tq].Pq != 0)
+        {
+            /* SOF1 Extended sequential DCT */
+            marker = 0xffc1;
+        }
+    }
+
+    err = write_marker(sink, marker);
+    RETURN_IF(err);
+
+    uint8_t Nf = context->Nf;
+
+    // length = 2 (len) + 1 (P) + 2 (Y) + 2 (X) + 1 (Nf) + Nf * ( 1 (C) + 1 (H, V) + 1 (Tq) ) = 8 + 3 * Nf
+    err = write_length(sink, 8 + 3 * Nf);
+    RETURN_IF(err);
+
+    err = write_byte(sink, context->P);
+    RETURN_IF(err);
+    err = write_word(sink, context->Y);
+    RETURN_IF(err);
+    err = write_word(sink, context->X);
+    RETURN_IF(err);
+    err = write_byte(sink, context->Nf);
+    RETURN_IF(err);
+
+    for (int i = 0; i < Nf; ++i)
+    {
+        err = write_byte(sink, context->component[i].C);
+        RETURN_IF(err);
+
+        err = write_nibbles(sink, context->component[i].H, context->component[i].V);
+        RETURN_IF(err);
+
+        err = write_byte(sink, context->component[i].Tq);
+        RETURN_IF(err);
+    }
+
+    return RET_SUCCESS;
+}
+
+int produce_DHT(struct context *context, uint8_t Tc, uint8_t Th, struct sink *sink)
+{
+    int err;
+
+    assert(context != NULL);
+
+    err = write_marker(sink, 0xffc4);
+    RETURN_IF(err);
+
+    struct htable *htable = &context->htable[Tc][Th];
+
+    // compute "mt (V)"
+    uint16_t mt = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        uint8_t L = htable->L[i];
+        mt += L;
+    }
+
+    // length = 2 (len) + 1 (Tc, Th) + 16 * 1 (L) + mt (V) = 2 + 17 + mt (V)
+    err = write_length(sink, 2 + 17 + mt);
+    RETURN_IF(err);
+
+    err = write_nibbles(sink, Tc, Th);
+    RETURN_IF(err);
+
+    for (int i = 0; i < 16; ++i)
+    {
+        err = write_byte(sink, htable->L[i]);
+        RETURN_IF(err);
+    }
+
+    for (int k = 0; k < mt; ++k)
+    {
+        err = write_byte(sink, htable->V[k]);
+        RETURN_IF(err);
+    }
+
+    return RET_SUCCESS;
+}
+
+struct scan
+{
+    uint8_t Ns;
+    /* index into context->component[] */
+    uint8_t Cs[MAX_COMPONENTS];
+
+    /* useful to remove differential DC coding
+     *
+     * At the beginning of the scan and at the beginning of each restart interval, the prediction for the DC coefficient prediction
+     * is initialized to 0. */
+    struct int_block *last_block[MAX_COMPONENTS];
+};
+
+int fill_scan(struct context *context, struct scan *scan)
+{
+    assert(context != NULL);
+    assert(scan != NULL);
+
+    scan->Ns = context->Nf;
+
+    for (int j = 0; j < scan->Ns; ++j)
+    {
+        scan->Cs[j] = j;
+    }
+
+    return RET_SUCCESS;
+}
+
+int produce_SOS(struct context *context, struct sink *sink, struct scan *scan)
+{
+    int err;
+
+    assert(context != NULL);
+    assert(scan != NULL);
+
+    err = write_marker(sink, 0xffda);
+    RETURN_IF(err);
+
+    uint8_t Ns = context->Nf;
+
+    /* Number of image components in scan = Number of image components in frame */
+    scan->Ns = Ns;
+
+    // length = 2 (len) + 1 (Ns) + Ns * (1 (Cs) + 1 (Td, Ta)) + 1 (Ss) + 1 (Se) + 1 (Ah, Al) = 6 + 2 * Ns
+    err = write_length(sink, 6 + 2 * Ns);
+    RETURN_IF(err);
+
+    for (int j = 0; j < Ns; ++j)
+    {
+        scan->Cs[j] = j;
+    }
+
+    err = write_byte(sink, Ns);
+    RETURN_IF(err);
+
+    for (int j = 0; j < Ns; ++j)
+    {
+        uint8_t Cs;
+        uint8_t Td, Ta;
+
+        Cs = scan->Cs[j];
+        Td = context->component[Cs].Td;
+        Ta = context->component[Cs].Ta;
+
+        err = write_byte(sink, context->component[Cs].C);
+        RETURN_IF(err);
+
+        err = write_nibbles(sink, Td, Ta);
+        RETURN_IF(err);
+    }
+
+    uint8_t Ss = 0;
+    uint8_t Se = 63;
+    uint8_t Ah = 0, Al = 0;
+
+    err = write_byte(sink, Ss);
+    RETURN_IF(err);
+    err = write_byte(sink, Se);
+    RETURN_IF(err);
+    err = write_nibbles(sink, Ah, Al);
+    RETURN_IF(err);
+
+    return RET_SUCCESS;
+}
+
+int produce_DRI(struct context *context, struct sink *sink)
+{
+    int err;
+
+    assert(context != NULL);
+
+    err = write_marker(sink, 0xffdd);
+    RETURN_IF(err);
+
+    // length = 2 (len) + 2 (Ri)
+    err = write_length(sink, 4);
+    RETURN_IF(err);
+
+    err = write_word(sink, context->Ri);
+    RETURN_IF(err);
+
+    return RET_SUCCESS;
+}
+
+int produce_EOI(struct sink *sink)
+{
+    int err;
+
+    err = write_marker(sink, 0xffd9);
+    RETURN_IF(err);
+
+    return RET_SUCCESS;
+}
+
+/* a run of macroblocks, tokenized together */
+struct unit
+{
+    /* macroblocks begin .. end-1 */
+    size_t begin, end;
+
+    struct token *tokens;
+    size_t count;
+
+    /* the entropy-coded segment (restart interval), in the arena once written (write_ecs_intervals()) */
+    struct sink sink;
+};
+
+/* all blocks of the scan as tokens, filled once by tokenize_scan() */
+struct scan_tokens
+{
+    /* restart intervals, or bands continuing the DC prediction when there are none */
+    size_t units;
+    struct unit *unit;
+
+    /* the tokens of all units, as many as counted beforehand */
+    struct token *buffer;
+};
+
+/* the macroblock seq_no into tokens, scan->last_block[] is the DC prediction, the blocks are only read */
+size_t tokenize_macroblock(struct histogram *histogram, struct context *context, struct scan *scan, size_t seq_no, struct token *tokens)
+{
+    assert(scan != NULL);
+    assert(context != NULL);
+
+    size_t count = 0;
+
+    size_t x = seq_no % context->m_x;
+    size_t y = seq_no / context->m_x;
+
+    /* for each component */
+    for (int j = 0; j < scan->Ns; ++j)
+    {
+        uint8_t Cs = scan->Cs[j];
+        uint8_t H = context->component[Cs].H;
+        uint8_t V = context->component[Cs].V;
+
+        /* for each 8x8 block */
+        for (int v = 0; v < V; ++v)
+        {
+            for (int h = 0; h < H; ++h)
+            {
+                size_t block_x = x * H + h;
+                size_t block_y = y * V + v;
+
+                assert(block_x < context->component[Cs].b_x);
+
+                size_t block_seq = block_y * context->component[Cs].b_x + block_x;
+
+                struct int_block *int_block = &context->component[Cs].int_buffer[block_seq];
+
+                /* differential DC coding */
+                int32_t pred = scan->last_block[Cs] != NULL ? scan->last_block[Cs]->c[0] : 0;
+
+                size_t n = tokenize_block(int_block, pred, &tokens[count]);
+
+                count_tokens(histogram, &context->component[Cs], &tokens[count], n);
+
+                count += n;
+
+                scan->last_block[Cs] = int_block;
+            }
+        }
+    }
+
+    return count;
+}
+
+/* the number of tokens of the macroblock seq_no */
+static size_t count_macroblock_tokens(struct context *context, const struct scan *scan, size_t seq_no)
+{
+    size_t count = 0;
+
+    size_t x = seq_no % context->m_x;
+    size_t y = seq_no / context->m_x;
+
+    for (int j = 0; j < scan->Ns; ++j)
+    {
+        struct component *component = &context->component[scan->Cs[j]];
+
+        for (int v = 0; v < component->V; ++v)
+        {
+            for (int h = 0; h < component->H; ++h)
+            {
+                size_t block_x = x * component->H + h;
+                size_t block_y = y * component->V + v;
+
+                count += count_block_tokens(&component->int_buffer[block_y * component->b_x + block_x]);
+            }
+        }
+    }
+
+    return count;
+}
+
+/* replay the tokens of a macroblock with the final tables, *used is their number */
+int write_macroblock(struct bits *bits, struct context *context, struct scan *scan, const struct token *tokens, size_t count, size_t *used)
+{
+    int err;
+
+    assert(scan != NULL);
+    assert(context != NULL);
+
+    size_t pos = 0;
+
+    /* for each component */
+    for (int j = 0; j < scan->Ns; ++j)
+    {
+        uint8_t Cs = scan->Cs[j];
+        uint8_t H = context->component[Cs].H;
+        uint8_t V = context->component[Cs].V;
+
+        /* for each 8x8 block */
+        for (int b = 0; b < H * V; ++b)
+        {
+            size_t n;
+
+            /* write block */
+            err = write_tokens(bits, context, &context->component[Cs], &tokens[pos], count - pos, &n);
+            RETURN_IF(err);
+
+            pos += n;
+        }
+    }
+
+    *used = pos;
+
+    return RET_SUCCESS;
+}
+
+static const char *Tc_to_str[] =
+{
+    [0] = "DC",
+    [1] = "AC"
+};
+
+struct tokenize_job
+{
+    struct context *context;
+    const struct scan *scan;
+    struct scan_tokens *scan_tokens;
+    size_t bands;
+    struct histogram *histograms;
+};
+
+/* the last block of the macroblock seq_no for each component, i.e., the DC prediction for the next one */
+static void predict_from_macroblock(struct context *context, struct scan *scan, size_t seq_no)
+{
+    size_t x = seq_no % context->m_x;
+    size_t y = seq_no / context->m_x;
+
+    for (int j = 0; j < scan->Ns; ++j)
+    {
+        uint8_t Cs = scan->Cs[j];
+        struct component *component = &context->component[Cs];
+
+        size_t block_x = x * component->H + component->H - 1;
+        size_t block_y = y * component->V + component->V - 1;
+
+        scan->last_block[Cs] = &component->int_buffer[block_y * component->b_x + block_x];
+    }
+}
+
+/* the number of tokens of each unit of the band t, as unit->count */
+static int count_band(void *arg, size_t t)
+{
+    struct tokenize_job *job = arg;
+    struct scan_tokens *scan_tokens = job->scan_tokens;
+
+    size_t first = t * scan_tokens->units / job->bands;
+    size_t last = (t + 1) * scan_tokens->units / job->bands;
+
+    for (size_t u = first; u < last; ++u)
+    {
+        struct unit *unit = &scan_tokens->unit[u];
+
+        unit->count = 0;
+
+        for (size_t seq_no = unit->begin; seq_no < unit->end; ++seq_no)
+        {
+            unit->count += count_macroblock_tokens(job->context, job->scan, seq_no);
+        }
+    }
+
+    return RET_SUCCESS;
+}
+
+/* tokenize the units of the band t, the symbols are counted into its own histogram */
+static int tokenize_band(void *arg, size_t t)
+{
+    struct tokenize_job *job = arg;
+    struct context *context = job->context;
+    struct scan_tokens *scan_tokens = job->scan_tokens;
+    struct histogram *histogram = &job->histograms[t];
+
+    struct scan scan = *job->scan;
+
+    size_t first = t * scan_tokens->units / job->bands;
+    size_t last = (t + 1) * scan_tokens->units / job->bands;
+
+    for (int j = 0; j < 2; ++j)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            for (int k = 0; k < 256; ++k)
+            {
+                histogram->freq[j][i][k] = 0;
+            }
+        }
+    }
+
+    for (size_t u = first; u < last; ++u)
+    {
+        struct unit *unit = &scan_tokens->unit[u];
+
+        /* At the beginning of the scan and at the beginning of each restart interval, the prediction is initialized to 0,
+         * otherwise the prediction chain continues from the previous unit. */
+        for (int i = 0; i < MAX_COMPONENTS; ++i)
+        {
+            scan.last_block[i] = NULL;
+        }
+
+        if (context->Ri == 0 && unit->begin > 0)
+        {
+            predict_from_macroblock(context, &scan, unit->begin - 1);
+        }
+
+        unit->count = 0;
+
+        for (size_t seq_no = unit->begin; seq_no < unit->end; ++seq_no)
+        {
+            unit->count += tokenize_macroblock(histogram, context, &scan, seq_no, &unit->tokens[unit->count]);
+        }
+    }
+
+    return RET_SUCCESS;
+}
+
+/* tokenize all macroblocks once (in parallel on context->pool), the symbols are counted into huffenc[][].freq
+ * free_scan_tokens() releases the tokens, even if this fails */
+int tokenize_scan(struct context *context, struct scan *scan, struct scan_tokens *scan_tokens)
+{
+    int err;
+
+    scan_tokens->units = 0;
+    scan_tokens->unit = NULL;
+    scan_tokens->buffer = NULL;
+
+    size_t mblocks_total = context->m_x * context->m_y;
+
+    size_t threads = (size_t)pool_threads(context->pool);
+
+    /* before the tokens, these are released first (LIFO) */
+    if (context->huffenc == NULL)
+    {
+        context->huffenc = arena_alloc(&context->arena, sizeof(struct huffenc) * 2 * 4);
+
+        if (context->huffenc == NULL)
+        {
+            return RET_FAILURE_MEMORY_ALLOCATION;
+        }
+    }
+
+    /* units of macroblocks */
+    size_t unit_size = context->Ri != 0 ? context->Ri : ceil_div(mblocks_total, threads);
+
+    size_t units = ceil_div(mblocks_total, unit_size);
+
+    scan_tokens->unit = arena_alloc(&context->arena, sizeof(struct unit) * units);
+
+    if (scan_tokens->unit == NULL)
+    {
+        return RET_FAILURE_MEMORY_ALLOCATION;
+    }
+
+    scan_tokens->units = units;
+
+    for (size_t u = 0; u < scan_tokens->units; ++u)
+    {
+        struct unit *unit = &scan_tokens->unit[u];
+
+        unit->begin = u * unit_size;
+        unit->end = unit->begin + unit_size < mblocks_total ? unit->begin + unit_size : mblocks_total;
+
+        unit->tokens = NULL;
+        unit->count = 0;
+
+        init_sink_memory(&unit->sink);
+    }
+
+    /* a band of units (and histogram) per thread */
+    size_t bands = threads < scan_tokens->units ? threads : scan_tokens->units;
+
+    struct tokenize_job job = { context, scan, scan_tokens, bands, NULL };
+
+    /* the tokens are counted first, so that the buffer holds no more than these */
+    err = pool_for(context->pool, bands, count_band, &job);
+    RETURN_IF(err);
+
+    size_t total = 0;
+
+    for (size_t u = 0; u < scan_tokens->units; ++u)
+    {
+        total += scan_tokens->unit[u].count;
+    }
+
+    scan_tokens->buffer = arena_alloc(&context->arena, sizeof(struct token) * total);
+
+    if (scan_tokens->buffer == NULL)
+    {
+        return RET_FAILURE_MEMORY_ALLOCATION;
+    }
+
+    total = 0;
+
+    for (size_t u = 0; u < scan_tokens->units; ++u)
+    {
+        struct unit *unit = &scan_tokens->unit[u];
+
+        unit->tokens = &scan_tokens->buffer[total];
+
+        total += unit->count;
+    }
+
+    struct histogram *histograms = arena_alloc(&context->arena, sizeof(struct histogram) * bands);
+
+    if (histograms == NULL)
+    {
+        return RET_FAILURE_MEMORY_ALLOCATION;
+    }
+
+    job.histograms = histograms;
+
+    err = pool_for(context->pool, bands, tokenize_band, &job);
+
+    if (err)
+    {
+        arena_free(&context->arena, histograms);
+        return err;
+    }
+
+    /* the statistics are collected from scratch */
+    for (int j = 0; j < 2; ++j)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            init_huffenc(&context->huffenc[j][i]);
+
+            for (size_t t = 0; t < bands; ++t)
+            {
+                for (int k = 0; k < 256; ++k)
+                {
+                    context->huffenc[j][i].freq[k] += histograms[t].freq[j][i][k];
+                }
+            }
+        }
+    }
+
+    arena_free(&context->arena, histograms);
+
+    return RET_SUCCESS;
+}
+
+void free_scan_tokens(struct context *context, struct scan_tokens *scan_tokens)
+{
+    for (size_t u = 0; u < scan_tokens->units; ++u)
+    {
+        free_sink(&scan_tokens->unit[u].sink);
+    }
+
+    /* LIFO */
+    arena_free(&context->arena, scan_tokens->buffer);
+    arena_free(&context->arena, scan_tokens->unit);
+
+    scan_tokens->units = 0;
+    scan_tokens->unit = NULL;
+    scan_tokens->buffer = NULL;
+}
+
+/* the table is used by a component of the frame */
+static int htable_used(struct context *context, uint8_t Tc, uint8_t Th)
+{
+    for (int i = 0; i < context->Nf; ++i)
+    {
+        if ((Tc == 0 ? context->component[i].Td : context->component[i].Ta) == Th)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* the tables from the counted symbols, optimize = 2 builds them by the Annex K.2 procedure */
+int optimize_tables(struct context *context, int optimize)
+{
+    int err;
+
+    int (*adapt)(struct htable *, struct huffenc *) = optimize == 2 ? adapt_huffman_table_k2 : adapt_huffman_table;
+
+    /* adapt codes */
+    for (int j = 0; j < 2; ++j)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            if (!htable_used(context, j, i))
+            {
+                continue;
+            }
+
+            TRACE(context, "Adapting Huffman table [%s][%i]...\n", Tc_to_str[j], i);
+
+            err = adapt(&context->htable[j][i], &context->huffenc[j][i]);
+            RETURN_IF(err);
+
+            set_htable(context, j, i);
+        }
+    }
+
+    return RET_SUCCESS;
+}
+
+/* every counted symbol has a code in the tables in use (the tables of a transcoded file need not have) */
+static int tables_complete(struct context *context)
+{
+    int err;
+
+    for (int j = 0; j < 2; ++j)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            const struct hcode *hcode;
+
+            if (!htable_used(context, j, i))
+            {
+                continue;
+            }
+
+            err = get_hcode(context, j, i, &hcode);
+
+            if (err)
+            {
+                return 0;
+            }
+
+            for (int k = 0; k < 256; ++k)
+            {
+                if (context->huffenc[j][i].freq[k] != 0 && hcode->e_huf_si[k] == 0)
+                {
+                    return 0;
+                }
+            }
+        }
+    }
+
+    return 1;
+}
+
+/* replay the tokens of the unit */
+int write_unit(struct bits *bits, struct context *context, struct scan *scan, const struct unit *unit)
+{
+    int err;
+
+    size_t pos = 0;
+
+    for (size_t seq_no = unit->begin; seq_no < unit->end; ++seq_no)
+    {
+        size_t used;
+
+        err = write_macroblock(bits, context, scan, &unit->tokens[pos], unit->count - pos, &used);
+        RETURN_IF(err);
+
+        pos += used;
+    }
+
+    return RET_SUCCESS;
+}
+
+struct interval_job
+{
+    struct context *context;
+    struct scan *scan;
+    struct scan_tokens *scan_tokens;
+};
+
+/* code the restart interval k into its own segment */
+static int write_interval(void *arg, size_t k)
+{
+    int err;
+
+    struct interval_job *job = arg;
+    struct unit *unit = &job->scan_tokens->unit[k];
+
+    struct bits bits;
+
+    init_bits_sink(&bits, &unit->sink);
+
+    err = write_unit(&bits, job->context, job->scan, unit);
+    RETURN_IF(err);
+
+    err = flush_bits(&bits);
+    RETURN_IF(err);
+
+    return RET_SUCCESS;
+}
+
+/* restart intervals are coded independently (in parallel on context->pool), then joined with RSTm markers */
+int write_ecs_intervals(struct sink *sink, struct context *context, struct scan *scan, struct scan_tokens *scan_tokens)
+{
+    int err;
+
+    size_t intervals = scan_tokens->units;
+
+    /* the tables are built before the threads share them */
+    for (int j = 0; j < scan->Ns; ++j)
+    {
+        const struct hcode *hcode;
+        struct component *component = &context->component[scan->Cs[j]];
+
+        err = get_hcode(context, 0, component->Td, &hcode);
+        RETURN_IF(err);
+        err = get_hcode(context, 1, component->Ta, &hcode);
+        RETURN_IF(err);
+    }
+
+    /* from the arena, for the worst case: at most 32 bits per token and a stuffed zero byte after each byte */
+    for (size_t k = 0; k < intervals; ++k)
+    {
+        struct unit *unit = &scan_tokens->unit[k];
+
+        size_t capacity = 2 * (4 * unit->count + 1);
+
+        void *data = arena_alloc(&context->arena, capacity);
+
+        if (data == NULL)
+        {
+            return RET_FAILURE_MEMORY_ALLOCATION;
+        }
+
+        init_sink_buffer(&unit->sink, data, capacity);
+    }
+
+    struct interval_job job = { context, scan, scan_tokens };
+
+    err = pool_for(context->pool, intervals, write_interval, &job);
+    RETURN_IF(err);
+
+    for (size_t k = 0; k < intervals; ++k)
+    {
+        struct unit *unit = &scan_tokens->unit[k];
+
+        err = sink_write(sink, unit->sink.data, unit->sink.size);
+        RETURN_IF(err);
+
+        /* RSTm, m = 0 .. 7 */
+        if (k + 1 < intervals)
+        {
+            err = write_marker(sink, 0xffd0 + k % 8);
+            RETURN_IF(err);
+        }
+    }
+
+    context->mblocks = context->m_x * context->m_y;
+
+    TRACE(context, "Processed: %zu macroblocks in %zu restart intervals\n", context->mblocks, intervals);
+
+    return RET_SUCCESS;
+}
+
+int write_ecs(struct sink *sink, struct context *context, struct scan *scan, struct scan_tokens *scan_tokens)
+{
+    int err;
+    struct bits bits;
+
+    if (context->Ri != 0)
+    {
+        return write_ecs_intervals(sink, context, scan, scan_tokens);
+    }
+
+    init_bits_sink(&bits, sink);
+
+    /* loop over macroblocks */
+    for (size_t u = 0; u < scan_tokens->units; ++u)
+    {
+        err = write_unit(&bits, context, scan, &scan_tokens->unit[u]);
+        RETURN_IF(err);
+    }
+
+    err = flush_bits(&bits);
+    RETURN_IF(err);
+
+    context->mblocks = context->m_x * context->m_y;
+
+    TRACE(context, "Processed: %zu macroblocks\n", context->mblocks);
+
+    return RET_SUCCESS;
+}
+
+/* the bytes the entropy-coded data takes with the tables in use, incl. the stuffed zero bytes (not the RSTm markers):
+ * write_ecs() without the output */
+static int count_ecs_bytes(struct context *context, struct scan *scan, struct scan_tokens *scan_tokens, size_t *bytes)
+{
+    int err;
+    const struct hcode *hcode_dc[MAX_COMPONENTS];
+    const struct hcode *hcode_ac[MAX_COMPONENTS];
+
+    for (int j = 0; j < scan->Ns; ++j)
+    {
+        struct component *component = &context->component[scan->Cs[j]];
+
+        err = get_hcode(context, 0, component->Td, &hcode_dc[j]);
+        RETURN_IF(err);
+        err = get_hcode(context, 1, component->Ta, &hcode_ac[j]);
+        RETURN_IF(err);
+    }
+
+    /* the pending bits, at most 7 + 16 + 16 */
+    uint64_t window = 0;
+    int count = 0;
+    size_t total = 0;
+
+    for (size_t u = 0; u < scan_tokens->units; ++u)
+    {
+        const struct unit *unit = &scan_tokens->unit[u];
+
+        size_t pos = 0;
+
+        for (size_t seq_no = unit->begin; seq_no < unit->end; ++seq_no)
+        {
+            for (int j = 0; j < scan->Ns; ++j)
+            {
+                const struct component *component = &context->component[scan->Cs[j]];
+
+                for (int b = 0; b < component->H * component->V; ++b)
+                {
+                    size_t k = pos;
+
+                    assert(k < unit->count && (unit->tokens[k].size & TOKEN_DC));
+
+                    do
+                    {
+                        const struct token *token = &unit->tokens[k];
+                        const struct hcode *hcode = k == pos ? hcode_dc[j] : hcode_ac[j];
+                        uint8_t size = token->size & ~TOKEN_DC;
+
+                        if (hcode->e_huf_si[token->value] == 0)
+                        {
+                            /* the value has no code */
+                            return RET_FAILURE_LOGIC_ERROR;
+                        }
+
+                        window = (window << hcode->e_huf_si[token->value]) | hcode->e_huf_co[token->value];
+                        window = (window << size) | (token->extra & ((1u << size) - 1));
+                        count += hcode->e_huf_si[token->value] + size;
+
+                        while (count >= 8)
+                        {
+                            count -= 8;
+                            total += ((window >> count) & 0xff) == 0xff ? 2 : 1;
+                        }
+
+                        k++;
+                    }
+                    while (k < unit->count && !(unit->tokens[k].size & TOKEN_DC));
+
+                    pos = k;
+                }
+            }
+        }
+
+        /* padded with 1-bits at the end of each restart interval and of the scan (flush_bits()) */
+        if (count > 0 && (context->Ri != 0 || u + 1 == scan_tokens->units))
+        {
+            uint8_t last = (uint8_t)((window << (8 - count)) | ((1u << (8 - count)) - 1));
+
+            total += last == 0xff ? 2 : 1;
+            count = 0;
+        }
+    }
+
+    *bytes = total;
+
+    return RET_SUCCESS;
+}
+
+/* the same codes for the same values */
+static int htables_equal(const struct htable *a, const struct htable *b)
+{
+    size_t n = 0;
+
+    for (int i = 0; i < 16; ++i)
+    {
+        if (a->L[i] != b->L[i])
+        {
+            return 0;
+        }
+
+        n += a->L[i];
+    }
+
+    for (size_t k = 0; k < n; ++k)
+    {
+        if (a->V[k] != b->V[k])
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* package-merge never codes more bits than K.2, but its 0xFF bytes (and their stuffed zero bytes) can outweigh that:
+ * the tables of either procedure are kept, whichever gives the shorter entropy-coded data */
+static int keep_shorter_tables(struct context *context, struct scan *scan, struct scan_tokens *scan_tokens)
+{
+    int err;
+    size_t merged_bytes, k2_bytes;
+    struct htable merged[2][4];
+    struct htable k2[2][4];
+    int same = 1;
+
+    for (int j = 0; j < 2; ++j)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            if (!htable_used(context, j, i))
+            {
+                continue;
+            }
+
+            /* K.2 consumes the counts */
+            struct huffenc huffenc;
+
+            init_huffenc(&huffenc);
+
+            for (int k = 0; k < 257; ++k)
+            {
+                huffenc.freq[k] = context->huffenc[j][i].freq[k];
+            }
+
+            err = adapt_huffman_table_k2(&k2[j][i], &huffenc);
+            RETURN_IF(err);
+
+            same = same && htables_equal(&k2[j][i], &context->htable[j][i]);
+        }
+    }
+
+    /* the same codes, nothing to compare */
+    if (same)
+    {
+        return RET_SUCCESS;
+    }
+
+    err = count_ecs_bytes(context, scan, scan_tokens, &merged_bytes);
+    RETURN_IF(err);
+
+    for (int j = 0; j < 2; ++j)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            if (htable_used(context, j, i))
+            {
+                merged[j][i] = context->htable[j][i];
+                context->htable[j][i] = k2[j][i];
+
+                set_htable(context, j, i);
+            }
+        }
+    }
+
+    err = count_ecs_bytes(context, scan, scan_tokens, &k2_bytes);
+    RETURN_IF(err);
+
+    TRACE(context, "Entropy-coded data: %zu bytes with package-merge, %zu bytes with K.2 tables\n", merged_bytes, k2_bytes);
+
+    if (k2_bytes < merged_bytes)
+    {
+        return RET_SUCCESS;
+    }
+
+    for (int j = 0; j < 2; ++j)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            if (htable_used(context, j, i))
+            {
+                context->htable[j][i] = merged[j][i];
+
+                set_htable(context, j, i);
+            }
+        }
+    }
+
+    return RET_SUCCESS;
+}
+
+int produce_codestream(struct context *context, struct sink *sink, struct params *params)
+{
+    int err;
+
+    /* SOI */
+    err = produce_SOI(sink);
+    RETURN_IF(err);
+
+    /* APPn, COM */
+    if (params->segments_size > 0)
+    {
+        err = sink_write(sink, params->segments, params->segments_size);
+        RETURN_IF(err);
+    }
+
+    /* DQT, the tables in use: Y, Cb/Cr */
+    for (uint8_t Tq = 0; Tq < 4; ++Tq)
+    {
+        if (qtable_used(context, Tq))
+        {
+            err = produce_DQT(context, Tq, sink);
+            RETURN_IF(err);
+        }
+    }
+
+    /* SOF0 */
+    err = produce_SOF0(context, sink);
+    RETURN_IF(err);
+
+    struct scan scan;
+
+    err = fill_scan(context, &scan);
+    RETURN_IF(err);
+
+    /* restart interval in MCUs, 0 = disabled */
+    context->Ri = params->Ri;
+
+    struct scan_tokens scan_tokens;
+
+    /* the blocks are tokenized once, for the statistics and for the output */
+    err = tokenize_scan(context, &scan, &scan_tokens);
+
+    if (err)
+    {
+        goto end;
+    }
+
+    // enable this by command line option
+    if (params->optimize || !tables_complete(context))
+    {
+        err = optimize_tables(context, params->optimize);
+
+        if (err)
+        {
+            goto end;
+        }
+
+        if (params->optimize != 2)
+        {
+            err = keep_shorter_tables(context, &scan, &scan_tokens);
+
+            if (err)
+            {
+                goto end;
+            }
+        }
+    }
+
+    /* DHT, the tables in use: DC Y, AC Y, DC Cb/Cr, AC Cb/Cr */
+    for (uint8_t Th = 0; Th < 4; ++Th)
+    {
+        for (uint8_t Tc = 0; Tc < 2; ++Tc)
+        {
+            if (htable_used(context, Tc, Th))
+            {
+                err = produce_DHT(context, Tc, Th, sink);
+
+                if (err)
+                {
+                    goto end;
+                }
+            }
+        }
+    }
+
+    /* DRI */
+    if (context->Ri != 0)
+    {
+        err = produce_DRI(context, sink);
+
+        if (err)
+        {
+            goto end;
+        }
+    }
+
+    /* SOS */
+    err = produce_SOS(context, sink, &scan);
+
+    if (err)
+    {
+        goto end;
+    }
+
+    /* loop over macroblocks */
+    err = write_ecs(sink, context, &scan, &scan_tokens);
+end:
+    free_scan_tokens(context, &scan_tokens);
+
+    RETURN_IF(err);
+
+    /* EOI */
+    err = produce_EOI(sink);
+    RETURN_IF(err);
+
+    return RET_SUCCESS;
+}
+
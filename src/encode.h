@@ -0,0 +1,58 @@
+#ifndef JPEG_ENCODE_H
+#define JPEG_ENCODE_H
+
+#include <stdio.h>
+#include "common.h"
+#include "frame.h"
+#include "io.h"
+
+/* encoding parameters (the command line of jpegmenc) */
+struct params
+{
+    /* luma subsampling */
+    uint8_t H, V;
+
+    /* quality 1..100 */
+    int q;
+
+    /* Huffman tables: 0 = those of Annex K.3 (unless a code is missing), 1 = optimized, 2 = by the Annex K.2 procedure */
+    int optimize;
+
+    /* threads (-j), -1 = serial phases, 0 = all processors */
+    int threads;
+
+    /* restart interval in MCUs (-r), 0 = no restart markers */
+    uint16_t Ri;
+
+    /* complete marker segments written as they are after SOI (those of a transcoded file), NULL = none */
+    const uint8_t *segments;
+    size_t segments_size;
+};
+
+void init_params(struct params *params);
+
+/* K.1 Quantization tables for luminance and chrominance components */
+extern const unsigned int std_luminance_quant_tbl[64];
+extern const unsigned int std_chrominance_quant_tbl[64];
+
+/* 0..100 to scaling_factor */
+int quality_to_sf(int q);
+
+/* Q_ref scaled for the quality q, 8-bit Qk values */
+void set_qtable(struct qtable *qtable, const unsigned int Q_ref[64], int q);
+
+/* the components, tables and buffers for the image described by the frame header, the (empty) frame is created in the context arena */
+int setup_image(struct context *context, struct params *params, struct frame *frame);
+
+/* PPM/PGM image, the frame is left in RGB */
+int read_image(struct context *context, FILE *stream, struct params *params, struct frame *frame);
+
+/* from RGB frame to quantized coefficients, the frame is destroyed */
+int prologue_frame(struct context *context, struct frame *frame);
+
+int prologue(struct context *context, FILE *i_stream, struct params *params);
+
+/* SOI .. EOI of the transformed image */
+int produce_codestream(struct context *context, struct sink *sink, struct params *params);
+
+#endif
@@ -7,10 +7,32 @@
 #include <ctype.h>
 #include "frame.h"
 #include "common.h"
+#include "imgproc.h"
+#include "pool.h"
+
+/* from the arena of the context if there is one */
+static void *frame_alloc(struct frame *frame, size_t size)
+{
+    return frame->arena != NULL ? arena_alloc(frame->arena, size) : malloc(size);
+}
+
+static void frame_free(struct frame *frame, void *ptr)
+{
+    if (frame->arena != NULL)
+    {
+        arena_free(frame->arena, ptr);
+    }
+    else
+    {
+        free(ptr);
+    }
+}
 
 void frame_destroy(struct frame *frame)
 {
-    free(frame->data);
+    frame_free(frame, frame->data);
+
+    frame->data = NULL;
 }
 
 int frame_create_empty(struct context *context, struct frame *frame)
@@ -24,8 +46,10 @@ int frame_create_empty(struct context *context, struct frame *frame)
     frame->size_x = size_x;
     frame->size_y = size_y;
 
+    frame->arena = &context->arena;
+
     // alloc frame->data[]
-    frame->data = malloc(sizeof(float) * frame->components * size_x * size_y);
+    frame->data = frame_alloc(frame, sizeof(float) * frame->components * size_x * size_y);
 
     if (frame->data == NULL)
     {
@@ -35,55 +59,115 @@ int frame_create_empty(struct context *context, struct frame *frame)
     return RET_SUCCESS;
 }
 
+// upsample a component raster (c_x * c_y samples) into frame->data[]
+static void upsample_component(const float *buffer, size_t c_x, size_t c_y, struct frame *frame, int compno)
+{
+    size_t size_x = frame->size_x;
+    size_t size_y = frame->size_y;
+
+    size_t step_x = size_x / c_x;
+    size_t step_y = size_y / c_y;
+
+    // iterate over component raster (smaller than frame raster)
+    for (size_t y = 0; y < c_y; ++y)
+    {
+        for (size_t x = 0; x < c_x; ++x)
+        {
+            // (i,y,x) to index component
+            // (compno,step*y,step*x) to index frame
+
+            float px = buffer[y * c_x + x];
+
+            // copy patch
+            for (size_t yy = 0; yy < step_y; ++yy)
+            {
+                for (size_t xx = 0; xx < step_x; ++xx)
+                {
+                    frame->data[(step_y * y + yy) * size_x * frame->components + frame->components * (step_x * x + xx) + compno] = px;
+                }
+            }
+        }
+    }
+}
+
 // context->component[].frame_buffer[] => frame->data[]
 void transform_components_to_frame(struct context *context, struct frame *frame)
 {
     assert(context != NULL);
     assert(frame != NULL);
 
-    size_t size_x = frame->size_x;
-    size_t size_y = frame->size_y;
-
     // component id
     int compno = 0;
 
-    for (int i = 0; i < 256; ++i)
+    for (int i = 0; i < context->Nf; ++i)
     {
         if (context->component[i].frame_buffer != NULL)
         {
             size_t b_x = context->component[i].b_x;
             size_t b_y = context->component[i].b_y;
 
-            size_t c_x = b_x * 8;
-            size_t c_y = b_y * 8;
+            upsample_component(context->component[i].frame_buffer, b_x * 8, b_y * 8, frame, compno);
+
+            compno++;
+        }
+    }
+}
 
-            size_t step_x = size_x / c_x;
-            size_t step_y = size_y / c_y;
+// MCU row m_y of context->component[].frame_buffer[] => frame->data[] (a band of 8 * max_V lines)
+void transform_mcu_row_to_frame(struct context *context, struct frame *frame, size_t m_y)
+{
+    assert(context != NULL);
+    assert(frame != NULL);
 
-            float *buffer = context->component[i].frame_buffer;
+    // component id
+    int compno = 0;
 
-            // iterate over component raster (smaller than frame raster)
-            for (size_t y = 0; y < c_y; ++y)
+    for (int i = 0; i < context->Nf; ++i)
+    {
+        struct component *component = &context->component[i];
+
+        if (component->frame_buffer != NULL)
+        {
+            const float *buffer = &component->frame_buffer[block_seq(context, component, 0, m_y * component->V) * 8 * 8];
+
+            upsample_component(buffer, component->b_x * 8, component->V * 8, frame, compno);
+
+            compno++;
+        }
+    }
+}
+
+// downsample frame->data[] into a component raster (c_x * c_y samples)
+static void downsample_component(const struct frame *frame, int compno, float *buffer, size_t c_x, size_t c_y)
+{
+    size_t size_x = frame->size_x;
+    size_t size_y = frame->size_y;
+
+    size_t step_x = size_x / c_x;
+    size_t step_y = size_y / c_y;
+
+    // iterate over component raster (smaller than frame raster)
+    for (size_t y = 0; y < c_y; ++y)
+    {
+        for (size_t x = 0; x < c_x; ++x)
+        {
+            // (i,y,x) to index component
+            // (compno,step*y,step*x) to index frame
+
+            float px = 0.f;
+
+            // copy patch
+            for (size_t yy = 0; yy < step_y; ++yy)
             {
-                for (size_t x = 0; x < c_x; ++x)
+                for (size_t xx = 0; xx < step_x; ++xx)
                 {
-                    // (i,y,x) to index component
-                    // (compno,step*y,step*x) to index frame
-
-                    float px = buffer[y * c_x + x];
-
-                    // copy patch
-                    for (size_t yy = 0; yy < step_y; ++yy)
-                    {
-                        for (size_t xx = 0; xx < step_x; ++xx)
-                        {
-                            frame->data[(step_y * y + yy) * size_x * frame->components + frame->components * (step_x * x + xx) + compno] = px;
-                        }
-                    }
+                    px += frame->data[(step_y * y + yy) * size_x * frame->components + frame->components * (step_x * x + xx) + compno];
                 }
             }
 
-            compno++;
+            px /= step_y * step_x;
+
+            buffer[y * c_x + x] = px;
         }
     }
 }
@@ -93,51 +177,41 @@ void transform_frame_to_components(struct context *context, struct frame *frame)
     assert(context != NULL);
     assert(frame != NULL);
 
-    size_t size_x = frame->size_x;
-    size_t size_y = frame->size_y;
-
     // component id
     int compno = 0;
 
-    for (int i = 0; i < 256; ++i)
+    for (int i = 0; i < context->Nf; ++i)
     {
         if (context->component[i].frame_buffer != NULL)
         {
             size_t b_x = context->component[i].b_x;
             size_t b_y = context->component[i].b_y;
 
-            size_t c_x = b_x * 8;
-            size_t c_y = b_y * 8;
+            downsample_component(frame, compno, context->component[i].frame_buffer, b_x * 8, b_y * 8);
 
-            size_t step_x = size_x / c_x;
-            size_t step_y = size_y / c_y;
-
-            float *buffer = context->component[i].frame_buffer;
+            compno++;
+        }
+    }
+}
 
-            // iterate over component raster (smaller than frame raster)
-            for (size_t y = 0; y < c_y; ++y)
-            {
-                for (size_t x = 0; x < c_x; ++x)
-                {
-                    // (i,y,x) to index component
-                    // (compno,step*y,step*x) to index frame
+// frame->data[] (a band of 8 * max_V lines) => MCU row m_y of context->component[].frame_buffer[]
+void transform_frame_to_mcu_row(struct context *context, struct frame *frame, size_t m_y)
+{
+    assert(context != NULL);
+    assert(frame != NULL);
 
-                    float px = 0.f;
+    // component id
+    int compno = 0;
 
-                    // copy patch
-                    for (size_t yy = 0; yy < step_y; ++yy)
-                    {
-                        for (size_t xx = 0; xx < step_x; ++xx)
-                        {
-                            px += frame->data[(step_y * y + yy) * size_x * frame->components + frame->components * (step_x * x + xx) + compno];
-                        }
-                    }
+    for (int i = 0; i < context->Nf; ++i)
+    {
+        struct component *component = &context->component[i];
 
-                    px /= step_y * step_x;
+        if (component->frame_buffer != NULL)
+        {
+            float *buffer = &component->frame_buffer[block_seq(context, component, 0, m_y * component->V) * 8 * 8];
 
-                    buffer[y * c_x + x] = px;
-                }
-            }
+            downsample_component(frame, compno, buffer, component->b_x * 8, component->V * 8);
 
             compno++;
         }
@@ -164,6 +238,198 @@ int frame_create(struct context *context, struct frame *frame)
     return RET_SUCCESS;
 }
 
+/* size_y rows of the frame starting at row y, sharing its data[] */
+static void frame_get_band(const struct frame *frame, size_t y, size_t size_y, struct frame *band)
+{
+    *band = *frame;
+
+    band->data = &frame->data[y * frame->size_x * frame->components];
+    band->size_y = size_y;
+
+    band->Y = (uint16_t)(y < frame->Y ? frame->Y - y : 0);
+
+    if (band->Y > size_y)
+    {
+        band->Y = (uint16_t)size_y;
+    }
+
+    band->arena = NULL;
+}
+
+struct band_job
+{
+    struct context *context;
+    struct frame *frame;
+
+    /* instead of the frame */
+    const struct pixels *pixels;
+};
+
+/* dequantize, IDCT, upsample and color convert a single MCU row (of the crop), independent of the other rows */
+static int reconstruct_mcu_row(void *arg, size_t t)
+{
+    struct band_job *job = arg;
+    struct context *context = job->context;
+    struct frame band;
+
+    size_t m_y = context->m_y0 + t;
+
+    for (int i = 0; i < context->Nf; ++i)
+    {
+        struct component *component = &context->component[i];
+
+        if (component->int_buffer == NULL)
+        {
+            continue;
+        }
+
+        for (size_t block_y = m_y * component->V; block_y < (m_y + 1) * component->V; ++block_y)
+        {
+            for (size_t block_x = context->m_x0 * component->H; block_x < context->m_x1 * component->H; ++block_x)
+            {
+                struct int_block *int_block = &component->int_buffer[block_seq(context, component, block_x, block_y)];
+
+                reconstruct_block(context, component, int_block, block_x, block_y);
+            }
+        }
+    }
+
+    if (job->pixels != NULL)
+    {
+        pack_mcu_row(context, job->pixels, m_y);
+
+        return RET_SUCCESS;
+    }
+
+    size_t size_y = 8 * context->max_V;
+
+    frame_get_band(job->frame, m_y * size_y, size_y, &band);
+
+    transform_mcu_row_to_frame(context, &band, m_y);
+
+    return frame_to_rgb(&band);
+}
+
+/* the whole epilogue (from coefficients to RGB frame), MCU rows are processed in parallel on context->pool */
+int frame_reconstruct(struct context *context, struct frame *frame)
+{
+    assert(context != NULL);
+    assert(frame != NULL);
+
+    int err;
+
+    frame->components = context->Nf;
+    frame->Y = context->Y;
+    frame->X = context->X;
+    frame->precision = context->P;
+
+    err = frame_create_empty(context, frame);
+    RETURN_IF(err);
+
+    TRACE(context, "Reconstructing %zu MCU rows on %i threads...\n", context->m_y, pool_threads(context->pool));
+
+    struct band_job job = { context, frame, NULL };
+
+    err = pool_for(context->pool, context->m_y, reconstruct_mcu_row, &job);
+
+    if (err)
+    {
+        frame_destroy(frame);
+    }
+
+    return err;
+}
+
+int pixels_reconstruct(struct context *context, const struct pixels *pixels)
+{
+    assert(context != NULL);
+    assert(pixels != NULL);
+
+    TRACE(context, "Reconstructing %zu MCU rows on %i threads...\n", context->m_y, pool_threads(context->pool));
+
+    struct band_job job = { context, NULL, pixels };
+
+    return pool_for(context->pool, context->m_y1 - context->m_y0, reconstruct_mcu_row, &job);
+}
+
+/* color convert, downsample, FDCT and quantize a single MCU row, independent of the other rows */
+static int decompose_mcu_row(void *arg, size_t m_y)
+{
+    struct band_job *job = arg;
+    struct context *context = job->context;
+    struct frame band;
+
+    int err;
+
+    size_t size_y = 8 * context->max_V;
+
+    frame_get_band(job->frame, m_y * size_y, size_y, &band);
+
+    err = frame_to_ycc(&band);
+    RETURN_IF(err);
+
+    transform_frame_to_mcu_row(context, &band, m_y);
+
+    for (int i = 0; i < context->Nf; ++i)
+    {
+        struct component *component = &context->component[i];
+
+        if (component->int_buffer == NULL)
+        {
+            continue;
+        }
+
+        for (size_t block_y = m_y * component->V; block_y < (m_y + 1) * component->V; ++block_y)
+        {
+            for (size_t block_x = 0; block_x < component->b_x; ++block_x)
+            {
+                decompose_block(context, component, block_x, block_y);
+            }
+        }
+    }
+
+    return RET_SUCCESS;
+}
+
+/* the whole prologue (from RGB frame to quantized coefficients), MCU rows are processed in parallel on context->pool */
+int frame_decompose(struct context *context, struct frame *frame)
+{
+    assert(context != NULL);
+    assert(frame != NULL);
+
+    TRACE(context, "Decomposing %zu MCU rows on %i threads...\n", context->m_y, pool_threads(context->pool));
+
+    struct band_job job = { context, frame, NULL };
+
+    return pool_for(context->pool, context->m_y, decompose_mcu_row, &job);
+}
+
+/* frame holding a single MCU row (band) of the image, frame->Y is set for each band */
+int frame_create_band(struct context *context, struct frame *frame)
+{
+    assert(context != NULL);
+    assert(frame != NULL);
+
+    frame->components = context->Nf;
+    frame->Y = 0;
+    frame->X = context->X;
+    frame->precision = context->P;
+
+    frame->size_x = ceil_div(frame->X, 8 * context->max_H) * 8 * context->max_H;
+    frame->size_y = 8 * context->max_V;
+
+    frame->arena = &context->arena;
+
+    frame->data = frame_alloc(frame, sizeof(float) * frame->components * frame->size_x * frame->size_y);
+
+    if (frame->data == NULL)
+    {
+        return RET_FAILURE_MEMORY_ALLOCATION;
+    }
+
+    return RET_SUCCESS;
+}
+
 int frame_to_ycc(struct frame *frame)
 {
     assert(frame != NULL);
@@ -308,7 +574,7 @@ int read_frame_body(struct frame *frame, FILE *stream)
     size_t height = (size_t)frame->Y;
     size_t line_size = sample_size * components * width;
 
-    void *line = malloc(line_size);
+    void *line = frame_alloc(frame, line_size);
 
     if (line == NULL)
     {
@@ -319,7 +585,7 @@ int read_frame_body(struct frame *frame, FILE *stream)
     {
         if (fread(line, 1, line_size, stream) < line_size)
         {
-            free(line);
+            frame_free(frame, line);
             return RET_FAILURE_FILE_IO;
         }
         switch (sample_size)
@@ -383,7 +649,7 @@ int read_frame_body(struct frame *frame, FILE *stream)
         }
     }
 
-    free(line);
+    frame_free(frame, line);
 
     return RET_SUCCESS;
 }
@@ -399,7 +665,7 @@ int write_frame_body(struct frame *frame, int components, FILE *stream)
     size_t height = (size_t)frame->Y;
     size_t line_size = sample_size * components * width;
 
-    void *line = malloc(line_size);
+    void *line = frame_alloc(frame, line_size);
 
     if (line == NULL)
     {
@@ -437,18 +703,18 @@ int write_frame_body(struct frame *frame, int components, FILE *stream)
             break;
         }
         default:
-            free(line);
+            frame_free(frame, line);
             return RET_FAILURE_LOGIC_ERROR;
         }
         /* write line */
         if (fwrite(line, 1, line_size, stream) < line_size)
         {
-            free(line);
+            frame_free(frame, line);
             return RET_FAILURE_FILE_IO;
         }
     }
 
-    free(line);
+    frame_free(frame, line);
 
     return RET_SUCCESS;
 }
@@ -612,24 +878,425 @@ end:
     return err;
 }
 
-int write_frame(struct frame *frame, const char *path)
+/* number of components in PPM/PGM file */
+static int frame_output_components(struct frame *frame)
 {
-    assert(frame != NULL);
-
-    int err;
-
     switch (frame->components)
     {
     case 4:
     case 3:
-        err = write_frame_components(frame, 3, path != NULL ? path : "output.ppm");
-        break;
+        return 3;
     case 1:
-        err = write_frame_components(frame, 1, path != NULL ? path : "output.pgm");
-        break;
+        return 1;
     default:
         abort();
     }
+}
+
+int write_frame(struct frame *frame, const char *path)
+{
+    assert(frame != NULL);
+
+    int components = frame_output_components(frame);
+
+    return write_frame_components(frame, components, path != NULL ? path : (components == 3 ? "output.ppm" : "output.pgm"));
+}
+
+/* create the file and write PPM/PGM header, the lines are written by write_frame_rows() */
+int write_frame_open(struct frame *frame, const char *path, FILE **stream)
+{
+    assert(frame != NULL);
+    assert(stream != NULL);
+
+    int err;
+    int components = frame_output_components(frame);
+
+    *stream = fopen(path != NULL ? path : (components == 3 ? "output.ppm" : "output.pgm"), "w");
+
+    if (*stream == NULL)
+    {
+        return RET_FAILURE_FILE_OPEN;
+    }
+
+    err = write_frame_header(frame, components, *stream);
+
+    if (err)
+    {
+        fclose(*stream);
+        *stream = NULL;
+    }
+
+    return err;
+}
+
+/* append frame->Y lines of the frame (band) */
+int write_frame_rows(struct frame *frame, FILE *stream)
+{
+    assert(frame != NULL);
+
+    return write_frame_body(frame, frame_output_components(frame), stream);
+}
+
+/* replicate the last column and row into the padding */
+static void frame_pad(struct frame *frame)
+{
+    uint8_t Nf = frame->components;
+    size_t width = (size_t)frame->X;
+    size_t height = (size_t)frame->Y;
+
+    for (size_t y = 0; y < height; ++y)
+    {
+        for (size_t x = width; x < frame->size_x; ++x)
+        {
+            for (int c = 0; c < Nf; ++c)
+            {
+                frame->data[y * frame->size_x * Nf + x * Nf + c] =
+                    frame->data[y * frame->size_x * Nf + (width - 1) * Nf + c];
+            }
+        }
+    }
+
+    for (size_t y = height; y < frame->size_y; ++y)
+    {
+        for (size_t x = 0; x < frame->size_x; ++x)
+        {
+            for (int c = 0; c < Nf; ++c)
+            {
+                frame->data[y * frame->size_x * Nf + x * Nf + c] =
+                    frame->data[(height - 1) * frame->size_x * Nf + x * Nf + c];
+            }
+        }
+    }
+}
+
+int read_frame_pixels(struct frame *frame, const void *pixels, size_t stride)
+{
+    assert(frame != NULL);
+    assert(pixels != NULL);
+
+    uint8_t Nf = frame->components;
+    int maxval = (1 << frame->precision) - 1;
+    size_t sample_size = convert_maxval_to_sample_size(maxval);
+
+    for (size_t y = 0; y < frame->Y; ++y)
+    {
+        const uint8_t *row = (const uint8_t *)pixels + y * stride;
+        float *data = &frame->data[y * frame->size_x * Nf];
+
+        switch (sample_size)
+        {
+        case sizeof(uint8_t):
+            for (size_t i = 0; i < (size_t)frame->X * Nf; ++i)
+            {
+                data[i] = (float)row[i];
+            }
+            break;
+        case sizeof(uint16_t):
+            for (size_t i = 0; i < (size_t)frame->X * Nf; ++i)
+            {
+                data[i] = (float)((const uint16_t *)row)[i];
+            }
+            break;
+        default:
+            return RET_FAILURE_LOGIC_ERROR;
+        }
+    }
+
+    frame_pad(frame);
+
+    return RET_SUCCESS;
+}
+
+/* channels of a pixel (of each plane for JPEGM_FORMAT_YCBCR_PLANAR) */
+static size_t pixels_channels(int format)
+{
+    switch (format)
+    {
+    case JPEGM_FORMAT_RGB:
+    case JPEGM_FORMAT_BGR:
+        return 3;
+    case JPEGM_FORMAT_RGBA:
+    case JPEGM_FORMAT_RGBX:
+        return 4;
+    default:
+        return 1;
+    }
+}
+
+int pixels_prepare(struct context *context, struct pixels *pixels)
+{
+    assert(context != NULL);
+    assert(pixels != NULL);
+
+    size_t x0, y0, x1, y1;
+
+    crop_region(context, &x0, &y0, &x1, &y1);
+
+    if (x0 >= x1 || y0 >= y1)
+    {
+        return RET_FAILURE_FILE_UNSUPPORTED;
+    }
+
+    if (pixels->format == JPEGM_FORMAT_AUTO)
+    {
+        pixels->format = context->Nf == 1 ? JPEGM_FORMAT_GREY : JPEGM_FORMAT_RGB;
+    }
+
+    if (pixels->format < JPEGM_FORMAT_RGB || pixels->format > JPEGM_FORMAT_YCBCR_PLANAR)
+    {
+        return RET_FAILURE_FILE_UNSUPPORTED;
+    }
+
+    /* grey, YCbCr or YCCK only, the samples of other frames have no known meaning */
+    if (context->Nf != 1 && context->Nf != 3 && context->Nf != 4)
+    {
+        return RET_FAILURE_FILE_UNSUPPORTED;
+    }
+
+    /* no chroma for CMYK */
+    if (pixels->format == JPEGM_FORMAT_YCBCR_PLANAR && context->Nf == 4)
+    {
+        return RET_FAILURE_FILE_UNSUPPORTED;
+    }
+
+    size_t sample_size = convert_maxval_to_sample_size((1 << context->P) - 1);
+    size_t line_size = sample_size * pixels_channels(pixels->format) * (x1 - x0);
+
+    if (pixels->stride == 0)
+    {
+        pixels->stride = line_size;
+    }
+
+    if (pixels->stride < line_size || pixels->stride % sample_size != 0)
+    {
+        return RET_FAILURE_FILE_UNSUPPORTED;
+    }
+
+    size_t planes = pixels->format == JPEGM_FORMAT_YCBCR_PLANAR ? 3 : 1;
+    size_t size = pixels->stride * ((y1 - y0) * planes - 1) + line_size;
+
+    if (pixels->data == NULL)
+    {
+        pixels->data = malloc(size);
+
+        if (pixels->data == NULL)
+        {
+            return RET_FAILURE_MEMORY_ALLOCATION;
+        }
+
+        pixels->size = size;
+        pixels->owned = 1;
+    }
+
+    if (pixels->size < size)
+    {
+        return RET_FAILURE_OVERFLOW_ERROR;
+    }
+
+    return RET_SUCCESS;
+}
+
+/* round and clamp, the i-th sample of the line */
+static void put_sample(uint8_t *line, size_t i, size_t sample_size, float value, int maxval)
+{
+    int sample = clamp(0, (int)roundf(value), maxval);
+
+    if (sample_size == sizeof(uint8_t))
+    {
+        line[i] = (uint8_t)sample;
+    }
+    else
+    {
+        ((uint16_t *)line)[i] = (uint16_t)sample;
+    }
+}
+
+void pack_mcu_row(struct context *context, const struct pixels *pixels, size_t m_y)
+{
+    assert(context != NULL);
+    assert(pixels != NULL);
+
+    int shift = 1 << (context->P - 1);
+    int denom = 1 << context->P;
+    int maxval = (1 << context->P) - 1;
+    size_t sample_size = convert_maxval_to_sample_size(maxval);
+
+    size_t size_y = 8 * context->max_V;
+
+    /* the pixels of the crop */
+    size_t x0, y0, x1, y1;
+
+    crop_region(context, &x0, &y0, &x1, &y1);
+
+    /* the first column in the component buffers */
+    size_t buffer_x = context->m_x0 * 8 * context->max_H;
+
+    /* the MCU row of each component and its upsampling factors */
+    const float *buffer[MAX_COMPONENTS];
+    size_t c_x[MAX_COMPONENTS];
+    size_t step_x[MAX_COMPONENTS];
+    size_t step_y[MAX_COMPONENTS];
+
+    int Nc = 0;
+
+    for (int i = 0; i < context->Nf; ++i)
+    {
+        struct component *component = &context->component[i];
+
+        if (component->frame_buffer != NULL)
+        {
+            buffer[Nc] = &component->frame_buffer[block_seq(context, component, context->m_x0 * component->H, m_y * component->V) * 8 * 8];
+            c_x[Nc] = buffer_b_x(context, component) * 8;
+            step_x[Nc] = context->max_H / component->H;
+            step_y[Nc] = context->max_V / component->V;
+
+            Nc++;
+        }
+    }
+
+    /* the lines of the MCU row within the crop */
+    size_t band_y = m_y * size_y;
+    size_t y_begin = band_y > y0 ? band_y : y0;
+    size_t y_end = band_y + size_y < y1 ? band_y + size_y : y1;
+
+    /* JPEGM_FORMAT_YCBCR_PLANAR */
+    size_t plane = pixels->stride * (y1 - y0);
+
+    for (size_t y = y_begin; y < y_end; ++y)
+    {
+        const float *row[MAX_COMPONENTS];
+
+        for (int c = 0; c < Nc; ++c)
+        {
+            row[c] = &buffer[c][(y - band_y) / step_y[c] * c_x[c]];
+        }
+
+        uint8_t *line = pixels->data + (y - y0) * pixels->stride;
+
+        for (size_t x = 0; x < x1 - x0; ++x)
+        {
+            float s[MAX_COMPONENTS] = { 0.f };
+
+            for (int c = 0; c < Nc; ++c)
+            {
+                s[c] = row[c][(x0 + x - buffer_x) / step_x[c]];
+            }
+
+            if (pixels->format == JPEGM_FORMAT_YCBCR_PLANAR)
+            {
+                put_sample(line, x, sample_size, s[0], maxval);
+                put_sample(line + plane, x, sample_size, Nc == 1 ? (float)shift : s[1], maxval);
+                put_sample(line + 2 * plane, x, sample_size, Nc == 1 ? (float)shift : s[2], maxval);
+                continue;
+            }
+
+            if (pixels->format == JPEGM_FORMAT_GREY && Nc != 4)
+            {
+                put_sample(line, x, sample_size, s[0], maxval);
+                continue;
+            }
+
+            /* as frame_to_rgb() */
+            float R, G, B;
+
+            switch (Nc)
+            {
+            case 4:
+            {
+                float C = s[0] + 1.402 * (s[2] - shift);
+                float M = s[0] - 0.34414 * (s[1] - shift) - 0.71414 * (s[2] - shift);
+                float Y = s[0] + 1.772 * (s[1] - shift);
+
+                R = s[3] - (C * s[3]) / denom;
+                G = s[3] - (M * s[3]) / denom;
+                B = s[3] - (Y * s[3]) / denom;
+                break;
+            }
+            case 3:
+                R = s[0] + 1.402 * (s[2] - shift);
+                G = s[0] - 0.34414 * (s[1] - shift) - 0.71414 * (s[2] - shift);
+                B = s[0] + 1.772 * (s[1] - shift);
+                break;
+            default:
+                R = G = B = s[0];
+            }
+
+            switch (pixels->format)
+            {
+            case JPEGM_FORMAT_RGB:
+                put_sample(line, 3 * x + 0, sample_size, R, maxval);
+                put_sample(line, 3 * x + 1, sample_size, G, maxval);
+                put_sample(line, 3 * x + 2, sample_size, B, maxval);
+                break;
+            case JPEGM_FORMAT_BGR:
+                put_sample(line, 3 * x + 0, sample_size, B, maxval);
+                put_sample(line, 3 * x + 1, sample_size, G, maxval);
+                put_sample(line, 3 * x + 2, sample_size, R, maxval);
+                break;
+            case JPEGM_FORMAT_RGBA:
+            case JPEGM_FORMAT_RGBX:
+                put_sample(line, 4 * x + 0, sample_size, R, maxval);
+                put_sample(line, 4 * x + 1, sample_size, G, maxval);
+                put_sample(line, 4 * x + 2, sample_size, B, maxval);
+                put_sample(line, 4 * x + 3, sample_size, (float)maxval, maxval);
+                break;
+            case JPEGM_FORMAT_GREY:
+                /* CMYK */
+                put_sample(line, x, sample_size, 0.299f * R + 0.587f * G + 0.114f * B, maxval);
+                break;
+            }
+        }
+    }
+}
+
+int write_pixels(const struct pixels *pixels, size_t width, size_t height, uint8_t precision, const char *path)
+{
+    assert(pixels != NULL);
+
+    int err = RET_SUCCESS;
+    int components = pixels->format == JPEGM_FORMAT_GREY ? 1 : 3;
+    int maxval = (1 << precision) - 1;
+    size_t sample_size = convert_maxval_to_sample_size(maxval);
+
+    if (pixels->format != JPEGM_FORMAT_GREY && pixels->format != JPEGM_FORMAT_RGB)
+    {
+        return RET_FAILURE_FILE_UNSUPPORTED;
+    }
+
+    FILE *stream = fopen(path != NULL ? path : (components == 3 ? "output.ppm" : "output.pgm"), "w");
+
+    if (stream == NULL)
+    {
+        return RET_FAILURE_FILE_OPEN;
+    }
+
+    if (fprintf(stream, "P%c\n%zu %zu\n%i\n", components == 3 ? '6' : '5', width, height, maxval) < 0)
+    {
+        err = RET_FAILURE_FILE_IO;
+    }
+
+    size_t line_size = sample_size * components * width;
+
+    for (size_t y = 0; y < height && !err; ++y)
+    {
+        uint8_t *line = pixels->data + y * pixels->stride;
+
+        /* big endian */
+        if (sample_size == sizeof(uint16_t))
+        {
+            for (size_t i = 0; i < components * width; ++i)
+            {
+                ((uint16_t *)line)[i] = htons(((uint16_t *)line)[i]);
+            }
+        }
+
+        if (fwrite(line, 1, line_size, stream) < line_size)
+        {
+            err = RET_FAILURE_FILE_IO;
+        }
+    }
+
+    fclose(stream);
 
     return err;
 }
@@ -3,7 +3,9 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include "common.h"
+#include "jpegm.h"
 
 struct frame
 {
@@ -13,6 +15,9 @@ struct frame
     uint8_t precision;
 
     float *data;
+
+    /* where data[] comes from, NULL for malloc() */
+    struct arena *arena;
 };
 
 int frame_create(struct context *context, struct frame *frame);
@@ -31,6 +36,52 @@ int read_frame_body(struct frame *frame, FILE *stream);
 
 void transform_frame_to_components(struct context *context, struct frame *frame);
 
+void transform_frame_to_mcu_row(struct context *context, struct frame *frame, size_t m_y);
+
 int frame_to_ycc(struct frame *frame);
 
+int frame_reconstruct(struct context *context, struct frame *frame);
+
+int frame_decompose(struct context *context, struct frame *frame);
+
+int frame_create_band(struct context *context, struct frame *frame);
+
+void transform_mcu_row_to_frame(struct context *context, struct frame *frame, size_t m_y);
+
+int write_frame_open(struct frame *frame, const char *path, FILE **stream);
+
+int write_frame_rows(struct frame *frame, FILE *stream);
+
+/*
+ * interleaved samples in memory, rows stride bytes apart
+ * uint8_t samples up to 8 bits of precision, uint16_t (host byte order) otherwise
+ */
+int read_frame_pixels(struct frame *frame, const void *pixels, size_t stride);
+
+/* decoded image in the buffer of the caller, format is one of JPEGM_FORMAT_* */
+struct pixels
+{
+    int format;
+
+    uint8_t *data;
+
+    /* bytes between the rows, the bytes of data[] */
+    size_t stride, size;
+
+    /* data[] has been allocated by pixels_prepare() */
+    int owned;
+};
+
+/* resolve the format and the stride for the image of the context, allocate data[] if NULL, check the size */
+int pixels_prepare(struct context *context, struct pixels *pixels);
+
+/* color convert MCU row m_y of context->component[].frame_buffer[] straight into the pixels */
+void pack_mcu_row(struct context *context, const struct pixels *pixels, size_t m_y);
+
+/* frame_reconstruct() into the pixels (the MCU rows of the crop) */
+int pixels_reconstruct(struct context *context, const struct pixels *pixels);
+
+/* PPM/PGM file of JPEGM_FORMAT_RGB or JPEGM_FORMAT_GREY pixels (16-bit samples are byte-swapped in place) */
+int write_pixels(const struct pixels *pixels, size_t width, size_t height, uint8_t precision, const char *path);
+
 #endif
@@ -0,0 +1,153 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "common.h"
+#include "huffman.h"
+#include "mjpeg.h"
+
+/*
+ * writes the Annex C tables of the implicit MJPEG tables (mjpeg.h) and the DCT look-up table as C source,
+ * the library then uses them as const data instead of building them at run time
+ */
+
+/* the array member of struct hcode as an initializer */
+#define PRINT_ARRAY(stream, hcode, member) \
+	do { \
+		fprintf((stream), "        .%s = {", #member); \
+		for (size_t i = 0; i < sizeof((hcode).member) / sizeof(*(hcode).member); ++i) { \
+			fprintf((stream), "%s%ld,", i % 16 ? " " : "\n            ", (long)(hcode).member[i]); \
+		} \
+		fprintf((stream), "\n        },\n"); \
+	} while (0)
+
+int print_hcode(FILE *stream, const struct htable *htable, const char *comment)
+{
+    struct htable copy = *htable;
+    struct hcode hcode;
+
+    /* the unused entries are written as well */
+    memset(&hcode, 0, sizeof(struct hcode));
+
+    int err = conv_htable_to_hcode(&copy, &hcode);
+    RETURN_IF(err);
+
+    fprintf(stream, "    // %s\n", comment);
+    fprintf(stream, "    {\n");
+
+    PRINT_ARRAY(stream, hcode, huff_val);
+    PRINT_ARRAY(stream, hcode, huff_size);
+    PRINT_ARRAY(stream, hcode, huff_code);
+    fprintf(stream, "        .last_k = %zu,\n", hcode.last_k);
+    PRINT_ARRAY(stream, hcode, e_huf_co);
+    PRINT_ARRAY(stream, hcode, e_huf_si);
+    PRINT_ARRAY(stream, hcode, max_code);
+    PRINT_ARRAY(stream, hcode, min_code);
+    PRINT_ARRAY(stream, hcode, val_ptr);
+    PRINT_ARRAY(stream, hcode, look_size);
+    PRINT_ARRAY(stream, hcode, look_val);
+
+    fprintf(stream, "    },\n");
+
+    return RET_SUCCESS;
+}
+
+static float C(int u)
+{
+    if (u == 0)
+    {
+        return 1.f / sqrtf(2.f);
+    }
+
+    return 1.f;
+}
+
+/* cos(k pi / 16) reduced to the first quadrant, so that the mirrored entries of the table are exactly opposite */
+static double cos16(int k)
+{
+    k %= 32;
+
+    if (k > 16)
+    {
+        k = 32 - k;
+    }
+
+    if (k > 8)
+    {
+        return -cos((16 - k) * M_PI / 16);
+    }
+
+    return cos(k * M_PI / 16);
+}
+
+/* exact (hexadecimal) float constants */
+void print_dct_lut(FILE *stream)
+{
+    fprintf(stream, "const float dct_lut[8][8] =\n{\n");
+
+    for (int x = 0; x < 8; ++x)
+    {
+        fprintf(stream, "    {");
+
+        for (int u = 0; u < 8; ++u)
+        {
+            float c = (float)(0.5 * C(u) * cos16((2 * x + 1) * u));
+
+            fprintf(stream, " %af,", (double)c);
+        }
+
+        fprintf(stream, " },\n");
+    }
+
+    fprintf(stream, "};\n");
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s output.c\n", argv[0]);
+        return 1;
+    }
+
+    FILE *stream = fopen(argv[1], "w");
+
+    if (stream == NULL)
+    {
+        fprintf(stderr, "fopen failure\n");
+        return 1;
+    }
+
+    int err = RET_SUCCESS;
+
+    fprintf(stream, "/* generated by gentables, do not edit */\n\n");
+    fprintf(stream, "#include \"common.h\"\n\n");
+    fprintf(stream, "const struct hcode mjpg_hcode[2][2] =\n{\n");
+
+    /* [0=DC/1=AC][identifier] */
+    fprintf(stream, "  {\n");
+    err = err ? err : print_hcode(stream, &mjpg_htable_0_0, "DC Y");
+    err = err ? err : print_hcode(stream, &mjpg_htable_0_1, "DC CbCr");
+    fprintf(stream, "  },\n  {\n");
+    err = err ? err : print_hcode(stream, &mjpg_htable_1_0, "AC Y");
+    err = err ? err : print_hcode(stream, &mjpg_htable_1_1, "AC CbCr");
+    fprintf(stream, "  },\n");
+
+    fprintf(stream, "};\n\n");
+
+    print_dct_lut(stream);
+
+    if (fclose(stream) != 0)
+    {
+        err = RET_FAILURE_FILE_IO;
+    }
+
+    if (err)
+    {
+        fprintf(stderr, "Failure.\n");
+        remove(argv[1]);
+        return 1;
+    }
+
+    return 0;
+}
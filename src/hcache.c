@@ -0,0 +1,187 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include "hcache.h"
+#include "huffman.h"
+
+/* power of two */
+#define HCACHE_BUCKETS 64
+
+struct entry
+{
+    struct entry *next;
+
+    uint32_t hash;
+
+    struct htable htable;
+
+    struct hcode hcode;
+};
+
+static struct
+{
+    pthread_mutex_t mutex;
+
+    struct entry *buckets[HCACHE_BUCKETS];
+
+    size_t entries;
+
+    size_t hits, misses;
+} hcache = { PTHREAD_MUTEX_INITIALIZER, { NULL }, 0, 0, 0 };
+
+/* the number of values in V[] */
+static size_t count_values(const struct htable *htable)
+{
+    size_t n = 0;
+
+    for (int i = 0; i < 16; ++i)
+    {
+        n += htable->L[i];
+    }
+
+    return n;
+}
+
+/* FNV-1a over L[] and the used part of V[] */
+static uint32_t hash_htable(const struct htable *htable, size_t n)
+{
+    uint32_t hash = UINT32_C(2166136261);
+
+    for (int i = 0; i < 16; ++i)
+    {
+        hash = (hash ^ htable->L[i]) * UINT32_C(16777619);
+    }
+
+    for (size_t k = 0; k < n; ++k)
+    {
+        hash = (hash ^ htable->V[k]) * UINT32_C(16777619);
+    }
+
+    return hash;
+}
+
+static int same_htable(const struct htable *a, const struct htable *b, size_t n)
+{
+    return memcmp(a->L, b->L, sizeof(a->L)) == 0 && memcmp(a->V, b->V, n) == 0;
+}
+
+int hcache_get(const struct htable *htable, const struct hcode **hcode)
+{
+    assert(htable != NULL);
+    assert(hcode != NULL);
+
+    size_t n = count_values(htable);
+
+    if (n > 256)
+    {
+        return RET_FAILURE_FILE_UNSUPPORTED;
+    }
+
+    uint32_t hash = hash_htable(htable, n);
+
+    struct entry **bucket = &hcache.buckets[hash & (HCACHE_BUCKETS - 1)];
+
+    int err = RET_SUCCESS;
+
+    pthread_mutex_lock(&hcache.mutex);
+
+    for (struct entry *entry = *bucket; entry != NULL; entry = entry->next)
+    {
+        if (entry->hash == hash && same_htable(&entry->htable, htable, n))
+        {
+            hcache.hits++;
+
+            *hcode = &entry->hcode;
+
+            goto end;
+        }
+    }
+
+    hcache.misses++;
+
+    *hcode = NULL;
+
+    if (hcache.entries == HCACHE_ENTRIES)
+    {
+        goto end;
+    }
+
+    struct entry *entry = malloc(sizeof(struct entry));
+
+    if (entry == NULL)
+    {
+        err = RET_FAILURE_MEMORY_ALLOCATION;
+        goto end;
+    }
+
+    /* the unused values do not take part in the key */
+    memset(&entry->htable, 0, sizeof(struct htable));
+    memcpy(entry->htable.L, htable->L, sizeof(htable->L));
+    memcpy(entry->htable.V, htable->V, n);
+    memset(&entry->hcode, 0, sizeof(struct hcode));
+
+    err = conv_htable_to_hcode(&entry->htable, &entry->hcode);
+
+    if (err)
+    {
+        free(entry);
+        goto end;
+    }
+
+    entry->hash = hash;
+    entry->next = *bucket;
+    *bucket = entry;
+
+    hcache.entries++;
+
+    *hcode = &entry->hcode;
+
+end:
+    pthread_mutex_unlock(&hcache.mutex);
+
+    return err;
+}
+
+void hcache_clear(void)
+{
+    pthread_mutex_lock(&hcache.mutex);
+
+    for (int b = 0; b < HCACHE_BUCKETS; ++b)
+    {
+        struct entry *entry = hcache.buckets[b];
+
+        while (entry != NULL)
+        {
+            struct entry *next = entry->next;
+
+            free(entry);
+
+            entry = next;
+        }
+
+        hcache.buckets[b] = NULL;
+    }
+
+    hcache.entries = 0;
+
+    pthread_mutex_unlock(&hcache.mutex);
+}
+
+void hcache_stats(size_t *hits, size_t *misses)
+{
+    pthread_mutex_lock(&hcache.mutex);
+
+    if (hits != NULL)
+    {
+        *hits = hcache.hits;
+    }
+
+    if (misses != NULL)
+    {
+        *misses = hcache.misses;
+    }
+
+    pthread_mutex_unlock(&hcache.mutex);
+}
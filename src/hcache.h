@@ -0,0 +1,23 @@
+#ifndef JPEG_HCACHE_H
+#define JPEG_HCACHE_H
+
+#include "common.h"
+
+/* the number of distinct tables kept by the cache */
+#define HCACHE_ENTRIES 256
+
+/*
+ * process-wide cache of Annex C tables keyed by the content of the DHT segment (L and V)
+ *
+ * the tables are shared by all contexts and threads, they are immutable and stay valid until hcache_clear()
+ * *hcode is NULL if the table is not cached and the cache is full (the caller builds the table itself)
+ */
+int hcache_get(const struct htable *htable, const struct hcode **hcode);
+
+/* release all the tables, no context may use them anymore */
+void hcache_clear(void);
+
+/* hits and misses so far */
+void hcache_stats(size_t *hits, size_t *misses);
+
+#endif
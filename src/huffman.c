@@ -1,4 +1,5 @@
 #include <stddef.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -68,7 +69,7 @@ int generate_size_table(struct htable *htable, struct hcode *hcode)
         J = 1;
     }
     while (I <= 16);
-    assert(K < 256);
+    assert(K < 257);
     HUFFSIZE(K) = 0;
     LASTK = K;
 
@@ -92,6 +93,12 @@ int generate_code_table(struct htable *htable, struct hcode *hcode)
     uint16_t CODE = 0;
     size_t SI = HUFFSIZE(0);
 
+    /* empty table */
+    if (SI == 0)
+    {
+        return RET_SUCCESS;
+    }
+
     do
     {
         do
@@ -100,11 +107,11 @@ int generate_code_table(struct htable *htable, struct hcode *hcode)
             HUFFCODE(K) = CODE;
             CODE++;
             K++;
-            assert(K < 256);
+            assert(K < 257);
         }
         while (HUFFSIZE(K) == SI);
 
-        assert(K < 256);
+        assert(K < 257);
         if (HUFFSIZE(K) == 0)
         {
             return RET_SUCCESS;
@@ -114,7 +121,7 @@ int generate_code_table(struct htable *htable, struct hcode *hcode)
         {
             CODE <<= 1;
             SI++;
-            assert(K < 256);
+            assert(K < 257);
         }
         while (HUFFSIZE(K) != SI);
     }
@@ -139,15 +146,20 @@ int order_codes(struct htable *htable, struct hcode *hcode)
 
     size_t K = 0;
 
-    do
+    /* values without a code */
+    for (int I = 0; I < 256; ++I)
+    {
+        EHUFSI(I) = 0;
+    }
+
+    while (K < LASTK)
     {
         uint8_t I = HUFFVAL(K);
         EHUFCO(I) = HUFFCODE(K);
         EHUFSI(I) = HUFFSIZE(K);
-// 		printf("[DEBUG] value=%i cat=%i size=%zu code=%" PRIu16 "\n", I, I & 15, EHUFSI(I), EHUFCO(I));
+// 		printf("[DEBUG] value=%i cat=%i size=%i code=%" PRIu16 "\n", I, I & 15, EHUFSI(I), EHUFCO(I));
         K++;
     }
-    while (K < LASTK);
 
 #undef HUFFVAL
 #undef EHUFCO
@@ -159,6 +171,71 @@ int order_codes(struct htable *htable, struct hcode *hcode)
     return RET_SUCCESS;
 }
 
+/* Figure F.15 – Decoder table generation */
+int generate_decoder_tables(struct htable *htable, struct hcode *hcode)
+{
+    assert(htable != NULL);
+    assert(hcode != NULL);
+
+#define BITS(I)     (htable->L[(I) - 1])
+#define HUFFCODE(K) (hcode->huff_code[(K)])
+#define MAXCODE(I)  (hcode->max_code[(I)])
+#define MINCODE(I)  (hcode->min_code[(I)])
+#define VALPTR(I)   (hcode->val_ptr[(I)])
+
+    int I = 0;
+    int J = 0;
+
+    while (++I <= 16)
+    {
+        if (BITS(I) == 0)
+        {
+            MAXCODE(I) = -1;
+            continue;
+        }
+
+        VALPTR(I) = J;
+        MINCODE(I) = HUFFCODE(J);
+        J = J + BITS(I) - 1;
+        MAXCODE(I) = HUFFCODE(J);
+        J++;
+    }
+
+    /* no code is longer than 16 bits */
+    MAXCODE(17) = INT32_MAX;
+
+    /* the lookahead for read_code(), the codes of up to 8 bits decode with a single peek */
+    for (int i = 0; i < 256; ++i)
+    {
+        hcode->look_size[i] = 0;
+    }
+
+    for (size_t K = 0; K < hcode->last_k; ++K)
+    {
+        uint8_t size = hcode->huff_size[K];
+        uint16_t code = HUFFCODE(K);
+
+        if (size > 8 || code >= (1 << size))
+        {
+            continue;
+        }
+
+        for (int i = code << (8 - size); i < (code + 1) << (8 - size); ++i)
+        {
+            hcode->look_size[i] = size;
+            hcode->look_val[i] = hcode->huff_val[K];
+        }
+    }
+
+#undef BITS
+#undef HUFFCODE
+#undef MAXCODE
+#undef MINCODE
+#undef VALPTR
+
+    return RET_SUCCESS;
+}
+
 int conv_htable_to_hcode(struct htable *htable, struct hcode *hcode)
 {
     int err;
@@ -166,17 +243,21 @@ int conv_htable_to_hcode(struct htable *htable, struct hcode *hcode)
     assert(htable != NULL);
     assert(hcode != NULL);
 
-    uint8_t *v = hcode->huff_val;
+    size_t mt = 0;
 
     for (int i = 0; i < 16; ++i)
     {
-        uint8_t L = htable->L[i];
+        mt += htable->L[i];
+    }
 
-        for (int l = 0; l < L; ++l)
-        {
-            *v = htable->V[i][l];
-            v++;
-        }
+    if (mt > 256)
+    {
+        return RET_FAILURE_FILE_UNSUPPORTED;
+    }
+
+    for (size_t k = 0; k < mt; ++k)
+    {
+        hcode->huff_val[k] = htable->V[k];
     }
 
     err = generate_size_table(htable, hcode);
@@ -188,6 +269,9 @@ int conv_htable_to_hcode(struct htable *htable, struct hcode *hcode)
     err = order_codes(htable, hcode);
     RETURN_IF(err);
 
+    err = generate_decoder_tables(htable, hcode);
+    RETURN_IF(err);
+
     return RET_SUCCESS;
 }
 
@@ -204,7 +288,7 @@ int conv_htable_to_hcode(struct htable *htable, struct hcode *hcode)
  * // value ... category code
  * // read extra bits
  */
-int query_code(struct vlc *vlc, struct hcode *hcode, uint8_t *value)
+int query_code(struct vlc *vlc, const struct hcode *hcode, uint8_t *value)
 {
     assert(vlc != NULL);
     assert(hcode != NULL);
@@ -241,75 +325,90 @@ int query_code(struct vlc *vlc, struct hcode *hcode, uint8_t *value)
     return -1; /* not found */
 }
 
-/* transform value to (code, size), inverse of query_code() */
-int value_to_vlc(struct vlc *vlc, struct hcode *hcode, uint8_t value)
+/* Figure F.16 – Procedure for DECODE */
+int read_code(struct bits *bits, const struct hcode *hcode, uint8_t *value)
 {
-    assert(vlc != NULL);
+    int err;
+    uint8_t bit;
+
     assert(hcode != NULL);
+    assert(value != NULL);
 
 #define HUFFVAL(K)  (hcode->huff_val[(K)])
-#define LASTK       (hcode->last_k)
-#define HUFFSIZE(K) (hcode->huff_size[(K)])
-#define HUFFCODE(K) (hcode->huff_code[(K)])
+#define MAXCODE(I)  (hcode->max_code[(I)])
+#define MINCODE(I)  (hcode->min_code[(I)])
+#define VALPTR(I)   (hcode->val_ptr[(I)])
 
-    for (size_t K = 0; K < LASTK; ++K)
-    {
-        if (value == HUFFVAL(K))
-        {
-            vlc->size = HUFFSIZE(K);
-            vlc->code = HUFFCODE(K);
+    int I = 1;
+    int32_t CODE;
+    uint16_t look;
 
-            return RET_SUCCESS;
-        }
+    /* most codes are short, fewer than 8 bits are left only at the end of the segment */
+    if (peek_bits(bits, 8, &look) == RET_SUCCESS && hcode->look_size[look] != 0)
+    {
+        skip_bits(bits, hcode->look_size[look]);
+        *value = hcode->look_val[look];
+        return RET_SUCCESS;
     }
 
-#undef HUFFVAL
-#undef LASTK
-#undef HUFFSIZE
-#undef HUFFCODE
+    err = next_bit(bits, &bit);
+    RETURN_IF(err);
 
-    return -1; /* not found */
-}
+    CODE = bit;
 
-int read_code(struct bits *bits, struct hcode *hcode, uint8_t *value)
-{
-    int err;
-    struct vlc vlc;
+    while (CODE > MAXCODE(I))
+    {
+        I++;
 
-    init_vlc(&vlc);
+        if (I > 16)
+        {
+            /* invalid code, the rest of the segment cannot be decoded */
+            do
+            {
+                err = next_bit(bits, &bit);
+            }
+            while (err == RET_SUCCESS);
+
+            return err;
+        }
 
-    do
-    {
-        uint8_t bit;
         err = next_bit(bits, &bit);
         RETURN_IF(err);
-        err = vlc_add_bit(&vlc, (uint16_t)bit); // add this bit to VLC
-        RETURN_IF(err);
+
+        CODE = (CODE << 1) + bit;
     }
-    while (query_code(&vlc, hcode, value) == -1);   // query Huffman table
+
+    *value = HUFFVAL(VALPTR(I) + CODE - MINCODE(I));
+
+#undef HUFFVAL
+#undef MAXCODE
+#undef MINCODE
+#undef VALPTR
 
     return RET_SUCCESS;
 }
 
 /* inverse of read_code() */
-int write_code(struct bits *bits, struct hcode *hcode, uint8_t value)
+int write_code(struct bits *bits, const struct hcode *hcode, uint8_t value)
 {
     int err;
     struct vlc vlc;
 
-    err = value_to_vlc(&vlc, hcode, value);
-    RETURN_IF(err);
+    assert(hcode != NULL);
 
-    /* send bits */
-    while (vlc.size != 0)
+    vlc.code = hcode->e_huf_co[value];
+    vlc.size = hcode->e_huf_si[value];
+
+    if (vlc.size == 0)
     {
-        uint16_t bit;
-        err = vlc_remove_bit(&vlc, &bit);
-        RETURN_IF(err);
-        err = put_bit(bits, (uint8_t)bit);
-        RETURN_IF(err);
+        /* the value has no code */
+        return -1;
     }
 
+    /* send bits */
+    err = put_bits(bits, (uint8_t)vlc.size, vlc.code);
+    RETURN_IF(err);
+
     return RET_SUCCESS;
 }
 
@@ -318,6 +417,14 @@ int read_extra_bits(struct bits *bits, uint8_t count, uint16_t *value)
     int err;
     uint16_t v = 0;
 
+    /* a corrupt table may have categories beyond 16 */
+    if (count != 0 && count <= 16 && peek_bits(bits, count, &v) == RET_SUCCESS)
+    {
+        skip_bits(bits, count);
+        *value = v;
+        return RET_SUCCESS;
+    }
+
     for (int i = 0; i < count; ++i)
     {
         uint8_t bit;
@@ -338,12 +445,10 @@ int write_extra_bits(struct bits *bits, uint8_t count, uint16_t value)
 {
     int err;
 
-    for (int s = count - 1; s >= 0; --s)
-    {
-        uint8_t bit = (value >> s) & 1;
-        err = put_bit(bits, bit);
-        RETURN_IF(err);
-    }
+    assert(count <= 16);
+
+    err = put_bits(bits, count, value);
+    RETURN_IF(err);
 
     return RET_SUCCESS;
 }
@@ -543,7 +648,7 @@ void sort_input(struct huffenc *huffenc)
 
             if (CODESIZE(j) == (size_t)i)
             {
-                assert(k < 16 * 255);
+                assert(k < 256);
 
                 HUFFVAL(k) = j;
                 k++;
@@ -560,7 +665,27 @@ void sort_input(struct huffenc *huffenc)
 #undef HUFFVAL
 }
 
-int adapt_huffman_table(struct htable *htable, struct huffenc *huffenc)
+/* htable.L[] and htable.V[] from huffenc->bits[] and huffenc->huff_val[] */
+static void fill_htable(struct htable *htable, const struct huffenc *huffenc)
+{
+    // fill htable.L[]
+    for (int i = 0; i < 16; ++i)
+    {
+        htable->L[i] = huffenc->bits[i + 1];
+    }
+
+    // fill htable.V[]
+    for (int k = 0, i = 0; i < 16; ++i)
+    {
+        for (int l = 0; l < htable->L[i]; ++l, ++k)
+        {
+            htable->V[k] = huffenc->huff_val[k];
+        }
+    }
+}
+
+/* Annex K.2, kept as the reference for adapt_huffman_table() */
+int adapt_huffman_table_k2(struct htable *htable, struct huffenc *huffenc)
 {
     assert(htable != NULL);
     assert(huffenc != NULL);
@@ -571,25 +696,223 @@ int adapt_huffman_table(struct htable *htable, struct huffenc *huffenc)
 
     sort_input(huffenc);
 
-    // fill htable.L[]
-    for (int i = 0; i < 16; ++i)
+    fill_htable(htable, huffenc);
+
+    return RET_SUCCESS;
+}
+
+/* the maximum code length */
+#define MAX_CODE_SIZE 16
+
+struct leaf
+{
+    size_t freq;
+    int value;
+};
+
+/* ascending frequency, the larger value first for the same frequency (as in K.2) */
+static int compare_leaves(const void *a, const void *b)
+{
+    const struct leaf *l = a;
+    const struct leaf *r = b;
+
+    if (l->freq != r->freq)
     {
-        htable->L[i] = huffenc->bits[i + 1];
+        return l->freq < r->freq ? -1 : +1;
     }
 
-    // fill htable.V[]
-    uint8_t *v = huffenc->huff_val;
+    return r->value - l->value;
+}
 
-    for (int i = 0; i < 16; ++i)
+/*
+ * CODESIZE(V) by the package-merge algorithm (optimal code lengths limited to MAX_CODE_SIZE bits)
+ *
+ * The reserved code point V = 256 takes part with zero weight, so it gets one of the longest codes
+ * and no other code consists of all 1-bits. The lists are built from the longest codes to the shortest
+ * ones, the leaves come first in the sorted order within each list.
+ */
+void code_size_limited(struct huffenc *huffenc)
+{
+    assert(huffenc != NULL);
+
+    struct leaf leaves[257];
+    int n = 0;
+
+    for (int v = 0; v < 257; ++v)
     {
-        uint8_t L = htable->L[i];
+        huffenc->codesize[v] = 0;
 
-        for (int l = 0; l < L; ++l)
+        if (v == 256 || huffenc->freq[v] > 0)
         {
-            htable->V[i][l] = *v;
-            v++;
+            leaves[n].freq = v == 256 ? 0 : huffenc->freq[v];
+            leaves[n].value = v;
+            n++;
         }
     }
 
+    if (n < 2)
+    {
+        return;
+    }
+
+    qsort(leaves, (size_t)n, sizeof(struct leaf), compare_leaves);
+
+    /* for each list, 1 = leaf, 0 = package */
+    uint8_t is_leaf[MAX_CODE_SIZE + 1][2 * 257];
+    int items[MAX_CODE_SIZE + 1];
+
+    size_t weight[2][2 * 257];
+
+    /* the list of the longest codes holds only the leaves */
+    for (int k = 0; k < n; ++k)
+    {
+        weight[MAX_CODE_SIZE % 2][k] = leaves[k].freq;
+        is_leaf[MAX_CODE_SIZE][k] = 1;
+    }
+
+    items[MAX_CODE_SIZE] = n;
+
+    for (int l = MAX_CODE_SIZE - 1; l >= 1; --l)
+    {
+        const size_t *prev = weight[(l + 1) % 2];
+        size_t *list = weight[l % 2];
+
+        int packages = items[l + 1] / 2;
+        int p = 0, k = 0, m = 0;
+
+        /* merge the leaves with the packages of pairs from the previous list */
+        while (k < n || p < packages)
+        {
+            assert(m < 2 * 257);
+
+            if (p == packages || (k < n && leaves[k].freq <= prev[2 * p] + prev[2 * p + 1]))
+            {
+                list[m] = leaves[k++].freq;
+                is_leaf[l][m++] = 1;
+            }
+            else
+            {
+                list[m] = prev[2 * p] + prev[2 * p + 1];
+                is_leaf[l][m++] = 0;
+                p++;
+            }
+        }
+
+        items[l] = m;
+    }
+
+    /* select the 2n - 2 cheapest items, each leaf within them (and within the packages) adds a bit */
+    int m = 2 * n - 2;
+
+    for (int l = 1; l <= MAX_CODE_SIZE && m > 0; ++l)
+    {
+        int c = 0;
+
+        assert(m <= items[l]);
+
+        for (int j = 0; j < m; ++j)
+        {
+            c += is_leaf[l][j];
+        }
+
+        /* the leaves form a prefix of the sorted leaves */
+        for (int k = 0; k < c; ++k)
+        {
+            huffenc->codesize[leaves[k].value]++;
+        }
+
+        m = 2 * (m - c);
+    }
+}
+
+/* BITS(I) from CODESIZE(V), the reserved code point is removed */
+void count_bits_limited(struct huffenc *huffenc)
+{
+    assert(huffenc != NULL);
+
+    for (int k = 0; k < 33; ++k)
+    {
+        huffenc->bits[k] = 0;
+    }
+
+    for (int v = 0; v < 257; ++v)
+    {
+        if (huffenc->codesize[v] != 0)
+        {
+            assert(huffenc->codesize[v] <= MAX_CODE_SIZE);
+
+            huffenc->bits[huffenc->codesize[v]]++;
+        }
+    }
+
+    if (huffenc->codesize[256] != 0)
+    {
+        huffenc->bits[huffenc->codesize[256]]--;
+    }
+}
+
+/* descending frequency, the smaller value first for the same frequency */
+static int compare_leaves_desc(const void *a, const void *b)
+{
+    return compare_leaves(b, a);
+}
+
+/*
+ * HUFFVAL(K) by code size, then by descending frequency (a counting sort)
+ *
+ * The canonical codes of one size are assigned in the HUFFVAL order, the more frequent symbols thus get the codes
+ * with fewer 1-bits, which makes a 0xFF byte (and its stuffed zero byte) less likely in the entropy-coded segment.
+ */
+void sort_input_by_size(struct huffenc *huffenc)
+{
+    assert(huffenc != NULL);
+
+    struct leaf leaves[256];
+    int n = 0;
+
+    for (int v = 0; v < 256; ++v)
+    {
+        if (huffenc->codesize[v] != 0)
+        {
+            leaves[n].freq = huffenc->freq[v];
+            leaves[n].value = v;
+            n++;
+        }
+    }
+
+    qsort(leaves, (size_t)n, sizeof(struct leaf), compare_leaves_desc);
+
+    size_t offset[33];
+
+    offset[1] = 0;
+
+    for (int i = 1; i < 32; ++i)
+    {
+        offset[i + 1] = offset[i] + huffenc->bits[i];
+    }
+
+    for (int k = 0; k < n; ++k)
+    {
+        size_t size = huffenc->codesize[leaves[k].value];
+
+        assert(offset[size] < 256);
+
+        huffenc->huff_val[offset[size]++] = (uint8_t)leaves[k].value;
+    }
+}
+
+int adapt_huffman_table(struct htable *htable, struct huffenc *huffenc)
+{
+    assert(htable != NULL);
+    assert(huffenc != NULL);
+
+    code_size_limited(huffenc);
+
+    count_bits_limited(huffenc);
+
+    sort_input_by_size(huffenc);
+
+    fill_htable(htable, huffenc);
+
     return RET_SUCCESS;
 }
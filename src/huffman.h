@@ -26,24 +26,29 @@ int generate_code_table(struct htable *htable, struct hcode *hcode);
 
 int order_codes(struct htable *htable, struct hcode *hcode);
 
+int generate_decoder_tables(struct htable *htable, struct hcode *hcode);
+
 int conv_htable_to_hcode(struct htable *htable, struct hcode *hcode);
 
 /*
  * query if the code is present in htable/hcode, and return its value
  */
-int query_code(struct vlc *vlc, struct hcode *hcode, uint8_t *value);
+int query_code(struct vlc *vlc, const struct hcode *hcode, uint8_t *value);
 
-int read_code(struct bits *bits, struct hcode *hcode, uint8_t *value);
+int read_code(struct bits *bits, const struct hcode *hcode, uint8_t *value);
 
-int write_code(struct bits *bits, struct hcode *hcode, uint8_t value);
+int write_code(struct bits *bits, const struct hcode *hcode, uint8_t value);
 
 int read_extra_bits(struct bits *bits, uint8_t count, uint16_t *value);
 
 int write_extra_bits(struct bits *bits, uint8_t count, uint16_t value);
 
 /*
- * adaptive Huffman
+ * adaptive Huffman (package-merge, limited to 16 bits)
  */
 int adapt_huffman_table(struct htable *htable, struct huffenc *huffenc);
 
+/* Annex K.2 procedure */
+int adapt_huffman_table_k2(struct htable *htable, struct huffenc *huffenc);
+
 #endif
@@ -15,7 +15,8 @@ void dequantize_block(struct int_block *int_block, struct flt_block *flt_block,
 
     for (int j = 0; j < 64; ++j)
     {
-        flt_block->c[j] = (float)(int_block->c[j] * (int32_t)qtable->Q[j]);
+        /* the same as (float)(c * Q), the product is rounded once */
+        flt_block->c[j] = (float)int_block->c[j] * qtable->dequant[j];
     }
 }
 
@@ -27,7 +28,7 @@ void quantize_block(struct int_block *int_block, struct flt_block *flt_block, st
 
     for (int j = 0; j < 64; ++j)
     {
-        int_block->c[j] = (int32_t)roundf(flt_block->c[j] / (float)qtable->Q[j]);
+        int_block->c[j] = (int32_t)roundf(flt_block->c[j] * qtable->recip[j]);
     }
 }
 
@@ -35,11 +36,11 @@ int dequantize(struct context *context)
 {
     assert(context != NULL);
 
-    for (int i = 0; i < 256; ++i)
+    for (int i = 0; i < context->Nf; ++i)
     {
         if (context->component[i].int_buffer != NULL)
         {
-            printf("Dequantizing component %i...\n", i);
+            TRACE(context, "Dequantizing component %i...\n", i);
 
             size_t blocks = context->component[i].b_x * context->component[i].b_y;
 
@@ -64,11 +65,11 @@ int quantize(struct context *context)
 {
     assert(context != NULL);
 
-    for (int i = 0; i < 256; ++i)
+    for (int i = 0; i < context->Nf; ++i)
     {
         if (context->component[i].int_buffer != NULL)
         {
-            printf("Quantizing component %i...\n", i);
+            TRACE(context, "Quantizing component %i...\n", i);
 
             size_t blocks = context->component[i].b_x * context->component[i].b_y;
 
@@ -89,29 +90,6 @@ int quantize(struct context *context)
     return RET_SUCCESS;
 }
 
-static float C(int u)
-{
-    if (u == 0)
-    {
-        return 1.f / sqrtf(2.f);
-    }
-
-    return 1.f;
-}
-
-float lut[8][8];
-
-void init_lut()
-{
-    for (int x = 0; x < 8; ++x)
-    {
-        for (int u = 0; u < 8; ++u)
-        {
-            lut[x][u] = 0.5f * C(u) * cosf((2 * x + 1) * u * M_PI / 16);
-        }
-    }
-}
-
 void idct1(const float in[8], float out[8], size_t stride)
 {
     for (int x = 0; x < 8; ++x)
@@ -120,7 +98,7 @@ void idct1(const float in[8], float out[8], size_t stride)
 
         for (int u = 0; u < 8; ++u)
         {
-            s += in[u * stride] * lut[x][u];
+            s += in[u * stride] * dct_lut[x][u];
         }
 
         out[x * stride] = s;
@@ -135,7 +113,7 @@ void fdct1(const float in[8], float out[8], size_t stride)
 
         for (int x = 0; x < 8; ++x)
         {
-            s += in[x * stride] * lut[x][u];
+            s += in[x * stride] * dct_lut[x][u];
         }
 
         out[u * stride] = s;
@@ -144,15 +122,6 @@ void fdct1(const float in[8], float out[8], size_t stride)
 
 void idct(struct flt_block *flt_block)
 {
-    static int init = 0;
-
-    // init look-up table
-    if (init == 0)
-    {
-        init_lut();
-        init = 1;
-    }
-
     struct flt_block b;
 
     for (int y = 0; y < 8; ++y)
@@ -168,15 +137,6 @@ void idct(struct flt_block *flt_block)
 
 void fdct(struct flt_block *flt_block)
 {
-    static int init = 0;
-
-    // init look-up table
-    if (init == 0)
-    {
-        init_lut();
-        init = 1;
-    }
-
     struct flt_block b;
 
     for (int y = 0; y < 8; ++y)
@@ -190,6 +150,18 @@ void fdct(struct flt_block *flt_block)
     }
 }
 
+/* IDCT followed by the level shift */
+void inverse_dct_block(struct flt_block *flt_block, int shift)
+{
+    idct(flt_block);
+
+    // level shift
+    for (int j = 0; j < 64; ++j)
+    {
+        flt_block->c[j] += shift;
+    }
+}
+
 int inverse_dct(struct context *context)
 {
     assert(context != NULL);
@@ -198,11 +170,11 @@ int inverse_dct(struct context *context)
     uint8_t P = context->P;
     int shift = 1 << (P - 1);
 
-    for (int i = 0; i < 256; ++i)
+    for (int i = 0; i < context->Nf; ++i)
     {
         if (context->component[i].int_buffer != NULL)
         {
-            printf("IDCT on component %i...\n", i);
+            TRACE(context, "IDCT on component %i...\n", i);
 
             size_t blocks = context->component[i].b_x * context->component[i].b_y;
 
@@ -210,13 +182,7 @@ int inverse_dct(struct context *context)
             {
                 struct flt_block *flt_block = &context->component[i].flt_buffer[b];
 
-                idct(flt_block);
-
-                // level shift
-                for (int j = 0; j < 64; ++j)
-                {
-                    flt_block->c[j] += shift;
-                }
+                inverse_dct_block(flt_block, shift);
             }
         }
     }
@@ -224,6 +190,18 @@ int inverse_dct(struct context *context)
     return RET_SUCCESS;
 }
 
+/* level shift followed by the FDCT */
+void forward_dct_block(struct flt_block *flt_block, int shift)
+{
+    // level shift
+    for (int j = 0; j < 64; ++j)
+    {
+        flt_block->c[j] -= shift;
+    }
+
+    fdct(flt_block);
+}
+
 int forward_dct(struct context *context)
 {
     assert(context != NULL);
@@ -232,11 +210,11 @@ int forward_dct(struct context *context)
     uint8_t P = context->P;
     int shift = 1 << (P - 1);
 
-    for (int i = 0; i < 256; ++i)
+    for (int i = 0; i < context->Nf; ++i)
     {
         if (context->component[i].int_buffer != NULL)
         {
-            printf("FDCT on component %i...\n", i);
+            TRACE(context, "FDCT on component %i...\n", i);
 
             size_t blocks = context->component[i].b_x * context->component[i].b_y;
 
@@ -244,13 +222,7 @@ int forward_dct(struct context *context)
             {
                 struct flt_block *flt_block = &context->component[i].flt_buffer[b];
 
-                // level shift
-                for (int j = 0; j < 64; ++j)
-                {
-                    flt_block->c[j] -= shift;
-                }
-
-                fdct(flt_block);
+                forward_dct_block(flt_block, shift);
             }
         }
     }
@@ -258,16 +230,28 @@ int forward_dct(struct context *context)
     return RET_SUCCESS;
 }
 
+/* copy the block into the raster with the given line stride */
+void conv_block_to_frame(const struct flt_block *flt_block, float *buffer, size_t stride)
+{
+    for (int v = 0; v < 8; ++v)
+    {
+        for (int u = 0; u < 8; ++u)
+        {
+            buffer[v * stride + u] = flt_block->c[v * 8 + u];
+        }
+    }
+}
+
 /* convert floating-point blocks to frame buffers (for each component) */
 int conv_blocks_to_frame(struct context *context)
 {
     assert(context != NULL);
 
-    for (int i = 0; i < 256; ++i)
+    for (int i = 0; i < context->Nf; ++i)
     {
         if (context->component[i].frame_buffer != NULL)
         {
-            printf("converting component %i...\n", i);
+            TRACE(context, "converting component %i...\n", i);
 
             float *buffer = context->component[i].frame_buffer;
 
@@ -281,13 +265,7 @@ int conv_blocks_to_frame(struct context *context)
                     /* copy from... */
                     struct flt_block *flt_block = &context->component[i].flt_buffer[y * b_x + x];
 
-                    for (int v = 0; v < 8; ++v)
-                    {
-                        for (int u = 0; u < 8; ++u)
-                        {
-                            buffer[y * b_x * 8 * 8 + v * b_x * 8 + x * 8 + u] = flt_block->c[v * 8 + u];
-                        }
-                    }
+                    conv_block_to_frame(flt_block, &buffer[y * b_x * 8 * 8 + x * 8], b_x * 8);
                 }
             }
         }
@@ -296,15 +274,27 @@ int conv_blocks_to_frame(struct context *context)
     return RET_SUCCESS;
 }
 
+/* copy the block from the raster with the given line stride */
+void conv_frame_to_block(const float *buffer, size_t stride, struct flt_block *flt_block)
+{
+    for (int v = 0; v < 8; ++v)
+    {
+        for (int u = 0; u < 8; ++u)
+        {
+            flt_block->c[v * 8 + u] = buffer[v * stride + u];
+        }
+    }
+}
+
 int conv_frame_to_blocks(struct context *context)
 {
     assert(context != NULL);
 
-    for (int i = 0; i < 256; ++i)
+    for (int i = 0; i < context->Nf; ++i)
     {
         if (context->component[i].frame_buffer != NULL)
         {
-            printf("converting component %i...\n", i);
+            TRACE(context, "converting component %i...\n", i);
 
             float *buffer = context->component[i].frame_buffer;
 
@@ -318,13 +308,7 @@ int conv_frame_to_blocks(struct context *context)
                     /* copy to... */
                     struct flt_block *flt_block = &context->component[i].flt_buffer[y * b_x + x];
 
-                    for (int v = 0; v < 8; ++v)
-                    {
-                        for (int u = 0; u < 8; ++u)
-                        {
-                            flt_block->c[v * 8 + u] = buffer[y * b_x * 8 * 8 + v * b_x * 8 + x * 8 + u];
-                        }
-                    }
+                    conv_frame_to_block(&buffer[y * b_x * 8 * 8 + x * 8], b_x * 8, flt_block);
                 }
             }
         }
@@ -332,3 +316,45 @@ int conv_frame_to_blocks(struct context *context)
 
     return RET_SUCCESS;
 }
+
+/* dequantize(), inverse_dct() and conv_blocks_to_frame() for a single block (fused decoding) */
+void reconstruct_block(struct context *context, struct component *component, struct int_block *int_block, size_t block_x, size_t block_y)
+{
+    assert(context != NULL);
+    assert(component != NULL);
+
+    struct flt_block flt_block;
+
+    size_t b_x = buffer_b_x(context, component);
+    size_t x = block_x - context->m_x0 * component->H;
+
+    /* the first block of the row */
+    size_t seq = block_seq(context, component, block_x, block_y) - x;
+
+    dequantize_block(int_block, &flt_block, &context->qtable[component->Tq]);
+
+    inverse_dct_block(&flt_block, 1 << (context->P - 1));
+
+    conv_block_to_frame(&flt_block, &component->frame_buffer[seq * 8 * 8 + x * 8], b_x * 8);
+}
+
+/* conv_frame_to_blocks(), forward_dct() and quantize() for a single block */
+void decompose_block(struct context *context, struct component *component, size_t block_x, size_t block_y)
+{
+    assert(context != NULL);
+    assert(component != NULL);
+
+    struct flt_block flt_block;
+
+    size_t b_x = buffer_b_x(context, component);
+    size_t x = block_x - context->m_x0 * component->H;
+
+    /* the first block of the row */
+    size_t seq = block_seq(context, component, block_x, block_y) - x;
+
+    conv_frame_to_block(&component->frame_buffer[seq * 8 * 8 + x * 8], b_x * 8, &flt_block);
+
+    forward_dct_block(&flt_block, 1 << (context->P - 1));
+
+    quantize_block(&component->int_buffer[seq + x], &flt_block, &context->qtable[component->Tq]);
+}
@@ -4,6 +4,9 @@
 #include "common.h"
 #include "coeffs.h"
 
+/* 0.5 C(u) cos((2x + 1) u pi / 16), [x][u], generated at build time (see gentables.c) */
+extern const float dct_lut[8][8];
+
 /* for each component: remove quantization */
 int dequantize(struct context *context);
 
@@ -11,12 +14,26 @@ int quantize(struct context *context);
 
 void dequantize_block(struct int_block *int_block, struct flt_block *flt_block, struct qtable *qtable);
 
+void inverse_dct_block(struct flt_block *flt_block, int shift);
+
 int inverse_dct(struct context *context);
 
 int forward_dct(struct context *context);
 
+void forward_dct_block(struct flt_block *flt_block, int shift);
+
+void conv_block_to_frame(const struct flt_block *flt_block, float *buffer, size_t stride);
+
 int conv_blocks_to_frame(struct context *context);
 
 int conv_frame_to_blocks(struct context *context);
 
+void conv_frame_to_block(const float *buffer, size_t stride, struct flt_block *flt_block);
+
+/* dequantize, IDCT and store the block into its place in the frame buffer */
+void reconstruct_block(struct context *context, struct component *component, struct int_block *int_block, size_t block_x, size_t block_y);
+
+/* take the block from its place in the frame buffer, FDCT and quantize */
+void decompose_block(struct context *context, struct component *component, size_t block_x, size_t block_y);
+
 #endif
@@ -1,53 +1,292 @@
 #include <arpa/inet.h>
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include "io.h"
 #include "common.h"
 
+void init_sink_memory(struct sink *sink)
+{
+    assert(sink != NULL);
+
+    sink->kind = SINK_MEMORY;
+    sink->data = NULL;
+    sink->size = 0;
+    sink->capacity = 0;
+    sink->fd = -1;
+    sink->written = 0;
+}
+
+void init_sink_buffer(struct sink *sink, void *buffer, size_t capacity)
+{
+    assert(sink != NULL);
+
+    sink->kind = SINK_BUFFER;
+    sink->data = buffer;
+    sink->size = 0;
+    sink->capacity = capacity;
+    sink->fd = -1;
+    sink->written = 0;
+}
+
+int init_sink_file(struct sink *sink, int fd)
+{
+    assert(sink != NULL);
+
+    sink->kind = SINK_FILE;
+    sink->data = malloc(SINK_FILE_CHUNK);
+    sink->size = 0;
+    sink->capacity = SINK_FILE_CHUNK;
+    sink->fd = fd;
+    sink->written = 0;
+
+    if (sink->data == NULL)
+    {
+        return RET_FAILURE_MEMORY_ALLOCATION;
+    }
+
+    return RET_SUCCESS;
+}
+
+int sink_flush(struct sink *sink)
+{
+    assert(sink != NULL);
+
+    if (sink->kind != SINK_FILE)
+    {
+        return RET_SUCCESS;
+    }
+
+    size_t done = 0;
+
+    while (done < sink->size)
+    {
+        ssize_t n = write(sink->fd, sink->data + done, sink->size - done);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return RET_FAILURE_FILE_IO;
+        }
+
+        done += (size_t)n;
+    }
+
+    sink->written += sink->size;
+    sink->size = 0;
+
+    return RET_SUCCESS;
+}
+
+/* make room for size more bytes */
+static int sink_reserve(struct sink *sink, size_t size)
+{
+    int err;
+
+    switch (sink->kind)
+    {
+    case SINK_MEMORY:
+        {
+            size_t capacity = sink->capacity > 0 ? sink->capacity : 4096;
+
+            while (capacity - sink->size < size)
+            {
+                capacity *= 2;
+            }
+
+            uint8_t *data = realloc(sink->data, capacity);
+
+            if (data == NULL)
+            {
+                return RET_FAILURE_MEMORY_ALLOCATION;
+            }
+
+            sink->data = data;
+            sink->capacity = capacity;
+
+            return RET_SUCCESS;
+        }
+    case SINK_FILE:
+        err = sink_flush(sink);
+        RETURN_IF(err);
+
+        return RET_SUCCESS;
+    default:
+        /* the buffer of the caller is full */
+        return RET_FAILURE_OVERFLOW_ERROR;
+    }
+}
+
+int sink_write(struct sink *sink, const void *data, size_t size)
+{
+    int err;
+
+    assert(sink != NULL);
+
+    if (sink->capacity - sink->size < size)
+    {
+        err = sink_reserve(sink, size);
+        RETURN_IF(err);
+
+        /* large blocks go to the file directly */
+        if (sink->kind == SINK_FILE && size > sink->capacity)
+        {
+            struct sink direct = *sink;
+
+            direct.data = (uint8_t *)data;
+            direct.size = size;
+
+            err = sink_flush(&direct);
+            RETURN_IF(err);
+
+            sink->written = direct.written;
+
+            return RET_SUCCESS;
+        }
+    }
+
+    memcpy(sink->data + sink->size, data, size);
+
+    sink->size += size;
+
+    return RET_SUCCESS;
+}
+
+size_t sink_tell(const struct sink *sink)
+{
+    assert(sink != NULL);
+
+    return sink->written + sink->size;
+}
+
+void free_sink(struct sink *sink)
+{
+    assert(sink != NULL);
+
+    if (sink->kind != SINK_BUFFER)
+    {
+        free(sink->data);
+    }
+
+    sink->data = NULL;
+    sink->size = 0;
+    sink->capacity = 0;
+}
+
 int init_bits(struct bits *bits, FILE *stream)
 {
     assert(bits != NULL);
 
+    bits->window = 0;
     bits->count = 0;
+    bits->end = RET_SUCCESS;
     bits->stream = stream;
+    bits->sink = NULL;
+
+    return RET_SUCCESS;
+}
+
+int init_bits_sink(struct bits *bits, struct sink *sink)
+{
+    assert(bits != NULL);
+
+    bits->window = 0;
+    bits->count = 0;
+    bits->end = RET_SUCCESS;
+    bits->stream = NULL;
+    bits->sink = sink;
 
     return RET_SUCCESS;
 }
 
+/* read whole bytes into the window while they fit, the stream stops before a marker (read_ecs_byte()) */
+static void fill_bits(struct bits *bits)
+{
+    while (bits->count <= 24 && bits->end == RET_SUCCESS)
+    {
+        uint8_t byte;
+
+        bits->end = read_ecs_byte(bits->stream, &byte);
+
+        if (bits->end == RET_SUCCESS)
+        {
+            bits->window |= (uint32_t)byte << (24 - bits->count);
+            bits->count += 8;
+        }
+    }
+}
+
 /* F.2.2.5 The NEXTBIT procedure
  * Figure F.18 – Procedure for fetching the next bit of compressed data */
 int next_bit(struct bits *bits, uint8_t *bit)
 {
-    int err;
-
     assert(bits != NULL);
 
     if (bits->count == 0)
     {
-        /* refill bits->byte */
-        err = read_ecs_byte(bits->stream, &bits->byte);
-        RETURN_IF(err); /* incl. RET_FAILURE_NO_MORE_DATA */
+        fill_bits(bits);
 
-        bits->count = 8;
+        if (bits->count == 0)
+        {
+            return bits->end; /* incl. RET_FAILURE_NO_MORE_DATA */
+        }
     }
 
     assert(bit != NULL);
 
     /* output MSB */
-    *bit = bits->byte >> 7;
+    *bit = (uint8_t)(bits->window >> 31);
 
-    bits->byte <<= 1;
+    bits->window <<= 1;
     bits->count--;
 
     return RET_SUCCESS;
 }
 
+int peek_bits(struct bits *bits, uint8_t n, uint16_t *value)
+{
+    assert(bits != NULL);
+    assert(n >= 1 && n <= 16);
+
+    if (bits->count < n)
+    {
+        fill_bits(bits);
+
+        if (bits->count < n)
+        {
+            return bits->end != RET_SUCCESS ? bits->end : RET_FAILURE_NO_MORE_DATA;
+        }
+    }
+
+    assert(value != NULL);
+
+    *value = (uint16_t)(bits->window >> (32 - n));
+
+    return RET_SUCCESS;
+}
+
+void skip_bits(struct bits *bits, uint8_t n)
+{
+    assert(bits != NULL);
+    assert(n <= bits->count);
+
+    bits->window <<= n;
+    bits->count -= n;
+}
+
 int put_bit(struct bits *bits, uint8_t bit)
 {
     assert(bits != NULL);
     assert(bits->count < 8);
 
-    bits->byte <<= 1;
-    bits->byte |= bit & 1;
+    bits->window <<= 1;
+    bits->window |= bit & 1;
 
     bits->count++;
 
@@ -55,7 +294,7 @@ int put_bit(struct bits *bits, uint8_t bit)
     {
         int err;
 
-        err = write_ecs_byte(bits->stream, bits->byte);
+        err = write_ecs_byte(bits->sink, (uint8_t)bits->window);
         RETURN_IF(err);
 
         bits->count = 0;
@@ -64,6 +303,29 @@ int put_bit(struct bits *bits, uint8_t bit)
     return RET_SUCCESS;
 }
 
+int put_bits(struct bits *bits, uint8_t n, uint16_t value)
+{
+    int err;
+
+    assert(bits != NULL);
+    assert(bits->count < 8);
+    assert(n <= 16);
+
+    /* at most 7 + 16 pending bits */
+    bits->window = (bits->window << n) | (value & ((UINT32_C(1) << n) - 1));
+    bits->count += n;
+
+    while (bits->count >= 8)
+    {
+        bits->count -= 8;
+
+        err = write_ecs_byte(bits->sink, (uint8_t)(bits->window >> bits->count));
+        RETURN_IF(err);
+    }
+
+    return RET_SUCCESS;
+}
+
 int flush_bits(struct bits *bits)
 {
     int err;
@@ -77,12 +339,12 @@ int flush_bits(struct bits *bits)
 
     while (bits->count < 8)
     {
-        bits->byte <<= 1;
-        bits->byte |= 1;
+        bits->window <<= 1;
+        bits->window |= 1;
         bits->count++;
     }
 
-    err = write_ecs_byte(bits->stream, bits->byte);
+    err = write_ecs_byte(bits->sink, (uint8_t)bits->window);
     RETURN_IF(err);
 
     bits->count = 0;
@@ -92,22 +354,31 @@ int flush_bits(struct bits *bits)
 
 int read_byte(FILE *stream, uint8_t *byte)
 {
-    if (fread(byte, sizeof(uint8_t), 1, stream) != 1)
+    /* the stream is not shared between threads, skip the locking of fread() */
+    int c = getc_unlocked(stream);
+
+    if (c == EOF)
     {
         return RET_FAILURE_FILE_IO;
     }
 
+    *byte = (uint8_t)c;
+
     return RET_SUCCESS;
 }
 
-int write_byte(FILE *stream, uint8_t byte)
+int write_byte(struct sink *sink, uint8_t byte)
 {
-    if (fwrite(&byte, sizeof(uint8_t), 1, stream) != 1)
+    assert(sink != NULL);
+
+    if (sink->size < sink->capacity)
     {
-        return RET_FAILURE_FILE_IO;
+        sink->data[sink->size++] = byte;
+
+        return RET_SUCCESS;
     }
 
-    return RET_SUCCESS;
+    return sink_write(sink, &byte, 1);
 }
 
 int read_word(FILE *stream, uint16_t *word)
@@ -128,16 +399,11 @@ int read_word(FILE *stream, uint16_t *word)
     return RET_SUCCESS;
 }
 
-int write_word(FILE *stream, uint16_t word)
+int write_word(struct sink *sink, uint16_t word)
 {
     word = htons(word);
 
-    if (fwrite(&word, sizeof(uint16_t), 1, stream) != 1)
-    {
-        return RET_FAILURE_FILE_IO;
-    }
-
-    return RET_SUCCESS;
+    return sink_write(sink, &word, sizeof(uint16_t));
 }
 
 int read_length(FILE *stream, uint16_t *len)
@@ -150,11 +416,11 @@ int read_length(FILE *stream, uint16_t *len)
     return RET_SUCCESS;
 }
 
-int write_length(FILE *stream, uint16_t len)
+int write_length(struct sink *sink, uint16_t len)
 {
     int err;
 
-    err = write_word(stream, len);
+    err = write_word(sink, len);
     RETURN_IF(err);
 
     return RET_SUCCESS;
@@ -178,12 +444,12 @@ int read_nibbles(FILE *stream, uint8_t *first, uint8_t *second)
     return RET_SUCCESS;
 }
 
-int write_nibbles(FILE *stream, uint8_t first, uint8_t second)
+int write_nibbles(struct sink *sink, uint8_t first, uint8_t second)
 {
     int err;
     uint8_t byte = (first << 4) | (second & 15);
 
-    err = write_byte(stream, byte);
+    err = write_byte(sink, byte);
     RETURN_IF(err);
 
     return RET_SUCCESS;
@@ -199,8 +465,6 @@ int read_marker(FILE *stream, uint16_t *marker)
     /* Any marker may optionally be preceded by any
      * number of fill bytes, which are bytes assigned code X’FF’. */
 
-    long start = ftell(stream), end;
-
 seek:
     do
     {
@@ -222,11 +486,6 @@ seek:
         case 0x00:
             goto seek;
         default:
-            end = ftell(stream);
-            if (end - start != 2)
-            {
-                printf("*** %li bytes skipped ***\n", end - start - 2);
-            }
             *marker = UINT16_C(0xff00) | byte;
             return RET_SUCCESS;
         }
@@ -234,16 +493,16 @@ seek:
     while (1);
 }
 
-int write_marker(FILE *stream, uint16_t marker)
+int write_marker(struct sink *sink, uint16_t marker)
 {
     int err;
 
     assert((marker >> 8) == 0xff);
 
-    err = write_byte(stream, 0xff);
+    err = write_byte(sink, 0xff);
     RETURN_IF(err);
 
-    err = write_byte(stream, (uint8_t)marker);
+    err = write_byte(sink, (uint8_t)marker);
     RETURN_IF(err);
 
     return RET_SUCCESS;
@@ -296,17 +555,31 @@ int read_ecs_byte(FILE *stream, uint8_t *byte)
     }
 }
 
+int skip_ecs(FILE *stream)
+{
+    int err;
+    uint8_t byte;
+
+    do
+    {
+        err = read_ecs_byte(stream, &byte);
+    }
+    while (err == RET_SUCCESS);
+
+    return err == RET_FAILURE_NO_MORE_DATA ? RET_SUCCESS : err;
+}
+
 /* B.1.1.5 Entropy-coded data segments */
-int write_ecs_byte(FILE *stream, uint8_t byte)
+int write_ecs_byte(struct sink *sink, uint8_t byte)
 {
     int err;
 
-    err = write_byte(stream, byte);
+    err = write_byte(sink, byte);
     RETURN_IF(err);
 
     if (byte == 0xff)
     {
-        err = write_byte(stream, 0x00);
+        err = write_byte(sink, 0x00);
         RETURN_IF(err);
     }
 
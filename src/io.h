@@ -4,48 +4,116 @@
 #include <stdio.h>
 #include <stdint.h>
 
+/* where the written bytes go */
+enum
+{
+    /* growable buffer in memory (sink->data is owned) */
+    SINK_MEMORY,
+    /* fixed buffer of the caller */
+    SINK_BUFFER,
+    /* file descriptor, buffered and written in large write() calls */
+    SINK_FILE
+};
+
+/* SINK_FILE writes once this many bytes are buffered */
+#define SINK_FILE_CHUNK (1 << 20)
+
+struct sink
+{
+    int kind;
+
+    /* the bytes held, sink->size of sink->capacity */
+    uint8_t *data;
+    size_t size, capacity;
+
+    /* SINK_FILE */
+    int fd;
+
+    /* the bytes already handed over to the file */
+    size_t written;
+};
+
+void init_sink_memory(struct sink *sink);
+
+void init_sink_buffer(struct sink *sink, void *buffer, size_t capacity);
+
+int init_sink_file(struct sink *sink, int fd);
+
+int sink_write(struct sink *sink, const void *data, size_t size);
+
+/* SINK_FILE: write() the buffered bytes */
+int sink_flush(struct sink *sink);
+
+/* the total number of bytes written into the sink */
+size_t sink_tell(const struct sink *sink);
+
+/* release the owned memory (not the buffer of the caller, the descriptor is not closed) */
+void free_sink(struct sink *sink);
+
 struct bits
 {
-    uint8_t byte;
+    /* reading: the next count bits of the data, MSB first; writing: the count pending bits, LSB last */
+    uint32_t window;
     size_t count;
+
+    /* reading: the error that stopped the refill of the window (a marker or the end of the data) */
+    int end;
+
     FILE *stream;
+    struct sink *sink;
 };
 
+/* for reading */
 int init_bits(struct bits *bits, FILE *stream);
 
+/* for writing */
+int init_bits_sink(struct bits *bits, struct sink *sink);
+
 /* F.2.2.5 The NEXTBIT procedure */
 int next_bit(struct bits *bits, uint8_t *bit);
 
+/* the next n (at most 16) bits without consuming them, fails if fewer are left */
+int peek_bits(struct bits *bits, uint8_t n, uint16_t *value);
+
+/* consume n bits, after a successful peek_bits() of at least n bits */
+void skip_bits(struct bits *bits, uint8_t n);
+
 int put_bit(struct bits *bits, uint8_t bit);
 
+/* the n (at most 16) low bits of the value, MSB first */
+int put_bits(struct bits *bits, uint8_t n, uint16_t value);
+
 /* align to byte boundary */
 int flush_bits(struct bits *bits);
 
 int read_nibbles(FILE *stream, uint8_t *first, uint8_t *second);
 
-int write_nibbles(FILE *stream, uint8_t first, uint8_t second);
+int write_nibbles(struct sink *sink, uint8_t first, uint8_t second);
 
 int read_byte(FILE *stream, uint8_t *byte);
 
-int write_byte(FILE *stream, uint8_t byte);
+int write_byte(struct sink *sink, uint8_t byte);
 
 int read_word(FILE *stream, uint16_t *word);
 
-int write_word(FILE *stream, uint16_t word);
+int write_word(struct sink *sink, uint16_t word);
 
 int read_length(FILE *stream, uint16_t *len);
 
-int write_length(FILE *stream, uint16_t len);
+int write_length(struct sink *sink, uint16_t len);
 
 int skip_segment(FILE *stream, uint16_t len);
 
 int read_marker(FILE *stream, uint16_t *marker);
 
-int write_marker(FILE *stream, uint16_t marker);
+int write_marker(struct sink *sink, uint16_t marker);
 
 /* read entropy-coded segment byte */
 int read_ecs_byte(FILE *stream, uint8_t *byte);
 
-int write_ecs_byte(FILE *stream, uint8_t byte);
+int write_ecs_byte(struct sink *sink, uint8_t byte);
+
+/* the rest of the entropy-coded segment, up to the next marker */
+int skip_ecs(FILE *stream);
 
 #endif
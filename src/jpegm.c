@@ -0,0 +1,767 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jpegm.h"
+#include "common.h"
+#include "frame.h"
+#include "io.h"
+#include "decode.h"
+#include "encode.h"
+#include "transcode.h"
+#include "arena.h"
+
+/* the data of a call, read through the stream of a context */
+struct input
+{
+    const uint8_t *data;
+    size_t size, pos;
+};
+
+struct jpegm_context
+{
+    struct context context;
+
+    /* the memory of this struct */
+    struct allocator allocator;
+
+    /* opened once, instead of fmemopen() for each call */
+    struct input input;
+    FILE *stream;
+    char buffer[BUFSIZ];
+};
+
+/* the internal RET_* code as a JPEGM_* one */
+static int public_error(int err)
+{
+    switch (err)
+    {
+    case RET_SUCCESS:
+        return JPEGM_SUCCESS;
+    case RET_FAILURE_FILE_IO:
+    case RET_FAILURE_FILE_SEEK:
+    case RET_FAILURE_NO_MORE_DATA:
+        return JPEGM_ERROR_DATA;
+    case RET_FAILURE_FILE_UNSUPPORTED:
+        return JPEGM_ERROR_UNSUPPORTED;
+    /* fmemopen() */
+    case RET_FAILURE_FILE_OPEN:
+    case RET_FAILURE_MEMORY_ALLOCATION:
+        return JPEGM_ERROR_MEMORY;
+    case RET_FAILURE_OVERFLOW_ERROR:
+        return JPEGM_ERROR_OVERFLOW;
+    default:
+        return JPEGM_ERROR_INTERNAL;
+    }
+}
+
+const char *jpegm_strerror(int err)
+{
+    switch (err)
+    {
+    case JPEGM_SUCCESS:
+        return "success";
+    case JPEGM_ERROR_DATA:
+        return "truncated or invalid data";
+    case JPEGM_ERROR_UNSUPPORTED:
+        return "unsupported feature";
+    case JPEGM_ERROR_MEMORY:
+        return "out of memory";
+    case JPEGM_ERROR_OVERFLOW:
+        return "output buffer too small";
+    case JPEGM_ERROR_INTERNAL:
+        return "internal error";
+    default:
+        return "unknown error";
+    }
+}
+
+static ssize_t input_read(void *cookie, char *buf, size_t size)
+{
+    struct input *input = cookie;
+
+    size_t n = input->size - input->pos < size ? input->size - input->pos : size;
+
+    memcpy(buf, input->data + input->pos, n);
+
+    input->pos += n;
+
+    return (ssize_t)n;
+}
+
+static int input_seek(void *cookie, off64_t *offset, int whence)
+{
+    struct input *input = cookie;
+
+    off64_t base = whence == SEEK_SET ? 0 : whence == SEEK_CUR ? (off64_t)input->pos : (off64_t)input->size;
+
+    if (base + *offset < 0 || base + *offset > (off64_t)input->size)
+    {
+        return -1;
+    }
+
+    input->pos = (size_t)(base + *offset);
+
+    *offset = (off64_t)input->pos;
+
+    return 0;
+}
+
+/* the struct jpegm_context without an allocator, the arena has its own default */
+static void *default_alloc(size_t size, void *opaque)
+{
+    (void)opaque;
+
+    return malloc(size);
+}
+
+static void default_free(void *ptr, size_t size, void *opaque)
+{
+    (void)size;
+    (void)opaque;
+
+    free(ptr);
+}
+
+void jpegm_init_context_opts(struct jpegm_context_opts *opts)
+{
+    assert(opts != NULL);
+
+    opts->allocator = NULL;
+
+    opts->huge_pages = 0;
+}
+
+int jpegm_create_context(const struct jpegm_context_opts *opts, struct jpegm_context **context)
+{
+    int err;
+
+    assert(context != NULL);
+
+    struct jpegm_context_opts defaults;
+
+    if (opts == NULL)
+    {
+        jpegm_init_context_opts(&defaults);
+        opts = &defaults;
+    }
+
+    struct allocator allocator = { default_alloc, default_free, NULL };
+
+    if (opts->allocator != NULL)
+    {
+        allocator.alloc = opts->allocator->alloc;
+        allocator.free = opts->allocator->free;
+        allocator.opaque = opts->allocator->opaque;
+    }
+
+    struct jpegm_context *reused = allocator.alloc(sizeof(struct jpegm_context), allocator.opaque);
+
+    if (reused == NULL)
+    {
+        return JPEGM_ERROR_MEMORY;
+    }
+
+    reused->allocator = allocator;
+
+    err = init_context(&reused->context);
+
+    if (err)
+    {
+        allocator.free(reused, sizeof(struct jpegm_context), allocator.opaque);
+        return public_error(err);
+    }
+
+    /* nothing has been allocated from the arena yet */
+    arena_init(&reused->context.arena, opts->allocator != NULL ? &allocator : NULL, opts->huge_pages ? ARENA_HUGE_PAGES : 0);
+
+    cookie_io_functions_t functions = { input_read, NULL, input_seek, NULL };
+
+    reused->input.data = NULL;
+    reused->input.size = 0;
+    reused->input.pos = 0;
+
+    reused->stream = fopencookie(&reused->input, "r", functions);
+
+    if (reused->stream == NULL || setvbuf(reused->stream, reused->buffer, _IOFBF, sizeof(reused->buffer)) != 0)
+    {
+        jpegm_free_context(reused);
+        return JPEGM_ERROR_MEMORY;
+    }
+
+    *context = reused;
+
+    return JPEGM_SUCCESS;
+}
+
+void jpegm_free_context(struct jpegm_context *context)
+{
+    if (context == NULL)
+    {
+        return;
+    }
+
+    if (context->stream != NULL)
+    {
+        fclose(context->stream);
+    }
+
+    free_context(&context->context);
+
+    struct allocator allocator = context->allocator;
+
+    allocator.free(context, sizeof(struct jpegm_context), allocator.opaque);
+}
+
+/* the stream over the data, that of the context rewound if there is one */
+static FILE *open_input(struct jpegm_context *reused, const void *data, size_t size)
+{
+    if (reused == NULL)
+    {
+        /* read-only, the parser seeks within the stream */
+        return fmemopen((void *)data, size, "r");
+    }
+
+    reused->input.data = data;
+    reused->input.size = size;
+    reused->input.pos = 0;
+
+    /* drops what the buffer holds of the previous data */
+    clearerr(reused->stream);
+
+    if (fseek(reused->stream, 0, SEEK_SET) != 0)
+    {
+        return NULL;
+    }
+
+    return reused->stream;
+}
+
+static void close_input(struct jpegm_context *reused, FILE *stream)
+{
+    if (reused == NULL)
+    {
+        fclose(stream);
+    }
+}
+
+/* that of the caller reset for the next image, or a new one (*context is NULL if it cannot be allocated) */
+static int begin_context(struct jpegm_context *reused, struct context **context)
+{
+    if (reused != NULL)
+    {
+        *context = &reused->context;
+
+        return reset_context(*context);
+    }
+
+    *context = malloc(sizeof(struct context));
+
+    if (*context == NULL)
+    {
+        return RET_FAILURE_MEMORY_ALLOCATION;
+    }
+
+    return init_context(*context);
+}
+
+/* the context of the caller keeps its memory for the next image */
+static void end_context(struct jpegm_context *reused, struct context *context)
+{
+    if (reused == NULL && context != NULL)
+    {
+        free_context(context);
+
+        free(context);
+    }
+}
+
+void jpegm_init_decode_opts(struct jpegm_decode_opts *opts)
+{
+    assert(opts != NULL);
+
+    opts->pool = NULL;
+
+    opts->streaming = 0;
+
+    opts->crop_x = 0;
+    opts->crop_y = 0;
+    opts->crop_width = 0;
+    opts->crop_height = 0;
+
+    opts->context = NULL;
+}
+
+void jpegm_init_encode_opts(struct jpegm_encode_opts *opts)
+{
+    assert(opts != NULL);
+
+    opts->H = 2;
+    opts->V = 1;
+
+    opts->quality = 75;
+
+    opts->optimize = 1;
+
+    opts->restart_interval = 0;
+
+    opts->pool = NULL;
+
+    opts->context = NULL;
+}
+
+void jpegm_init_transform_opts(struct jpegm_transform_opts *opts)
+{
+    assert(opts != NULL);
+
+    opts->transform = JPEGM_TRANSFORM_NONE;
+
+    opts->crop_x = 0;
+    opts->crop_y = 0;
+    opts->crop_width = 0;
+    opts->crop_height = 0;
+
+    opts->optimize = 1;
+
+    opts->copy = 1;
+
+    opts->quality = 0;
+
+    opts->downscale = 0;
+
+    opts->pool = NULL;
+}
+
+void jpegm_init_image(struct jpegm_image *image)
+{
+    assert(image != NULL);
+
+    image->width = 0;
+    image->height = 0;
+    image->precision = 0;
+    image->format = JPEGM_FORMAT_AUTO;
+    image->stride = 0;
+    image->size = 0;
+    image->pixels = NULL;
+}
+
+int jpegm_probe(const void *data, size_t size, struct jpegm_info *info)
+{
+    int err;
+
+    assert(data != NULL);
+    assert(info != NULL);
+
+    if (size == 0)
+    {
+        return JPEGM_ERROR_DATA;
+    }
+
+    FILE *stream = fmemopen((void *)data, size, "r");
+
+    if (stream == NULL)
+    {
+        return JPEGM_ERROR_MEMORY;
+    }
+
+    struct context *context = malloc(sizeof(struct context));
+
+    if (context == NULL)
+    {
+        fclose(stream);
+        return JPEGM_ERROR_MEMORY;
+    }
+
+    err = init_context(context);
+
+    if (err)
+    {
+        goto end;
+    }
+
+    uint16_t sof;
+
+    err = probe_format(stream, context, &sof);
+
+    if (err)
+    {
+        goto end;
+    }
+
+    info->width = context->X;
+    info->height = context->Y;
+    info->components = context->Nf;
+    info->precision = context->P;
+    info->process = sof & 0xf;
+
+    for (int i = 0; i < MAX_COMPONENTS; ++i)
+    {
+        info->H[i] = i < context->Nf ? context->component[i].H : 0;
+        info->V[i] = i < context->Nf ? context->component[i].V : 0;
+    }
+end:
+    free_context(context);
+
+    free(context);
+
+    fclose(stream);
+
+    return public_error(err);
+}
+
+int jpegm_validate(const void *data, size_t size, struct jpegm_report *report)
+{
+    int err;
+
+    assert(data != NULL);
+    assert(report != NULL);
+
+    struct output output;
+
+    init_output(&output, NULL);
+
+    output.report = report;
+
+    /* as if nothing was read */
+    memset(report, 0, sizeof(struct jpegm_report));
+
+    report->error = JPEGM_ERROR_DATA;
+
+    if (size == 0)
+    {
+        return JPEGM_ERROR_DATA;
+    }
+
+    FILE *stream = fmemopen((void *)data, size, "r");
+
+    if (stream == NULL)
+    {
+        report->error = JPEGM_ERROR_MEMORY;
+        return JPEGM_ERROR_MEMORY;
+    }
+
+    struct context *context = malloc(sizeof(struct context));
+
+    if (context == NULL)
+    {
+        fclose(stream);
+        report->error = JPEGM_ERROR_MEMORY;
+        return JPEGM_ERROR_MEMORY;
+    }
+
+    err = init_context(context);
+
+    if (!err)
+    {
+        err = decode_stream(stream, context, &output);
+
+        report->error = public_error(report->error);
+    }
+
+    free_context(context);
+
+    free(context);
+
+    fclose(stream);
+
+    return public_error(err);
+}
+
+int jpegm_decode(const void *data, size_t size, struct jpegm_image *image, const struct jpegm_decode_opts *opts)
+{
+    int err;
+
+    assert(data != NULL);
+    assert(image != NULL);
+
+    if (size == 0)
+    {
+        return JPEGM_ERROR_DATA;
+    }
+
+    struct jpegm_context *reused = opts != NULL ? opts->context : NULL;
+
+    FILE *stream = open_input(reused, data, size);
+
+    if (stream == NULL)
+    {
+        return JPEGM_ERROR_MEMORY;
+    }
+
+    struct context *context;
+
+    err = begin_context(reused, &context);
+
+    if (err)
+    {
+        goto end;
+    }
+
+    struct pixels pixels = { image->format, image->pixels, image->stride, image->size, 0 };
+    struct output output;
+
+    init_output(&output, NULL);
+
+    output.pixels = &pixels;
+    output.pool = opts != NULL ? opts->pool : NULL;
+    output.streaming = opts != NULL ? opts->streaming : 0;
+
+    if (opts != NULL)
+    {
+        output.crop_x = opts->crop_x;
+        output.crop_y = opts->crop_y;
+        output.crop_w = opts->crop_width;
+        output.crop_h = opts->crop_height;
+    }
+
+    err = decode_stream(stream, context, &output);
+
+    if (err)
+    {
+        if (pixels.owned)
+        {
+            free(pixels.data);
+        }
+
+        goto end;
+    }
+
+    size_t x0, y0, x1, y1;
+
+    crop_region(context, &x0, &y0, &x1, &y1);
+
+    image->width = (uint16_t)(x1 - x0);
+    image->height = (uint16_t)(y1 - y0);
+    image->precision = context->P;
+    image->format = pixels.format;
+    image->stride = pixels.stride;
+    image->size = pixels.size;
+    image->pixels = pixels.data;
+end:
+    end_context(reused, context);
+
+    close_input(reused, stream);
+
+    return public_error(err);
+}
+
+void jpegm_free_image(struct jpegm_image *image)
+{
+    assert(image != NULL);
+
+    free(image->pixels);
+
+    image->pixels = NULL;
+}
+
+static int encode_image(struct context *context, const struct jpegm_image *image, struct params *params, struct sink *sink)
+{
+    int err;
+
+    struct frame frame;
+
+    frame.components = image->format == JPEGM_FORMAT_GREY ? 1 : 3;
+    frame.Y = image->height;
+    frame.X = image->width;
+    frame.precision = image->precision;
+
+    err = setup_image(context, params, &frame);
+    RETURN_IF(err);
+
+    size_t stride = image->stride;
+
+    if (stride == 0)
+    {
+        stride = (size_t)frame.X * frame.components * (frame.precision > 8 ? sizeof(uint16_t) : sizeof(uint8_t));
+    }
+
+    err = read_frame_pixels(&frame, image->pixels, stride);
+
+    if (err)
+    {
+        frame_destroy(&frame);
+        return err;
+    }
+
+    err = prologue_frame(context, &frame);
+    RETURN_IF(err);
+
+    return produce_codestream(context, sink, params);
+}
+
+int jpegm_encode(const struct jpegm_image *image, const struct jpegm_encode_opts *opts, struct jpegm_buffer *buffer)
+{
+    int err;
+
+    assert(image != NULL);
+    assert(buffer != NULL);
+
+    struct jpegm_encode_opts defaults;
+
+    if (opts == NULL)
+    {
+        jpegm_init_encode_opts(&defaults);
+        opts = &defaults;
+    }
+
+    if (image->format != JPEGM_FORMAT_RGB && image->format != JPEGM_FORMAT_GREY)
+    {
+        return JPEGM_ERROR_UNSUPPORTED;
+    }
+
+    if ((image->precision != 8 && image->precision != 12) || image->width == 0 || image->height == 0)
+    {
+        return JPEGM_ERROR_UNSUPPORTED;
+    }
+
+    if (opts->H < 1 || opts->H > 2 || opts->V < 1 || opts->V > 2)
+    {
+        return JPEGM_ERROR_UNSUPPORTED;
+    }
+
+    struct params params;
+
+    init_params(&params);
+
+    params.H = opts->H;
+    params.V = opts->V;
+    params.q = opts->quality;
+    params.optimize = opts->optimize;
+    params.Ri = opts->restart_interval;
+
+    struct sink sink;
+
+    if (buffer->data == NULL)
+    {
+        init_sink_memory(&sink);
+    }
+    else
+    {
+        init_sink_buffer(&sink, buffer->data, buffer->capacity);
+    }
+
+    struct context *context;
+
+    err = begin_context(opts->context, &context);
+
+    if (err)
+    {
+        goto end;
+    }
+
+    context->pool = opts->pool;
+
+    err = encode_image(context, image, &params, &sink);
+
+    if (err)
+    {
+        goto end;
+    }
+
+    /* hand over the bytes */
+    buffer->data = sink.data;
+    buffer->size = sink.size;
+    buffer->capacity = sink.capacity;
+
+    sink.data = NULL;
+end:
+    free_sink(&sink);
+
+    end_context(opts->context, context);
+
+    return public_error(err);
+}
+
+int jpegm_transform(const void *data, size_t size, const struct jpegm_transform_opts *opts, struct jpegm_buffer *buffer)
+{
+    int err;
+
+    assert(data != NULL);
+    assert(buffer != NULL);
+
+    struct jpegm_transform_opts defaults;
+
+    if (opts == NULL)
+    {
+        jpegm_init_transform_opts(&defaults);
+        opts = &defaults;
+    }
+
+    if (size == 0)
+    {
+        return JPEGM_ERROR_DATA;
+    }
+
+    struct transcode_params params;
+
+    init_transcode_params(&params);
+
+    params.transform = opts->transform;
+    params.crop_x = opts->crop_x;
+    params.crop_y = opts->crop_y;
+    params.crop_w = opts->crop_width;
+    params.crop_h = opts->crop_height;
+    params.optimize = opts->optimize;
+    params.copy = opts->copy;
+    params.quality = opts->quality;
+    params.downscale = opts->downscale;
+
+    FILE *stream = fmemopen((void *)data, size, "r");
+
+    if (stream == NULL)
+    {
+        return JPEGM_ERROR_MEMORY;
+    }
+
+    struct sink sink;
+
+    if (buffer->data == NULL)
+    {
+        init_sink_memory(&sink);
+    }
+    else
+    {
+        init_sink_buffer(&sink, buffer->data, buffer->capacity);
+    }
+
+    struct context *context = malloc(sizeof(struct context));
+
+    if (context == NULL)
+    {
+        fclose(stream);
+        return JPEGM_ERROR_MEMORY;
+    }
+
+    err = init_context(context);
+
+    if (err)
+    {
+        goto end;
+    }
+
+    context->pool = opts->pool;
+
+    err = transcode_stream(stream, context, &sink, &params);
+
+    if (err)
+    {
+        goto end;
+    }
+
+    /* hand over the bytes */
+    buffer->data = sink.data;
+    buffer->size = sink.size;
+    buffer->capacity = sink.capacity;
+
+    sink.data = NULL;
+end:
+    free_sink(&sink);
+
+    free_context(context);
+
+    free(context);
+
+    fclose(stream);
+
+    return public_error(err);
+}
@@ -0,0 +1,277 @@
+#ifndef JPEGM_H
+#define JPEGM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * in-memory encoding, decoding and transcoding
+ *
+ * The functions keep no state between calls (besides the mutex-guarded cache of Huffman tables and
+ * the contexts passed by the caller) and print nothing, so that they can be called from several threads at once.
+ * They return JPEGM_SUCCESS or one of the JPEGM_ERROR_* codes below.
+ *
+ * The pool of the options (pool_create() of pool.h) may be passed to several calls at once:
+ * their parallel parts take turns on its threads.
+ */
+
+struct pool;
+
+/* the results of the functions */
+enum
+{
+    JPEGM_SUCCESS,
+    /* the data ends early or is not a JPEG file */
+    JPEGM_ERROR_DATA,
+    /* a feature of the file (e.g., progressive coding), or an image or an option that is not supported */
+    JPEGM_ERROR_UNSUPPORTED,
+    JPEGM_ERROR_MEMORY,
+    /* the output does not fit into the buffer of the caller */
+    JPEGM_ERROR_OVERFLOW,
+    /* a bug in the library */
+    JPEGM_ERROR_INTERNAL
+};
+
+/* a static description of the result */
+const char *jpegm_strerror(int err);
+
+/* where a context gets its memory from */
+struct jpegm_allocator
+{
+    /* size bytes aligned to 64 bytes, or NULL */
+    void *(*alloc)(size_t size, void *opaque);
+    void (*free)(void *ptr, size_t size, void *opaque);
+    void *opaque;
+};
+
+struct jpegm_context_opts
+{
+    /* NULL = malloc() */
+    const struct jpegm_allocator *allocator;
+
+    /* the buffers of the images in huge pages (explicit ones if the system reserves them, transparent otherwise),
+     * with an allocator the sizes are multiples of 2 MiB only */
+    int huge_pages;
+};
+
+void jpegm_init_context_opts(struct jpegm_context_opts *opts);
+
+/*
+ * the state of jpegm_decode() and jpegm_encode() reused from one image to the next (the opts->context)
+ *
+ * The memory of an image is reset, not released, before the next one: once the largest image has been coded,
+ * the calls allocate nothing (given the buffers for the pixels and for the codestream, and once the process-wide
+ * cache holds the Huffman tables). A context serves one call at a time.
+ */
+struct jpegm_context;
+
+int jpegm_create_context(const struct jpegm_context_opts *opts, struct jpegm_context **context);
+
+/* releases its memory */
+void jpegm_free_context(struct jpegm_context *context);
+
+/* layout of the pixels */
+enum
+{
+    /* decoding: JPEGM_FORMAT_GREY or JPEGM_FORMAT_RGB, as coded */
+    JPEGM_FORMAT_AUTO,
+    JPEGM_FORMAT_RGB,
+    JPEGM_FORMAT_BGR,
+    /* the alpha (or unused) channel is set to the maximum value */
+    JPEGM_FORMAT_RGBA,
+    JPEGM_FORMAT_RGBX,
+    JPEGM_FORMAT_GREY,
+    /* three planes of Y, Cb and Cr at the full resolution, each height rows, one after another */
+    JPEGM_FORMAT_YCBCR_PLANAR
+};
+
+/* samples are uint8_t up to 8 bits of precision, uint16_t (host byte order) otherwise */
+struct jpegm_image
+{
+    uint16_t width, height;
+
+    /* bits per sample */
+    uint8_t precision;
+
+    int format;
+
+    /* bytes between the rows, 0 = no padding */
+    size_t stride;
+
+    /* the bytes of pixels[] */
+    size_t size;
+
+    void *pixels;
+};
+
+/* no pixels, JPEGM_FORMAT_AUTO */
+void jpegm_init_image(struct jpegm_image *image);
+
+/* the frame header */
+struct jpegm_info
+{
+    uint16_t width, height;
+
+    uint8_t components;
+
+    /* bits per sample */
+    uint8_t precision;
+
+    /* n of the SOFn marker: 0 = baseline, 1 = extended sequential, 2 = progressive, ... */
+    uint8_t process;
+
+    /* sampling factors of the components, in the frame order */
+    uint8_t H[4], V[4];
+};
+
+/* parse the markers up to the frame header only, the rest of the image need not be present */
+int jpegm_probe(const void *data, size_t size, struct jpegm_info *info);
+
+/* what jpegm_validate() has found */
+struct jpegm_report
+{
+    /* no problem found */
+    int valid;
+
+    /* the error that stopped the parsing (JPEGM_ERROR_DATA for a truncated file), JPEGM_SUCCESS if EOI was reached */
+    int error;
+
+    /* EOI found */
+    int eoi;
+
+    size_t scans;
+
+    /* scans with fewer or more blocks than the frame needs */
+    size_t short_scans, long_scans;
+
+    /* over all scans */
+    size_t blocks, blocks_expected;
+
+    /* quantized coefficients out of the range of the sample precision */
+    size_t bad_coefficients;
+
+    /* RSTm markers, those out of sequence or closing an interval of other than Ri MCUs */
+    size_t restarts, bad_restarts;
+};
+
+/* parse the markers and entropy decode all scans without reconstructing the image, the report is filled in also on error */
+int jpegm_validate(const void *data, size_t size, struct jpegm_report *report);
+
+struct jpegm_decode_opts
+{
+    /* threads of the caller for the reconstruction, NULL = the calling thread only */
+    struct pool *pool;
+
+    /* convert the MCU rows as soon as they are decoded (a single interleaved scan, fixed memory budget) */
+    int streaming;
+
+    /* decode only this rectangle (crop_width == 0 = the whole image), the image is the crop, streaming is not used */
+    uint16_t crop_x, crop_y, crop_width, crop_height;
+
+    /* reused (jpegm_create_context()), NULL = a new one for this call */
+    struct jpegm_context *context;
+};
+
+void jpegm_init_decode_opts(struct jpegm_decode_opts *opts);
+
+/*
+ * image->format, image->stride, image->size and image->pixels are set by the caller
+ * image->pixels == NULL: the pixels are allocated, release them by jpegm_free_image()
+ * otherwise: the pixels are written into image->size bytes (JPEGM_ERROR_OVERFLOW if they do not fit)
+ * the dimensions, the format (instead of JPEGM_FORMAT_AUTO) and the stride are filled in
+ * frames of other than 1 (grey), 3 (YCbCr) or 4 (YCCK) components are JPEGM_ERROR_UNSUPPORTED
+ */
+int jpegm_decode(const void *data, size_t size, struct jpegm_image *image, const struct jpegm_decode_opts *opts);
+
+/* the pixels allocated by jpegm_decode() */
+void jpegm_free_image(struct jpegm_image *image);
+
+struct jpegm_encode_opts
+{
+    /* luma subsampling (1 or 2) */
+    uint8_t H, V;
+
+    /* quality 1..100 */
+    int quality;
+
+    /* optimized Huffman tables (2 = by the Annex K.2 procedure, as a reference) */
+    int optimize;
+
+    /* restart interval in MCUs, 0 = no restart markers */
+    uint16_t restart_interval;
+
+    /* threads of the caller, NULL = the calling thread only */
+    struct pool *pool;
+
+    /* reused (jpegm_create_context()), NULL = a new one for this call */
+    struct jpegm_context *context;
+};
+
+void jpegm_init_encode_opts(struct jpegm_encode_opts *opts);
+
+/* the output of jpegm_encode() */
+struct jpegm_buffer
+{
+    void *data;
+    size_t size, capacity;
+};
+
+/*
+ * the image is JPEGM_FORMAT_RGB or JPEGM_FORMAT_GREY of 8-bit or 12-bit samples (JPEGM_ERROR_UNSUPPORTED otherwise)
+ * buffer->data == NULL: the codestream is allocated, release it by free(buffer->data)
+ * otherwise: it is written into buffer->capacity bytes of buffer->data (JPEGM_ERROR_OVERFLOW if it does not fit)
+ * buffer->size is the length of the codestream
+ */
+int jpegm_encode(const struct jpegm_image *image, const struct jpegm_encode_opts *opts, struct jpegm_buffer *buffer);
+
+/* lossless transformations of jpegm_transform() */
+enum
+{
+    JPEGM_TRANSFORM_NONE,
+    /* mirror left to right, top to bottom */
+    JPEGM_TRANSFORM_FLIP_H,
+    JPEGM_TRANSFORM_FLIP_V,
+    /* across the main diagonal, across the other one */
+    JPEGM_TRANSFORM_TRANSPOSE,
+    JPEGM_TRANSFORM_TRANSVERSE,
+    /* clockwise */
+    JPEGM_TRANSFORM_ROT_90,
+    JPEGM_TRANSFORM_ROT_180,
+    JPEGM_TRANSFORM_ROT_270
+};
+
+struct jpegm_transform_opts
+{
+    /* JPEGM_TRANSFORM_* */
+    int transform;
+
+    /* keep only this rectangle of the transformed image (crop_width == 0 = all of it), its upper-left corner is moved to the MCU grid */
+    uint16_t crop_x, crop_y, crop_width, crop_height;
+
+    /* optimized Huffman tables, otherwise those of the input (unless they lack a code the result needs) */
+    int optimize;
+
+    /* copy the APPn and COM segments (Exif, ICC profile, comments...) of the input */
+    int copy;
+
+    /* requantize the coefficients to the tables of this quality 1..100 (never finer than those of the input), 0 = keep them */
+    int quality;
+
+    /* a 1/8-size preview from the DC coefficients alone, coded anew at the quality (75 if 0) */
+    int downscale;
+
+    /* threads of the caller for the entropy coding, NULL = the calling thread only */
+    struct pool *pool;
+};
+
+void jpegm_init_transform_opts(struct jpegm_transform_opts *opts);
+
+/*
+ * rotate, mirror or crop a sequential 8-bit JPEG in the DCT domain, no pixel is decoded and nothing is lost
+ * the partial MCUs at an edge that would move to the opposite side are dropped
+ * only the entropy-coded data up to the crop is decoded (and the restart intervals outside it are skipped)
+ * buffer as for jpegm_encode()
+ */
+int jpegm_transform(const void *data, size_t size, const struct jpegm_transform_opts *opts, struct jpegm_buffer *buffer);
+
+#endif
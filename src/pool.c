@@ -0,0 +1,237 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "pool.h"
+#include "common.h"
+
+struct pool
+{
+    /* worker threads, excluding the calling thread */
+    pthread_t *workers;
+    int n;
+
+    /* held by pool_for() for a whole job, the callers sharing the pool take turns */
+    pthread_mutex_t busy;
+
+    pthread_mutex_t mutex;
+
+    /* a new job has been posted (or the pool is being destroyed) */
+    pthread_cond_t posted;
+
+    /* all items of the job have been processed */
+    pthread_cond_t finished;
+
+    /* the current job */
+    pool_task task;
+    void *arg;
+    size_t count;
+
+    /* the next item to be handed out, items done */
+    size_t next;
+    size_t done;
+
+    /* the first failing item and its error */
+    size_t err_item;
+    int err;
+
+    /* seq. number of the current job */
+    unsigned long job;
+
+    int quit;
+};
+
+/* process items of the current job until none is left, the mutex is held */
+static void run_items(struct pool *pool)
+{
+    while (pool->next < pool->count)
+    {
+        size_t i = pool->next++;
+
+        pthread_mutex_unlock(&pool->mutex);
+
+        int err = pool->task(pool->arg, i);
+
+        pthread_mutex_lock(&pool->mutex);
+
+        if (err && (pool->err == RET_SUCCESS || i < pool->err_item))
+        {
+            pool->err = err;
+            pool->err_item = i;
+        }
+
+        if (++pool->done == pool->count)
+        {
+            pthread_cond_signal(&pool->finished);
+        }
+    }
+}
+
+static void *worker(void *arg)
+{
+    struct pool *pool = arg;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    unsigned long job = pool->job;
+
+    while (1)
+    {
+        while (!pool->quit && pool->job == job)
+        {
+            pthread_cond_wait(&pool->posted, &pool->mutex);
+        }
+
+        if (pool->quit)
+        {
+            break;
+        }
+
+        job = pool->job;
+
+        run_items(pool);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+int pool_create(struct pool **pool, int threads)
+{
+    assert(pool != NULL);
+
+    if (threads <= 0)
+    {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+
+        threads = online > 0 ? (int)online : 1;
+    }
+
+    struct pool *p = malloc(sizeof(struct pool));
+
+    if (p == NULL)
+    {
+        return RET_FAILURE_MEMORY_ALLOCATION;
+    }
+
+    p->workers = malloc(sizeof(pthread_t) * (size_t)threads);
+
+    if (p->workers == NULL)
+    {
+        free(p);
+        return RET_FAILURE_MEMORY_ALLOCATION;
+    }
+
+    p->n = 0;
+
+    pthread_mutex_init(&p->busy, NULL);
+    pthread_mutex_init(&p->mutex, NULL);
+    pthread_cond_init(&p->posted, NULL);
+    pthread_cond_init(&p->finished, NULL);
+
+    p->task = NULL;
+    p->arg = NULL;
+    p->count = 0;
+    p->next = 0;
+    p->done = 0;
+    p->err_item = 0;
+    p->err = RET_SUCCESS;
+    p->job = 0;
+    p->quit = 0;
+
+    for (int t = 0; t < threads - 1; ++t)
+    {
+        if (pthread_create(&p->workers[t], NULL, worker, p) != 0)
+        {
+            pool_destroy(p);
+            return RET_FAILURE_LOGIC_ERROR;
+        }
+
+        p->n++;
+    }
+
+    *pool = p;
+
+    return RET_SUCCESS;
+}
+
+void pool_destroy(struct pool *pool)
+{
+    if (pool == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->posted);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int t = 0; t < pool->n; ++t)
+    {
+        pthread_join(pool->workers[t], NULL);
+    }
+
+    pthread_cond_destroy(&pool->finished);
+    pthread_cond_destroy(&pool->posted);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_mutex_destroy(&pool->busy);
+
+    free(pool->workers);
+    free(pool);
+}
+
+int pool_threads(const struct pool *pool)
+{
+    return pool != NULL ? pool->n + 1 : 1;
+}
+
+int pool_for(struct pool *pool, size_t n, pool_task task, void *arg)
+{
+    assert(task != NULL);
+
+    if (pool == NULL || pool->n == 0 || n < 2)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            int err = task(arg, i);
+            RETURN_IF(err);
+        }
+
+        return RET_SUCCESS;
+    }
+
+    /* a single job at a time */
+    pthread_mutex_lock(&pool->busy);
+
+    pthread_mutex_lock(&pool->mutex);
+
+    pool->task = task;
+    pool->arg = arg;
+    pool->count = n;
+    pool->next = 0;
+    pool->done = 0;
+    pool->err_item = 0;
+    pool->err = RET_SUCCESS;
+    pool->job++;
+
+    pthread_cond_broadcast(&pool->posted);
+
+    /* the calling thread takes part */
+    run_items(pool);
+
+    while (pool->done < pool->count)
+    {
+        pthread_cond_wait(&pool->finished, &pool->mutex);
+    }
+
+    int err = pool->err;
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    pthread_mutex_unlock(&pool->busy);
+
+    return err;
+}
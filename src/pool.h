@@ -0,0 +1,28 @@
+#ifndef JPEG_POOL_H
+#define JPEG_POOL_H
+
+#include <stddef.h>
+
+/* a task processes the item i of the job, returns RET_SUCCESS or an error code */
+typedef int (*pool_task)(void *arg, size_t i);
+
+struct pool;
+
+/* threads = 0 for all online processors, the calling thread counts as one of them */
+int pool_create(struct pool **pool, int threads);
+
+void pool_destroy(struct pool *pool);
+
+/* the number of threads processing a job */
+int pool_threads(const struct pool *pool);
+
+/*
+ * calls task(arg, i) for i = 0 .. n-1 on the threads of the pool, returns once all items are done
+ *
+ * the items are handed out in order; the first error (in item order) is returned
+ * pool may be NULL (the items are processed by the calling thread)
+ * several threads may share a pool, their jobs run one after another; a task must not call pool_for() on its own pool
+ */
+int pool_for(struct pool *pool, size_t n, pool_task task, void *arg);
+
+#endif
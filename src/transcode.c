@@ -0,0 +1,868 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <assert.h>
+#include "common.h"
+#include "coeffs.h"
+#include "imgproc.h"
+#include "decode.h"
+#include "encode.h"
+#include "transcode.h"
+
+void init_transcode_params(struct transcode_params *params)
+{
+    assert(params != NULL);
+
+    params->transform = JPEGM_TRANSFORM_NONE;
+
+    params->crop_x = 0;
+    params->crop_y = 0;
+    params->crop_w = 0;
+    params->crop_h = 0;
+
+    params->optimize = 1;
+
+    params->copy = 1;
+
+    params->quality = 0;
+
+    params->downscale = 0;
+}
+
+int read_segments(FILE *stream, struct sink *segments)
+{
+    int err;
+
+    assert(segments != NULL);
+
+    do
+    {
+        uint16_t marker;
+        uint16_t len;
+
+        err = read_marker(stream, &marker);
+        RETURN_IF(err);
+
+        switch (marker)
+        {
+        /* SOS, EOI: no more headers */
+        case 0xffda:
+        case 0xffd9:
+            return RET_SUCCESS;
+        /* SOI*, RSTm*, TEM* */
+        case 0xffd8:
+        case 0xffd0:
+        case 0xffd1:
+        case 0xffd2:
+        case 0xffd3:
+        case 0xffd4:
+        case 0xffd5:
+        case 0xffd6:
+        case 0xffd7:
+        case 0xff01:
+            break;
+        /* APPn, COM */
+        case 0xffe0:
+        case 0xffe1:
+        case 0xffe2:
+        case 0xffe3:
+        case 0xffe4:
+        case 0xffe5:
+        case 0xffe6:
+        case 0xffe7:
+        case 0xffe8:
+        case 0xffe9:
+        case 0xffea:
+        case 0xffeb:
+        case 0xffec:
+        case 0xffed:
+        case 0xffee:
+        case 0xffef:
+        case 0xfffe:
+            err = read_length(stream, &len);
+            RETURN_IF(err);
+
+            if (len < 2)
+            {
+                return RET_FAILURE_FILE_UNSUPPORTED;
+            }
+
+            err = write_marker(segments, marker);
+            RETURN_IF(err);
+
+            err = write_length(segments, len);
+            RETURN_IF(err);
+
+            for (size_t size = len - 2; size > 0; )
+            {
+                uint8_t chunk[4096];
+
+                size_t n = size < sizeof chunk ? size : sizeof chunk;
+
+                if (fread(chunk, 1, n, stream) != n)
+                {
+                    return RET_FAILURE_FILE_IO;
+                }
+
+                err = sink_write(segments, chunk, n);
+                RETURN_IF(err);
+
+                size -= n;
+            }
+            break;
+        /* the tables and the frame header are written anew */
+        default:
+            err = read_length(stream, &len);
+            RETURN_IF(err);
+
+            err = skip_segment(stream, len);
+            RETURN_IF(err);
+        }
+    }
+    while (1);
+}
+
+/* the entropy layer only, the epilogue produces no image */
+int read_coefficients(FILE *stream, struct context *context)
+{
+    int err;
+
+    assert(context != NULL);
+
+    struct output output;
+
+    init_output(&output, NULL);
+
+    /* kept by decode_stream() */
+    output.pool = context->pool;
+
+    output.crop_x = context->crop_x;
+    output.crop_y = context->crop_y;
+    output.crop_w = context->crop_w;
+    output.crop_h = context->crop_h;
+
+    context->coefficients = 1;
+
+    err = decode_stream(stream, context, &output);
+    RETURN_IF(err);
+
+    if (context->Nf == 0)
+    {
+        /* no frame */
+        return RET_FAILURE_FILE_UNSUPPORTED;
+    }
+
+    for (int i = 0; i < context->Nf; ++i)
+    {
+        if (context->component[i].int_buffer == NULL)
+        {
+            return RET_FAILURE_FILE_UNSUPPORTED;
+        }
+    }
+
+    if (context->P != 8)
+    {
+        TRACE_ERROR(context, "Only 8-bit samples can be transcoded!\n");
+        return RET_FAILURE_FILE_UNSUPPORTED;
+    }
+
+    return RET_SUCCESS;
+}
+
+/* the transformation as a transposition followed by mirroring */
+struct mapping
+{
+    int transpose;
+    int flip_x, flip_y;
+};
+
+static const struct mapping mappings[] =
+{
+    [JPEGM_TRANSFORM_NONE]       = { 0, 0, 0 },
+    [JPEGM_TRANSFORM_FLIP_H]     = { 0, 1, 0 },
+    [JPEGM_TRANSFORM_FLIP_V]     = { 0, 0, 1 },
+    [JPEGM_TRANSFORM_TRANSPOSE]  = { 1, 0, 0 },
+    [JPEGM_TRANSFORM_TRANSVERSE] = { 1, 1, 1 },
+    [JPEGM_TRANSFORM_ROT_90]     = { 1, 1, 0 },
+    [JPEGM_TRANSFORM_ROT_180]    = { 0, 1, 1 },
+    [JPEGM_TRANSFORM_ROT_270]    = { 1, 0, 1 }
+};
+
+/* the transformed frame: its size (the partial MCUs at a mirrored edge dropped) and the size of its MCU */
+static void transformed_frame(const struct context *src, const struct mapping *mapping, size_t *X, size_t *Y, size_t *mcu_x, size_t *mcu_y)
+{
+    /* A.2.2 a single component is coded in blocks, whatever its sampling factors */
+    uint8_t max_H = src->Nf > 1 ? src->max_H : 1;
+    uint8_t max_V = src->Nf > 1 ? src->max_V : 1;
+
+    *mcu_x = 8 * (mapping->transpose ? max_V : max_H);
+    *mcu_y = 8 * (mapping->transpose ? max_H : max_V);
+
+    *X = mapping->transpose ? src->Y : src->X;
+    *Y = mapping->transpose ? src->X : src->Y;
+
+    /* the partial MCUs at a mirrored edge cannot move to the other side */
+    if (mapping->flip_x)
+    {
+        *X -= *X % *mcu_x;
+    }
+
+    if (mapping->flip_y)
+    {
+        *Y -= *Y % *mcu_y;
+    }
+}
+
+/* the crop of the transformed frame (the whole frame without one), its upper-left corner moved to the MCU grid */
+static void crop_rect(const struct transcode_params *params, size_t X, size_t Y, size_t mcu_x, size_t mcu_y, size_t *x0, size_t *y0, size_t *x1, size_t *y1)
+{
+    *x0 = 0;
+    *y0 = 0;
+    *x1 = X;
+    *y1 = Y;
+
+    if (params->crop_w == 0)
+    {
+        return;
+    }
+
+    *x0 = params->crop_x < X ? params->crop_x - params->crop_x % mcu_x : X;
+    *y0 = params->crop_y < Y ? params->crop_y - params->crop_y % mcu_y : Y;
+    *x1 = (size_t)params->crop_x + params->crop_w < X ? (size_t)params->crop_x + params->crop_w : X;
+    *y1 = (size_t)params->crop_y + params->crop_h < Y ? (size_t)params->crop_y + params->crop_h : Y;
+}
+
+/*
+ * the crop of the transformed frame back in the input frame, so that the decoder keeps only the blocks under it
+ * (and skips the restart intervals outside it, and the rest of the scan past it)
+ */
+static int source_crop(FILE *stream, struct context *context, const struct transcode_params *params)
+{
+    int err;
+
+    const struct mapping *mapping = &mappings[params->transform];
+
+    long start = ftell(stream);
+
+    /* the frame header first */
+    uint16_t sof;
+
+    err = probe_format(stream, context, &sof);
+    RETURN_IF(err);
+
+    size_t X, Y, mcu_x, mcu_y;
+
+    transformed_frame(context, mapping, &X, &Y, &mcu_x, &mcu_y);
+
+    size_t x0, y0, x1, y1;
+
+    crop_rect(params, X, Y, mcu_x, mcu_y, &x0, &y0, &x1, &y1);
+
+    if (x0 >= x1 || y0 >= y1)
+    {
+        TRACE_ERROR(context, "The crop is outside the image!\n");
+        return RET_FAILURE_FILE_UNSUPPORTED;
+    }
+
+    /* back through the mirroring */
+    if (mapping->flip_x)
+    {
+        size_t x = x0;
+
+        x0 = X - x1;
+        x1 = X - x;
+    }
+
+    if (mapping->flip_y)
+    {
+        size_t y = y0;
+
+        y0 = Y - y1;
+        y1 = Y - y;
+    }
+
+    /* and the transposition */
+    if (mapping->transpose)
+    {
+        size_t t;
+
+        t = x0;
+        x0 = y0;
+        y0 = t;
+
+        t = x1;
+        x1 = y1;
+        y1 = t;
+    }
+
+    err = reset_context(context);
+    RETURN_IF(err);
+
+    if (fseek(stream, start, SEEK_SET) != 0)
+    {
+        return RET_FAILURE_FILE_SEEK;
+    }
+
+    context->crop_x = (uint16_t)x0;
+    context->crop_y = (uint16_t)y0;
+    context->crop_w = (uint16_t)(x1 - x0);
+    context->crop_h = (uint16_t)(y1 - y0);
+
+    return RET_SUCCESS;
+}
+
+/* the DC differences of the encoder have at most 11 bits, the AC coefficients 10 bits (8-bit samples) */
+static int block_in_range(const struct int_block *int_block)
+{
+    if (int_block->c[0] < -1024 || int_block->c[0] > 1023)
+    {
+        return 0;
+    }
+
+    for (int i = 1; i < 64; ++i)
+    {
+        if (int_block->c[i] < -1023 || int_block->c[i] > 1023)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * A mirrored basis function of the DCT is the same function with the sign of its odd frequencies flipped,
+ * a transposed block is the block of transposed coefficients.
+ * The coefficient k of the output block is sign[k] * c[perm[k]] of the input block.
+ * The blocks of dst start at (origin_x, origin_y) of the transformed component, b_x by b_y blocks.
+ */
+static void transform_component(struct context *context, const struct mapping *mapping, const struct component *src, struct component *dst,
+                                const int perm[64], const int sign[64], size_t origin_x, size_t origin_y, size_t b_x, size_t b_y)
+{
+    for (size_t block_y = 0; block_y < dst->b_y; ++block_y)
+    {
+        for (size_t block_x = 0; block_x < dst->b_x; ++block_x)
+        {
+            size_t x = origin_x + block_x;
+            size_t y = origin_y + block_y;
+
+            /* mirrored within the (MCU-aligned) transformed component */
+            if (mapping->flip_x)
+            {
+                x = b_x - 1 - x;
+            }
+
+            if (mapping->flip_y)
+            {
+                y = b_y - 1 - y;
+            }
+
+            size_t src_x = mapping->transpose ? y : x;
+            size_t src_y = mapping->transpose ? x : y;
+
+            assert(src_x < src->b_x);
+            assert(src_y < src->b_y);
+
+            /* the input buffers may hold only the window of the crop */
+            const struct int_block *in = &src->int_buffer[block_seq(context, src, src_x, src_y)];
+            struct int_block *out = &dst->int_buffer[block_y * dst->b_x + block_x];
+
+            for (int k = 0; k < 64; ++k)
+            {
+                out->c[k] = sign[k] * in->c[perm[k]];
+            }
+        }
+    }
+}
+
+int transform_coefficients(struct context *src, struct context *dst, const struct transcode_params *params)
+{
+    int err;
+
+    assert(src != NULL);
+    assert(dst != NULL);
+    assert(params != NULL);
+
+    if (params->transform < JPEGM_TRANSFORM_NONE || params->transform > JPEGM_TRANSFORM_ROT_270)
+    {
+        return RET_FAILURE_LOGIC_ERROR;
+    }
+
+    const struct mapping *mapping = &mappings[params->transform];
+
+    size_t X, Y, mcu_x, mcu_y;
+
+    transformed_frame(src, mapping, &X, &Y, &mcu_x, &mcu_y);
+
+    size_t x0, y0, x1, y1;
+
+    crop_rect(params, X, Y, mcu_x, mcu_y, &x0, &y0, &x1, &y1);
+
+    if (x0 >= x1 || y0 >= y1)
+    {
+        TRACE_ERROR(dst, "The image is smaller than a macroblock!\n");
+        return RET_FAILURE_FILE_UNSUPPORTED;
+    }
+
+    dst->P = src->P;
+    dst->X = (uint16_t)(x1 - x0);
+    dst->Y = (uint16_t)(y1 - y0);
+    dst->Ri = src->Ri;
+
+    TRACE(dst, "Transformed frame: X = %" PRIu16 ", Y = %" PRIu16 "\n", dst->X, dst->Y);
+
+    uint8_t max_H = 0, max_V = 0;
+
+    for (int i = 0; i < src->Nf; ++i)
+    {
+        struct component *component;
+
+        err = add_component(dst, src->component[i].C, &component);
+        RETURN_IF(err);
+
+        uint8_t H = src->Nf > 1 ? src->component[i].H : 1;
+        uint8_t V = src->Nf > 1 ? src->component[i].V : 1;
+
+        component->H = mapping->transpose ? V : H;
+        component->V = mapping->transpose ? H : V;
+        component->Tq = src->component[i].Tq;
+        component->Td = src->component[i].Td;
+        component->Ta = src->component[i].Ta;
+
+        max_H = (component->H > max_H) ? component->H : max_H;
+        max_V = (component->V > max_V) ? component->V : max_V;
+    }
+
+    dst->max_H = max_H;
+    dst->max_V = max_V;
+
+    /* the quantization steps go with their coefficients */
+    for (int i = 0; i < 4; ++i)
+    {
+        uint16_t Q[64];
+
+        for (int k = 0; k < 64; ++k)
+        {
+            Q[k] = src->qtable[i].Q[mapping->transpose ? (k % 8) * 8 + k / 8 : k];
+        }
+
+        update_qtable(&dst->qtable[i], src->qtable[i].Pq, Q);
+    }
+
+    /* the Huffman tables of the input file, unless they are optimized */
+    for (int j = 0; j < 2; ++j)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            if (src->htable_custom[j][i])
+            {
+                dst->htable[j][i] = src->htable[j][i];
+
+                set_htable(dst, j, i);
+            }
+        }
+    }
+
+    dst->coefficients = 1;
+
+    err = compute_no_blocks_and_alloc_buffers(dst);
+    RETURN_IF(err);
+
+    /* raster order, k = 8 v + u */
+    int perm[64], sign[64];
+
+    for (int v = 0; v < 8; ++v)
+    {
+        for (int u = 0; u < 8; ++u)
+        {
+            perm[8 * v + u] = mapping->transpose ? 8 * u + v : 8 * v + u;
+            sign[8 * v + u] = ((mapping->flip_x && (u & 1)) ^ (mapping->flip_y && (v & 1))) ? -1 : +1;
+        }
+    }
+
+    for (int i = 0; i < dst->Nf; ++i)
+    {
+        struct component *component = &dst->component[i];
+
+        TRACE(dst, "Transforming component %i...\n", i);
+
+        /* in blocks of the transformed component */
+        size_t origin_x = x0 / mcu_x * component->H;
+        size_t origin_y = y0 / mcu_y * component->V;
+        size_t b_x = ceil_div(X, mcu_x) * component->H;
+        size_t b_y = ceil_div(Y, mcu_y) * component->V;
+
+        transform_component(src, mapping, &src->component[i], component, perm, sign, origin_x, origin_y, b_x, b_y);
+
+        size_t blocks = component->b_x * component->b_y;
+
+        for (size_t b = 0; b < blocks; ++b)
+        {
+            if (!block_in_range(&component->int_buffer[b]))
+            {
+                TRACE_ERROR(dst, "Coefficient out of range!\n");
+                return RET_FAILURE_FILE_UNSUPPORTED;
+            }
+        }
+    }
+
+    return RET_SUCCESS;
+}
+
+void requantize_coefficients(struct context *context, int q)
+{
+    assert(context != NULL);
+
+    /* the standard table of each destination, chosen by the components using it (luminance if Y shares it with the chroma) */
+    const unsigned int *Q_ref[4] = { NULL, NULL, NULL, NULL };
+
+    for (int i = 0; i < context->Nf; ++i)
+    {
+        uint8_t Tq = context->component[i].Tq;
+
+        /* Cb, Cr of YCbCr and YCCK */
+        int chroma = context->Nf >= 3 && (i == 1 || i == 2);
+
+        if (Q_ref[Tq] == NULL || !chroma)
+        {
+            Q_ref[Tq] = chroma ? std_chrominance_quant_tbl : std_luminance_quant_tbl;
+        }
+    }
+
+    /* the new steps, raster order */
+    uint16_t Q[4][64];
+
+    for (int i = 0; i < 4; ++i)
+    {
+        struct qtable qtable;
+
+        init_qtable(&qtable);
+
+        /* an unused table is kept */
+        if (Q_ref[i] != NULL)
+        {
+            set_qtable(&qtable, Q_ref[i], q);
+        }
+
+        for (int k = 0; k < 64; ++k)
+        {
+            Q[i][k] = qtable.Q[k] > context->qtable[i].Q[k] ? qtable.Q[k] : context->qtable[i].Q[k];
+        }
+    }
+
+    for (int i = 0; i < context->Nf; ++i)
+    {
+        struct component *component = &context->component[i];
+
+        const uint16_t *Q_in = context->qtable[component->Tq].Q;
+        const uint16_t *Q_out = Q[component->Tq];
+
+        TRACE(context, "Requantizing component %i...\n", i);
+
+        size_t blocks = component->b_x * component->b_y;
+
+        for (size_t b = 0; b < blocks; ++b)
+        {
+            struct int_block *int_block = &component->int_buffer[b];
+
+            for (int k = 0; k < 64; ++k)
+            {
+                if (Q_in[k] == Q_out[k])
+                {
+                    continue;
+                }
+
+                /* dequantized, then rounded to the nearest step; a tie is as close to either step across the
+                 * reconstruction interval of the input, so the smaller one (fewer bits) is taken */
+                int32_t c = int_block->c[k] * (int32_t)Q_in[k];
+                int32_t a = c < 0 ? -c : c;
+
+                a = (2 * a + Q_out[k] - 1) / (2 * Q_out[k]);
+
+                int_block->c[k] = c < 0 ? -a : a;
+            }
+        }
+    }
+
+    for (int i = 0; i < 4; ++i)
+    {
+        uint8_t Pq = 0;
+
+        for (int k = 0; k < 64; ++k)
+        {
+            if (Q[i][k] > 255)
+            {
+                Pq = 1;
+            }
+        }
+
+        update_qtable(&context->qtable[i], Pq, Q[i]);
+    }
+}
+
+/* the mean of the visible samples (x_i by y_i in the component) of the block */
+static float block_mean(struct component *component, struct qtable *qtable, size_t block_x, size_t block_y, size_t x_i, size_t y_i, int shift)
+{
+    struct int_block *int_block = &component->int_buffer[block_y * component->b_x + block_x];
+
+    size_t w = x_i > 8 * block_x ? x_i - 8 * block_x : 0;
+    size_t h = y_i > 8 * block_y ? y_i - 8 * block_y : 0;
+
+    /* the DC coefficient is 8 times the mean of the block */
+    if ((w >= 8 && h >= 8) || w == 0 || h == 0)
+    {
+        return (float)int_block->c[0] * qtable->dequant[0] / 8.f + (float)shift;
+    }
+
+    /* the padding of an edge block may hold anything, these few blocks are reconstructed */
+    struct flt_block flt_block;
+
+    dequantize_block(int_block, &flt_block, qtable);
+
+    inverse_dct_block(&flt_block, shift);
+
+    w = w < 8 ? w : 8;
+    h = h < 8 ? h : 8;
+
+    float sum = 0.f;
+
+    for (size_t v = 0; v < h; ++v)
+    {
+        for (size_t u = 0; u < w; ++u)
+        {
+            sum += flt_block.c[v * 8 + u];
+        }
+    }
+
+    return sum / (float)(w * h);
+}
+
+int downscale_coefficients(struct context *src, struct context *dst, int q)
+{
+    int err;
+
+    assert(src != NULL);
+    assert(dst != NULL);
+
+    err = reset_context(dst);
+    RETURN_IF(err);
+
+    dst->crop_x = 0;
+    dst->crop_y = 0;
+    dst->crop_w = 0;
+    dst->crop_h = 0;
+
+    dst->P = src->P;
+    dst->X = (uint16_t)ceil_div(src->X, 8);
+    dst->Y = (uint16_t)ceil_div(src->Y, 8);
+
+    TRACE(dst, "Downscaled frame: X = %" PRIu16 ", Y = %" PRIu16 "\n", dst->X, dst->Y);
+
+    for (int i = 0; i < src->Nf; ++i)
+    {
+        struct component *component;
+
+        err = add_component(dst, src->component[i].C, &component);
+        RETURN_IF(err);
+
+        component->H = src->component[i].H;
+        component->V = src->component[i].V;
+
+        /* the tables of the encoder: Y, then Cb/Cr */
+        component->Tq = i == 0 ? 0 : 1;
+        component->Td = component->Tq;
+        component->Ta = component->Tq;
+    }
+
+    dst->max_H = src->max_H;
+    dst->max_V = src->max_V;
+
+    set_qtable(&dst->qtable[0], std_luminance_quant_tbl, q);
+    set_qtable(&dst->qtable[1], std_chrominance_quant_tbl, q);
+
+    err = compute_no_blocks_and_alloc_buffers(dst);
+    RETURN_IF(err);
+
+    int shift = 1 << (src->P - 1);
+
+    for (int i = 0; i < dst->Nf; ++i)
+    {
+        struct component *in = &src->component[i];
+        struct component *out = &dst->component[i];
+
+        /* A.1.1 the samples of the component */
+        size_t x_i = ceil_div((size_t)src->X * in->H, src->max_H);
+        size_t y_i = ceil_div((size_t)src->Y * in->V, src->max_V);
+
+        size_t c_x = out->b_x * 8;
+        size_t c_y = out->b_y * 8;
+
+        /* a sample per block */
+        for (size_t y = 0; y < in->b_y; ++y)
+        {
+            for (size_t x = 0; x < in->b_x; ++x)
+            {
+                out->frame_buffer[y * c_x + x] = block_mean(in, &src->qtable[in->Tq], x, y, x_i, y_i, shift);
+            }
+        }
+
+        /* the edge repeated into the padding */
+        for (size_t y = 0; y < c_y; ++y)
+        {
+            size_t y_in = y < in->b_y ? y : in->b_y - 1;
+
+            for (size_t x = 0; x < c_x; ++x)
+            {
+                if (y != y_in || x >= in->b_x)
+                {
+                    out->frame_buffer[y * c_x + x] = out->frame_buffer[y_in * c_x + (x < in->b_x ? x : in->b_x - 1)];
+                }
+            }
+        }
+    }
+
+    err = conv_frame_to_blocks(dst);
+    RETURN_IF(err);
+
+    err = forward_dct(dst);
+    RETURN_IF(err);
+
+    err = quantize(dst);
+    RETURN_IF(err);
+
+    return RET_SUCCESS;
+}
+
+/* SOI .. EOI of the transformed coefficients, the run lengths change with a transposition, the DC differences with a crop */
+static int produce_transcoded(struct context *context, struct sink *sink, const struct transcode_params *params, const struct sink *segments)
+{
+    struct params encode_params;
+
+    init_params(&encode_params);
+
+    encode_params.optimize = params->optimize;
+    encode_params.Ri = context->Ri;
+
+    encode_params.segments = segments->data;
+    encode_params.segments_size = segments->size;
+
+    return produce_codestream(context, sink, &encode_params);
+}
+
+int transcode_stream(FILE *stream, struct context *context, struct sink *sink, const struct transcode_params *params)
+{
+    int err;
+
+    assert(context != NULL);
+    assert(params != NULL);
+
+    if (params->transform < JPEGM_TRANSFORM_NONE || params->transform > JPEGM_TRANSFORM_ROT_270)
+    {
+        return RET_FAILURE_LOGIC_ERROR;
+    }
+
+    struct sink segments;
+
+    init_sink_memory(&segments);
+
+    struct context *target = NULL;
+
+    if (params->copy)
+    {
+        long start = ftell(stream);
+
+        err = read_segments(stream, &segments);
+
+        if (err)
+        {
+            goto end;
+        }
+
+        TRACE(context, "Copied: %zu bytes of APPn/COM segments\n", segments.size);
+
+        if (fseek(stream, start, SEEK_SET) != 0)
+        {
+            err = RET_FAILURE_FILE_SEEK;
+            goto end;
+        }
+    }
+
+    if (params->crop_w != 0)
+    {
+        err = source_crop(stream, context, params);
+
+        if (err)
+        {
+            goto end;
+        }
+    }
+
+    err = read_coefficients(stream, context);
+
+    if (err)
+    {
+        goto end;
+    }
+
+    target = malloc(sizeof(struct context));
+
+    if (target == NULL)
+    {
+        err = RET_FAILURE_MEMORY_ALLOCATION;
+        goto end;
+    }
+
+    err = init_context(target);
+
+    if (err)
+    {
+        goto end;
+    }
+
+    target->pool = context->pool;
+    target->verbose = context->verbose;
+
+    err = transform_coefficients(context, target, params);
+
+    if (err)
+    {
+        goto end;
+    }
+
+    struct context *result = target;
+
+    if (params->downscale)
+    {
+        struct params defaults;
+
+        init_params(&defaults);
+
+        /* the input is no longer needed, its context holds the preview */
+        err = downscale_coefficients(target, context, params->quality > 0 ? params->quality : defaults.q);
+
+        if (err)
+        {
+            goto end;
+        }
+
+        result = context;
+    }
+    else if (params->quality > 0)
+    {
+        requantize_coefficients(target, params->quality);
+    }
+
+    err = produce_transcoded(result, sink, params, &segments);
+end:
+    if (target != NULL)
+    {
+        free_context(target);
+    }
+
+    free(target);
+
+    free_sink(&segments);
+
+    return err;
+}
@@ -0,0 +1,51 @@
+#ifndef JPEG_TRANSCODE_H
+#define JPEG_TRANSCODE_H
+
+#include <stdio.h>
+#include "common.h"
+#include "io.h"
+#include "jpegm.h"
+
+/* transcoding parameters (the command line of jpegmtran) */
+struct transcode_params
+{
+    /* JPEGM_TRANSFORM_* */
+    int transform;
+
+    /* the rectangle of the transformed image to keep (crop_w == 0 = all of it), its upper-left corner is moved to the MCU grid */
+    uint16_t crop_x, crop_y, crop_w, crop_h;
+
+    /* optimized Huffman tables, otherwise those of the input file (if they code every symbol) */
+    int optimize;
+
+    /* copy the APPn and COM segments of the input file */
+    int copy;
+
+    /* requantize to the tables of this quality 1..100, 0 = keep the quantization of the input */
+    int quality;
+
+    /* a 1/8-size image from the DC coefficients, coded anew at the quality (that of the encoder if 0) */
+    int downscale;
+};
+
+void init_transcode_params(struct transcode_params *params);
+
+/* the APPn and COM segments before the first scan, marker included, into the sink */
+int read_segments(FILE *stream, struct sink *segments);
+
+/* the quantized coefficients of the image (of the context->crop_* window) into the context, no samples are reconstructed */
+int read_coefficients(FILE *stream, struct context *context);
+
+/* the frame and the coefficients of src transformed and cropped into dst (an initialized context) */
+int transform_coefficients(struct context *src, struct context *dst, const struct transcode_params *params);
+
+/* the coefficients of the context quantized again with the standard tables of the quality q, no step gets finer than in the input */
+void requantize_coefficients(struct context *context, int q);
+
+/* the 1/8-size image of the DC coefficients of src into dst (reset first), through the FDCT of the encoder at the quality q */
+int downscale_coefficients(struct context *src, struct context *dst, int q);
+
+/* decode the JPEG stream into an initialized context (the entropy layer only), transform it and code it again into the sink */
+int transcode_stream(FILE *stream, struct context *context, struct sink *sink, const struct transcode_params *params);
+
+#endif
@@ -0,0 +1,233 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include "common.h"
+#include "transcode.h"
+#include "pool.h"
+#include "hcache.h"
+
+int process_stream(FILE *i_stream, struct sink *sink, struct transcode_params *params, int threads)
+{
+    int err;
+
+    struct context *context = malloc(sizeof(struct context));
+
+    if (context == NULL)
+    {
+        return RET_FAILURE_MEMORY_ALLOCATION;
+    }
+
+    err = init_context(context);
+
+    if (err)
+    {
+        goto end;
+    }
+
+    context->verbose = 1;
+
+    /* 0 = all processors */
+    if (threads >= 0)
+    {
+        err = pool_create(&context->pool, threads);
+
+        if (err)
+        {
+            goto end;
+        }
+    }
+
+    err = transcode_stream(i_stream, context, sink, params);
+
+    if (err)
+    {
+        goto end;
+    }
+
+    err = sink_flush(sink);
+
+    if (err)
+    {
+        goto end;
+    }
+
+    /* the size of the input and of the output */
+    if (fseek(i_stream, 0, SEEK_END) == 0)
+    {
+        long size = ftell(i_stream);
+
+        if (size > 0)
+        {
+            printf("Size: %ld -> %zu bytes (%+.1f%%)\n", size, sink_tell(sink), 100. * ((double)sink_tell(sink) - (double)size) / (double)size);
+        }
+    }
+end:
+    pool_destroy(context->pool);
+
+    free_context(context);
+
+    free(context);
+
+    hcache_clear();
+
+    return err;
+}
+
+/* 90, 180 or 270 degrees clockwise */
+int parse_rotate(const char *arg, int *transform)
+{
+    switch (atoi(arg))
+    {
+    case 90:
+        *transform = JPEGM_TRANSFORM_ROT_90;
+        return RET_SUCCESS;
+    case 180:
+        *transform = JPEGM_TRANSFORM_ROT_180;
+        return RET_SUCCESS;
+    case 270:
+        *transform = JPEGM_TRANSFORM_ROT_270;
+        return RET_SUCCESS;
+    default:
+        return RET_FAILURE_LOGIC_ERROR;
+    }
+}
+
+/* horizontal (left to right) or vertical (top to bottom) */
+int parse_flip(const char *arg, int *transform)
+{
+    if (strcmp(arg, "horizontal") == 0 || strcmp(arg, "h") == 0)
+    {
+        *transform = JPEGM_TRANSFORM_FLIP_H;
+        return RET_SUCCESS;
+    }
+
+    if (strcmp(arg, "vertical") == 0 || strcmp(arg, "v") == 0)
+    {
+        *transform = JPEGM_TRANSFORM_FLIP_V;
+        return RET_SUCCESS;
+    }
+
+    return RET_FAILURE_LOGIC_ERROR;
+}
+
+int main(int argc, char *argv[])
+{
+    struct transcode_params params;
+
+    init_transcode_params(&params);
+
+    int opt;
+
+    int threads = -1;
+
+    int err = RET_SUCCESS;
+
+    static const struct option long_options[] =
+    {
+        { "rotate", required_argument, NULL, 'r' },
+        { "flip", required_argument, NULL, 'f' },
+        { "transpose", no_argument, NULL, 't' },
+        { "transverse", no_argument, NULL, 'T' },
+        { "crop", required_argument, NULL, 'x' },
+        { "downscale", no_argument, NULL, 'd' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "r:f:tTx:do:c:q:j:", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'x':
+            if (sscanf(optarg, "%" SCNu16 ",%" SCNu16 ",%" SCNu16 ",%" SCNu16, &params.crop_x, &params.crop_y, &params.crop_w, &params.crop_h) != 4)
+            {
+                err = RET_FAILURE_LOGIC_ERROR;
+            }
+            break;
+        case 'o':
+            params.optimize = atoi(optarg);
+            break;
+        case 'c':
+            params.copy = atoi(optarg);
+            break;
+        case 'q':
+            params.quality = atoi(optarg);
+            break;
+        case 'd':
+            params.downscale = 1;
+            break;
+        case 'r':
+            err = parse_rotate(optarg, &params.transform);
+            break;
+        case 'f':
+            err = parse_flip(optarg, &params.transform);
+            break;
+        case 't':
+            params.transform = JPEGM_TRANSFORM_TRANSPOSE;
+            break;
+        case 'T':
+            params.transform = JPEGM_TRANSFORM_TRANSVERSE;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        default:
+            err = RET_FAILURE_LOGIC_ERROR;
+        }
+
+        if (err)
+        {
+            fprintf(stderr, "Usage: %s [-r|--rotate 90|180|270] [-f|--flip horizontal|vertical] [-t|--transpose] [-T|--transverse] [-x|--crop x,y,width,height] [-d|--downscale] [-o value] [-c value] [-q quality] [-j threads] input.jpg output.jpg\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    const char *i_path = optind + 0 < argc ? argv[optind + 0] : "Lenna.jpg";
+    const char *o_path = optind + 1 < argc ? argv[optind + 1] : "output.jpg";
+
+    FILE *i_stream = fopen(i_path, "r");
+
+    if (i_stream == NULL)
+    {
+        fprintf(stderr, "fopen failure\n");
+        return 1;
+    }
+
+    int o_fd = open(o_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+    if (o_fd < 0)
+    {
+        fprintf(stderr, "open failure\n");
+        fclose(i_stream);
+        return 1;
+    }
+
+    struct sink sink;
+
+    err = init_sink_file(&sink, o_fd);
+
+    if (!err)
+    {
+        err = process_stream(i_stream, &sink, &params, threads);
+    }
+
+    free_sink(&sink);
+
+    close(o_fd);
+    fclose(i_stream);
+
+    if (err)
+    {
+        fprintf(stderr, "Failure.\n");
+        return 1;
+    }
+
+    printf("Success.\n");
+
+    return 0;
+}